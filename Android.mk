@@ -7,7 +7,15 @@ include $(CLEAR_VARS)
 BDROID_DIR := $(TOP_DIR)external/bluetooth/bluedroid
 
 LOCAL_SRC_FILES := \
-        bt_vendor_linux.c
+        bt_vendor_linux.c \
+        bt_vendor_mgmt.c \
+        bt_vendor_hci.c \
+        bt_vendor_trace.c \
+        bt_vendor_stats.c \
+        bt_vendor_demux.c \
+        bt_vendor_lpm.c \
+        bt_vendor_caps.c \
+        bt_vendor_fw.c
 
 LOCAL_C_INCLUDES += \
         $(BDROID_DIR)/hci/include
@@ -17,7 +25,7 @@ LOCAL_SHARED_LIBRARIES := \
 
 ifeq ($(strip $(BOARD_USE_CELLULAR_COEX)),true)
     LOCAL_REQUIRED_MODULES += libbtvendorcellcoex-client
-       LOCAL_SRC_FILES += hci_service.c
+       LOCAL_SRC_FILES += hci_service.c hci_cmd_ring.c
        LOCAL_CFLAGS += -DUSE_CELLULAR_COEX
     LOCAL_SHARED_LIBRARIES += \
                libstlport \
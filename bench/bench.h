@@ -0,0 +1,60 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+/* Behaviour of the emulated kernel and controller, in us */
+struct bench_config {
+	/* mgmt command replies on the control channel */
+	int mgmt_delay_us;
+	/* From controller power on to its INDEX_ADDED */
+	int enum_delay_us;
+	/* HCIDEVDOWN ioctl and user channel bind */
+	int devdown_delay_us;
+	int bind_delay_us;
+	/* Command Complete of HCI commands, user channel and coex */
+	int cmd_delay_us;
+	/* Number of HCI commands the controller accepts at once */
+	int cmd_credits;
+	/* ACL packets the controller sends ahead of each Command Complete */
+	int acl_burst;
+};
+
+extern struct bench_config bench_config;
+
+uint64_t bench_now_us(void);
+void bench_sleep_us(int us);
+
+/* bench_kernel.c */
+int bench_kernel_start(void);
+void bench_kernel_stop(void);
+/*
+ * Radio state, the controller index shows up enum_delay_us after power on.
+ * Powering off hangs up the user channels bound to it.
+ */
+void bench_kernel_power(int index, int on);
+/* User channel binds so far */
+int bench_kernel_binds(void);
+
+/* bench_stubs.c */
+int bench_property_parse(const char *arg);
+
+#endif /* BENCH_H */
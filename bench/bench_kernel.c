@@ -0,0 +1,663 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * Emulated Bluetooth kernel interface. socket(), bind(), ioctl(), dup2()
+ * and close() are wrapped at link time: Bluetooth sockets become one end
+ * of a socketpair whose other end is served by the emulation thread.
+ * Control channel sockets get mgmt replies and index events, user channel
+ * sockets get Command Complete events, each after a configurable delay
+ * and optionally behind a burst of ACL data. As in the kernel, binding a
+ * user channel takes its index off mgmt until the socket is released.
+ */
+
+#define LOG_TAG "bench_kernel"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <utils/Log.h>
+
+#include "bt_vendor_linux.h"
+#include "bench.h"
+
+#define IOCTL_HCIDEVDOWN	_IOW('H', 202, int)
+
+#define KERNEL_FD_MAX		1024
+#define KERNEL_PEERS_MAX	16
+#define KERNEL_QUEUE_MAX	1024
+#define KERNEL_INDEX_MAX	4
+#define KERNEL_PKT_MAX		80
+
+enum {
+	SOCK_NONE,
+	SOCK_UNBOUND,
+	SOCK_CONTROL,
+	SOCK_USER,
+};
+
+/* Library side of an emulated socket, indexed by its fd */
+struct kernel_sock {
+	int type;
+	int peer;
+	int index;
+};
+
+/* Emulation side, polled by the kernel thread */
+struct kernel_peer {
+	int fd;
+	int type;
+	int index;
+};
+
+/* Packet to deliver to a peer once due */
+struct kernel_pkt {
+	uint64_t due;
+	int fd;
+	int len;
+	uint8_t data[KERNEL_PKT_MAX];
+};
+
+static struct kernel_sock socks[KERNEL_FD_MAX];
+static struct kernel_peer peers[KERNEL_PEERS_MAX];
+static int num_peers;
+static struct kernel_pkt queue[KERNEL_QUEUE_MAX];
+static int queue_len;
+/* Time each controller index comes up, 0 while powered off */
+static uint64_t index_up_at[KERNEL_INDEX_MAX];
+static int user_binds;
+
+static pthread_mutex_t kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t kernel_thread;
+static int kernel_wake_fd = -1;
+static volatile int kernel_running;
+
+int __real_socket(int domain, int type, int protocol);
+int __real_bind(int fd, const struct sockaddr *addr, socklen_t len);
+int __real_ioctl(int fd, unsigned long request, ...);
+int __real_dup2(int oldfd, int newfd);
+int __real_close(int fd);
+
+static void kernel_wake(void)
+{
+	uint64_t one = 1;
+
+	if (write(kernel_wake_fd, &one, sizeof(one)) < 0)
+		ALOGW("Unable to wake the kernel thread");
+}
+
+/* Called with kernel_lock held */
+static int kernel_index_present(int index)
+{
+	if (index < 0 || index >= KERNEL_INDEX_MAX || !index_up_at[index])
+		return 0;
+
+	return bench_now_us() >= index_up_at[index];
+}
+
+/* Called with kernel_lock held */
+static int kernel_index_bound(int index)
+{
+	int i;
+
+	for (i = 0; i < KERNEL_FD_MAX; i++) {
+		if (socks[i].type == SOCK_USER && socks[i].index == index)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Called with kernel_lock held */
+static void kernel_queue(int fd, int delay_us, const void *data, int len)
+{
+	struct kernel_pkt *pkt;
+
+	if (queue_len == KERNEL_QUEUE_MAX || len > KERNEL_PKT_MAX) {
+		ALOGE("Dropping packet for %d", fd);
+		return;
+	}
+
+	pkt = &queue[queue_len++];
+	pkt->due = bench_now_us() + delay_us;
+	pkt->fd = fd;
+	pkt->len = len;
+	memcpy(pkt->data, data, len);
+}
+
+/* Called with kernel_lock held */
+static void kernel_queue_index_event(int fd, uint16_t opcode, int index,
+				     int delay_us)
+{
+	struct mgmt_pkt ev;
+
+	ev.opcode = opcode;
+	ev.index = index;
+	ev.len = 0;
+	kernel_queue(fd, delay_us, &ev, MGMT_HDR_SIZE);
+}
+
+/* Called with kernel_lock held */
+static void kernel_index_event(uint16_t opcode, int index, int delay_us)
+{
+	int i;
+
+	for (i = 0; i < num_peers; i++) {
+		if (peers[i].type == SOCK_CONTROL)
+			kernel_queue_index_event(peers[i].fd, opcode, index, delay_us);
+	}
+}
+
+/* Called with kernel_lock held, sock is a descriptor being closed */
+static void kernel_sock_release(struct kernel_sock *sock)
+{
+	/* Back to mgmt, unless unplugged meanwhile */
+	if (sock->type == SOCK_USER && sock->index >= 0)
+		kernel_index_event(MGMT_EV_INDEX_ADDED, sock->index, 0);
+
+	sock->type = SOCK_NONE;
+}
+
+/* Called with kernel_lock held */
+static void kernel_mgmt_reply(int fd, uint16_t cmd, uint16_t index,
+			      const void *param, int plen)
+{
+	struct mgmt_pkt ev;
+
+	ev.opcode = MGMT_EV_COMMAND_COMP;
+	ev.index = index;
+	ev.len = 3 + plen;
+	ev.data[0] = cmd & 0xff;
+	ev.data[1] = cmd >> 8;
+	ev.data[2] = 0;
+	memcpy(ev.data + 3, param, plen);
+
+	kernel_queue(fd, bench_config.mgmt_delay_us, &ev, MGMT_HDR_SIZE + 3 + plen);
+}
+
+/* Called with kernel_lock held */
+static void kernel_handle_mgmt(int fd, const struct mgmt_pkt *cmd, int len)
+{
+	uint8_t param[2 + 2 * KERNEL_INDEX_MAX];
+	uint8_t addr[6] = { 0x00, 0x00, 0x00, 0x00, 0x5a, 0x00 };
+	int i, num = 0;
+
+	if (len < MGMT_HDR_SIZE)
+		return;
+
+	switch (cmd->opcode) {
+	case MGMT_OP_INDEX_LIST:
+		for (i = 0; i < KERNEL_INDEX_MAX; i++) {
+			if (!kernel_index_present(i) || kernel_index_bound(i))
+				continue;
+			param[2 + 2 * num] = i;
+			param[3 + 2 * num] = 0;
+			num++;
+		}
+		param[0] = num;
+		param[1] = 0;
+		kernel_mgmt_reply(fd, cmd->opcode, HCI_DEV_NONE, param, 2 + 2 * num);
+		break;
+
+	case MGMT_OP_READ_INFO:
+		addr[0] = cmd->index;
+		kernel_mgmt_reply(fd, cmd->opcode, cmd->index, addr, sizeof(addr));
+		break;
+	}
+}
+
+/* Called with kernel_lock held */
+static void kernel_handle_hci(int fd, const uint8_t *cmd, int len)
+{
+	uint8_t acl[64];
+	uint8_t ev[KERNEL_PKT_MAX];
+	uint16_t opcode;
+	int i, plen = 0;
+
+	if (len < 4 || cmd[0] != HCI_COMMAND_PKT)
+		return;
+
+	/* Incoming data delivered right ahead of the event */
+	memset(acl, 0, sizeof(acl));
+	acl[0] = HCI_ACLDATA_PKT;
+	acl[1] = 0x01;
+	acl[2] = 0x20;
+	acl[3] = sizeof(acl) - 5;
+	for (i = 0; i < bench_config.acl_burst; i++)
+		kernel_queue(fd, bench_config.cmd_delay_us, acl, sizeof(acl));
+
+	/* Return parameters after the status, everything supported */
+	opcode = cmd[1] | (cmd[2] << 8);
+	switch (opcode) {
+	case HCI_OP_READ_LOCAL_VERSION:
+		plen = 8;
+		memset(ev + 7, 0, plen);
+		ev[7] = 9;
+		ev[11] = 2;
+		break;
+	case HCI_OP_READ_LOCAL_COMMANDS:
+		plen = 64;
+		memset(ev + 7, 0xff, plen);
+		break;
+	case HCI_OP_READ_LOCAL_FEATURES:
+		plen = 8;
+		memset(ev + 7, 0xff, plen);
+		break;
+	case HCI_OP_READ_BUFFER_SIZE:
+		plen = 7;
+		ev[7] = 1021 & 0xff;
+		ev[8] = 1021 >> 8;
+		ev[9] = 64;
+		ev[10] = 8;
+		ev[11] = 0;
+		ev[12] = 8;
+		ev[13] = 0;
+		break;
+	case HCI_OP_READ_BD_ADDR:
+		plen = 6;
+		memset(ev + 7, 0x5a, plen);
+		break;
+	}
+
+	ev[0] = HCI_EVENT_PKT;
+	ev[1] = HCI_EV_CMD_COMPLETE;
+	ev[2] = 4 + plen;
+	ev[3] = bench_config.cmd_credits;
+	ev[4] = cmd[1];
+	ev[5] = cmd[2];
+	ev[6] = 0;
+
+	kernel_queue(fd, bench_config.cmd_delay_us, ev, 7 + plen);
+}
+
+/* Called with kernel_lock held */
+static void kernel_queue_drop(int fd)
+{
+	int j, k;
+
+	for (j = 0, k = 0; j < queue_len; j++) {
+		if (queue[j].fd != fd)
+			queue[k++] = queue[j];
+	}
+	queue_len = k;
+}
+
+/* Called with kernel_lock held */
+static void kernel_peer_remove(int i)
+{
+	kernel_queue_drop(peers[i].fd);
+
+	__real_close(peers[i].fd);
+	peers[i] = peers[--num_peers];
+}
+
+static void *kernel_thread_main(void *param)
+{
+	struct pollfd fds[KERNEL_PEERS_MAX + 1];
+	struct kernel_peer polled[KERNEL_PEERS_MAX];
+	union {
+		struct mgmt_pkt mgmt;
+		uint8_t hci[HCI_MAX_FRAME_SIZE];
+	} buf;
+	uint64_t now, next, count;
+	int i, j, n, num, timeout;
+
+	(void)param;
+
+	while (kernel_running) {
+		pthread_mutex_lock(&kernel_lock);
+		num = num_peers;
+		memcpy(polled, peers, num * sizeof(*peers));
+		next = UINT64_MAX;
+		for (i = 0; i < queue_len; i++) {
+			if (queue[i].due < next)
+				next = queue[i].due;
+		}
+		pthread_mutex_unlock(&kernel_lock);
+
+		fds[0].fd = kernel_wake_fd;
+		fds[0].events = POLLIN;
+		for (i = 0; i < num; i++) {
+			fds[i + 1].fd = polled[i].fd;
+			fds[i + 1].events = POLLIN;
+		}
+
+		now = bench_now_us();
+		if (next == UINT64_MAX)
+			timeout = -1;
+		else if (next <= now)
+			timeout = 0;
+		else
+			timeout = (next - now + 999) / 1000;
+
+		n = poll(fds, num + 1, timeout);
+		if (n < 0 && errno != EINTR) {
+			ALOGE("poll: %s", strerror(errno));
+			break;
+		}
+
+		if (n > 0 && (fds[0].revents & POLLIN)) {
+			if (read(kernel_wake_fd, &count, sizeof(count)) < 0)
+				ALOGW("Unable to read wake event");
+		}
+
+		pthread_mutex_lock(&kernel_lock);
+
+		for (i = 0; n > 0 && i < num; i++) {
+			if (!fds[i + 1].revents)
+				continue;
+
+			while ((j = recv(polled[i].fd, &buf, sizeof(buf),
+					 MSG_DONTWAIT)) > 0) {
+				if (polled[i].type == SOCK_CONTROL)
+					kernel_handle_mgmt(polled[i].fd, &buf.mgmt, j);
+				else
+					kernel_handle_hci(polled[i].fd, buf.hci, j);
+			}
+
+			if (j == 0 || (errno != EAGAIN && errno != EINTR)) {
+				/* Closed by the library */
+				for (j = 0; j < num_peers; j++) {
+					if (peers[j].fd == polled[i].fd) {
+						kernel_peer_remove(j);
+						break;
+					}
+				}
+			}
+		}
+
+		/* In queueing order, ACL bursts stay ahead of their event */
+		now = bench_now_us();
+		for (i = 0, j = 0; i < queue_len; i++) {
+			if (queue[i].due > now) {
+				queue[j++] = queue[i];
+				continue;
+			}
+			if (send(queue[i].fd, queue[i].data, queue[i].len,
+				 MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+				ALOGW("Unable to deliver packet: %s", strerror(errno));
+		}
+		queue_len = j;
+
+		pthread_mutex_unlock(&kernel_lock);
+	}
+
+	return NULL;
+}
+
+int bench_kernel_start(void)
+{
+	kernel_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (kernel_wake_fd < 0)
+		return -1;
+
+	kernel_running = 1;
+	if (pthread_create(&kernel_thread, NULL, kernel_thread_main, NULL)) {
+		__real_close(kernel_wake_fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+void bench_kernel_stop(void)
+{
+	int i;
+
+	kernel_running = 0;
+	kernel_wake();
+	pthread_join(kernel_thread, NULL);
+
+	for (i = num_peers - 1; i >= 0; i--)
+		kernel_peer_remove(i);
+	queue_len = 0;
+
+	__real_close(kernel_wake_fd);
+	kernel_wake_fd = -1;
+}
+
+void bench_kernel_power(int index, int on)
+{
+	int i;
+
+	if (index < 0 || index >= KERNEL_INDEX_MAX)
+		return;
+
+	pthread_mutex_lock(&kernel_lock);
+
+	if (on && !index_up_at[index]) {
+		index_up_at[index] = bench_now_us() + bench_config.enum_delay_us;
+		kernel_index_event(MGMT_EV_INDEX_ADDED, index,
+				   bench_config.enum_delay_us);
+	} else if (!on && index_up_at[index]) {
+		index_up_at[index] = 0;
+		kernel_index_event(MGMT_EV_INDEX_REMOVED, index, 0);
+		for (i = 0; i < num_peers; i++) {
+			/* The user channel hangs up, as on a transport reset */
+			if (peers[i].type == SOCK_USER && peers[i].index == index) {
+				kernel_queue_drop(peers[i].fd);
+				shutdown(peers[i].fd, SHUT_RDWR);
+			}
+		}
+		/* The index can be bound again once it comes back */
+		for (i = 0; i < KERNEL_FD_MAX; i++) {
+			if (socks[i].type == SOCK_USER && socks[i].index == index)
+				socks[i].index = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&kernel_lock);
+
+	kernel_wake();
+}
+
+int bench_kernel_binds(void)
+{
+	int binds;
+
+	pthread_mutex_lock(&kernel_lock);
+	binds = user_binds;
+	pthread_mutex_unlock(&kernel_lock);
+
+	return binds;
+}
+
+static int kernel_emulated(int fd)
+{
+	return fd >= 0 && fd < KERNEL_FD_MAX && socks[fd].type != SOCK_NONE;
+}
+
+int __wrap_socket(int domain, int type, int protocol)
+{
+	int sv[2];
+
+	if (domain != AF_BLUETOOTH)
+		return __real_socket(domain, type, protocol);
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | (type & SOCK_CLOEXEC), 0, sv) < 0)
+		return -1;
+
+	if (sv[0] >= KERNEL_FD_MAX) {
+		__real_close(sv[0]);
+		__real_close(sv[1]);
+		errno = EMFILE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&kernel_lock);
+	socks[sv[0]].type = SOCK_UNBOUND;
+	socks[sv[0]].peer = sv[1];
+	socks[sv[0]].index = -1;
+	pthread_mutex_unlock(&kernel_lock);
+
+	return sv[0];
+}
+
+int __wrap_bind(int fd, const struct sockaddr *addr, socklen_t len)
+{
+	const struct sockaddr_hci *hci = (const struct sockaddr_hci *) addr;
+	struct kernel_sock *sock;
+	int i, ret = 0;
+
+	if (!kernel_emulated(fd))
+		return __real_bind(fd, addr, len);
+
+	if (hci->hci_channel == HCI_CHANNEL_USER)
+		bench_sleep_us(bench_config.bind_delay_us);
+
+	pthread_mutex_lock(&kernel_lock);
+
+	sock = &socks[fd];
+
+	if (sock->type != SOCK_UNBOUND || num_peers == KERNEL_PEERS_MAX) {
+		errno = EBUSY;
+		ret = -1;
+		goto done;
+	}
+
+	switch (hci->hci_channel) {
+	case HCI_CHANNEL_CONTROL:
+		sock->type = SOCK_CONTROL;
+		/* Controllers powered on but not enumerated yet */
+		for (i = 0; i < KERNEL_INDEX_MAX; i++) {
+			if (index_up_at[i] && !kernel_index_present(i))
+				kernel_queue_index_event(sock->peer, MGMT_EV_INDEX_ADDED, i,
+							 index_up_at[i] - bench_now_us());
+		}
+		break;
+
+	case HCI_CHANNEL_USER:
+		if (!kernel_index_present(hci->hci_dev)) {
+			errno = ENODEV;
+			ret = -1;
+			goto done;
+		}
+		if (kernel_index_bound(hci->hci_dev)) {
+			errno = EBUSY;
+			ret = -1;
+			goto done;
+		}
+		sock->type = SOCK_USER;
+		sock->index = hci->hci_dev;
+		kernel_index_event(MGMT_EV_INDEX_REMOVED, sock->index, 0);
+		user_binds++;
+		break;
+
+	default:
+		errno = EINVAL;
+		ret = -1;
+		goto done;
+	}
+
+	peers[num_peers].fd = sock->peer;
+	peers[num_peers].type = sock->type;
+	peers[num_peers].index = sock->index;
+	num_peers++;
+
+done:
+	pthread_mutex_unlock(&kernel_lock);
+
+	if (!ret)
+		kernel_wake();
+
+	return ret;
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...)
+{
+	void *arg;
+	va_list ap;
+	int ret = 0;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (!kernel_emulated(fd))
+		return __real_ioctl(fd, request, arg);
+
+	if (request != IOCTL_HCIDEVDOWN) {
+		errno = ENOTTY;
+		return -1;
+	}
+
+	bench_sleep_us(bench_config.devdown_delay_us);
+
+	pthread_mutex_lock(&kernel_lock);
+	if (!kernel_index_present((int)(intptr_t) arg)) {
+		errno = ENODEV;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&kernel_lock);
+
+	return ret;
+}
+
+int __wrap_dup2(int oldfd, int newfd)
+{
+	int peer = -1;
+	int ret;
+
+	if (!kernel_emulated(oldfd) || newfd < 0 || newfd >= KERNEL_FD_MAX)
+		return __real_dup2(oldfd, newfd);
+
+	/* Closes the socket behind newfd, its peer then sees the hang up */
+	ret = __real_dup2(oldfd, newfd);
+	if (ret < 0)
+		return ret;
+
+	/* The socket state follows the new descriptor */
+	pthread_mutex_lock(&kernel_lock);
+	if (socks[newfd].type == SOCK_UNBOUND)
+		peer = socks[newfd].peer;
+	kernel_sock_release(&socks[newfd]);
+	socks[newfd] = socks[oldfd];
+	socks[oldfd].type = SOCK_NONE;
+	pthread_mutex_unlock(&kernel_lock);
+
+	if (peer >= 0)
+		__real_close(peer);
+
+	return ret;
+}
+
+int __wrap_close(int fd)
+{
+	int peer = -1;
+
+	if (kernel_emulated(fd)) {
+		pthread_mutex_lock(&kernel_lock);
+		/* Bound peers are closed by the kernel thread on hang up */
+		if (socks[fd].type == SOCK_UNBOUND)
+			peer = socks[fd].peer;
+		kernel_sock_release(&socks[fd]);
+		pthread_mutex_unlock(&kernel_lock);
+	}
+
+	if (peer >= 0)
+		__real_close(peer);
+
+	return __real_close(fd);
+}
@@ -0,0 +1,1140 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * Benchmark of libbt-vendor on a host, against the emulated kernel of
+ * bench_kernel.c and a fake stack. Drives BLUETOOTH_VENDOR_LIB_INTERFACE
+ * through power/open/FW_CFG/close cycles, with HCI round trips on the
+ * stack sockets, controller resets and back to back LPM mode changes,
+ * then coex command bursts, urgent and background, background commands
+ * under a continuous urgent load, asynchronous commands whose completion
+ * is lost, and a coex service cleanup with blocked senders. Optionally checks the trace ring dump. Reports latency
+ * percentiles.
+ */
+
+#define LOG_TAG "bench"
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/properties.h>
+#include <utils/Log.h>
+
+#include "bt_vendor_lib.h"
+#include "bt_hci_bdroid.h"
+#include "libbtcellcoex-client.h"
+#include "bt_vendor_linux.h"
+#include "hci_service.h"
+#include "bench.h"
+
+#define FW_CFG_TIMEOUT_US	15000000
+#define XMIT_QUEUE_MAX		64
+#define HCI_RTT_TIMEOUT_MS	1000
+/* Until the stack is told of the recovery */
+#define RECOVERY_TIMEOUT_MS	5000
+/* HCI_Read_Local_Version_Information */
+#define HCI_RTT_OPCODE		0x1001
+/* Intel patch write, each record carries this many bytes */
+#define FW_PATCH_OPCODE		0xfc8e
+#define FW_PATCH_CHUNK		56
+/* Set AFH Host Channel Classification, a coex state command */
+#define AFH_CLASS_OPCODE	0x0c3f
+#define AFH_CLASS_LEN		10
+/* Coex senders left blocked when the service is cleaned up */
+#define BLOCKED_SENDERS_MAX	16
+#define BLOCKED_SENDERS_WAIT_US	20000
+/* Longest wait for the timeout of a lost asynchronous command */
+#define LOST_CMD_WAIT_US	2000000
+/* Urgent senders of the load test, enough to always have some waiting */
+#define LOAD_URGENT_SENDERS	16
+/* Broadcom Write_Sleep_Mode, the LPM command of the check runs */
+#define LPM_SLEEP_MODE_OPCODE	0xfc27
+#define LPM_SLEEP_MODE_LEN	12
+/* Invalid HCI Command Parameters */
+#define HCI_ERR_INVALID_PARAMS	0x12
+/* Largest parameter block of an HCI command */
+#define HCI_CMD_PARAMS_MAX	255
+/* Linux monitor opcodes, as btmon decodes them */
+#define MONITOR_COMMAND_PKT	2
+#define MONITOR_CTRL_EVENT	17
+#define BTSNOOP_HDR_SIZE	16
+#define BTSNOOP_REC_SIZE	24
+
+extern const bt_vendor_interface_t BLUETOOTH_VENDOR_LIB_INTERFACE;
+
+struct bench_config bench_config = {
+	.mgmt_delay_us = 200,
+	.enum_delay_us = 20000,
+	.devdown_delay_us = 1000,
+	.bind_delay_us = 500,
+	.cmd_delay_us = 300,
+	.cmd_credits = 1,
+};
+
+struct samples {
+	const char *name;
+	uint64_t *us;
+	int num;
+	int max;
+	int failures;
+};
+
+/* Commands handed to the fake stack, completed by xmit_thread */
+struct xmit_entry {
+	uint64_t due;
+	uint16_t opcode;
+	uint8_t status;
+	tINT_CMD_CBACK p_cback;
+};
+
+/* Results of an operation completed through a callback, not waited yet */
+struct op_wait {
+	int done;
+	int failed;
+};
+
+static pthread_mutex_t op_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t op_cond = PTHREAD_COND_INITIALIZER;
+static struct op_wait fw_cfg_wait, lpm_wait;
+/* Status of the asynchronous command whose completion got lost */
+static int lost_done, lost_status;
+
+static pthread_mutex_t xmit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t xmit_cond = PTHREAD_COND_INITIALIZER;
+static struct xmit_entry xmit_queue[XMIT_QUEUE_MAX];
+static unsigned int xmit_head, xmit_tail;
+static int xmit_running;
+/* Commands are dropped instead of completed, as by a stuck controller */
+static volatile int xmit_drop;
+/* Commands whose length disagrees with their parameter length */
+static int xmit_malformed;
+static pthread_t xmit_thread;
+
+static int coex_cmds_per_thread;
+/* Distinct channel maps sent by the coex workers, 0 for vendor commands */
+static int coex_afh_maps;
+/* The stack leaves the incoming ACL data unread during round trips */
+static int rtt_acl_unread;
+
+uint64_t bench_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void bench_sleep_us(int us)
+{
+	struct timespec ts;
+
+	if (us <= 0)
+		return;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static void op_done(struct op_wait *w, bt_vendor_op_result_t result)
+{
+	pthread_mutex_lock(&op_lock);
+	w->done++;
+	if (result != BT_VND_OP_RESULT_SUCCESS)
+		w->failed++;
+	pthread_cond_broadcast(&op_cond);
+	pthread_mutex_unlock(&op_lock);
+}
+
+static void fwcfg_cb(bt_vendor_op_result_t result)
+{
+	op_done(&fw_cfg_wait, result);
+}
+
+static void lpm_cb(bt_vendor_op_result_t result)
+{
+	op_done(&lpm_wait, result);
+}
+
+static void result_cb(bt_vendor_op_result_t result)
+{
+	(void)result;
+}
+
+static void *alloc_cb(int size)
+{
+	return malloc(size);
+}
+
+static void dealloc_cb(void *p_buf)
+{
+	free(p_buf);
+}
+
+/* The stack frees transmitted buffers, completions come from xmit_thread */
+static uint8_t xmit_cb(uint16_t opcode, void *p_buf, tINT_CMD_CBACK p_cback)
+{
+	HC_BT_HDR *p_msg = p_buf;
+	uint8_t *p = (uint8_t *)(p_msg + 1) + p_msg->offset;
+	struct xmit_entry *e;
+	uint8_t status = 0;
+
+	if (p_msg->len < 3 || p_msg->len != p[2] + 3)
+		__atomic_fetch_add(&xmit_malformed, 1, __ATOMIC_RELAXED);
+
+	/* Rejected as a controller would, sleep mode 0 or 1 (UART) only */
+	if (opcode == LPM_SLEEP_MODE_OPCODE &&
+	    (p_msg->len != 3 + LPM_SLEEP_MODE_LEN || p[3] > 1))
+		status = HCI_ERR_INVALID_PARAMS;
+
+	if (xmit_drop) {
+		free(p_buf);
+		return TRUE;
+	}
+
+	pthread_mutex_lock(&xmit_lock);
+	if (xmit_tail - xmit_head == XMIT_QUEUE_MAX) {
+		pthread_mutex_unlock(&xmit_lock);
+		return FALSE;
+	}
+	e = &xmit_queue[xmit_tail++ % XMIT_QUEUE_MAX];
+	e->due = bench_now_us() + bench_config.cmd_delay_us;
+	e->opcode = opcode;
+	e->status = status;
+	e->p_cback = p_cback;
+	pthread_cond_signal(&xmit_cond);
+	pthread_mutex_unlock(&xmit_lock);
+
+	free(p_buf);
+
+	return TRUE;
+}
+
+static const bt_vendor_callbacks_t callbacks = {
+	sizeof(bt_vendor_callbacks_t),
+	fwcfg_cb,
+	result_cb,
+	lpm_cb,
+	result_cb,
+	alloc_cb,
+	dealloc_cb,
+	xmit_cb,
+	result_cb,
+};
+
+static void *xmit_thread_main(void *param)
+{
+	struct xmit_entry e;
+	HC_BT_HDR *p_evt;
+	uint8_t *p;
+	uint64_t now;
+
+	(void)param;
+
+	pthread_mutex_lock(&xmit_lock);
+	while (xmit_running) {
+		if (xmit_head == xmit_tail) {
+			pthread_cond_wait(&xmit_cond, &xmit_lock);
+			continue;
+		}
+
+		e = xmit_queue[xmit_head % XMIT_QUEUE_MAX];
+		now = bench_now_us();
+		if (e.due > now) {
+			pthread_mutex_unlock(&xmit_lock);
+			bench_sleep_us(e.due - now);
+			pthread_mutex_lock(&xmit_lock);
+			continue;
+		}
+		xmit_head++;
+		pthread_mutex_unlock(&xmit_lock);
+
+		/* Command Complete: code, length, ncmd, opcode, status */
+		p_evt = malloc(BT_HC_HDR_SIZE + 6);
+		p_evt->event = 0;
+		p_evt->len = 6;
+		p_evt->offset = 0;
+		p_evt->layer_specific = 0;
+		p = (uint8_t *)(p_evt + 1);
+		p[0] = HCI_EV_CMD_COMPLETE;
+		p[1] = 4;
+		p[2] = bench_config.cmd_credits;
+		p[3] = e.opcode & 0xff;
+		p[4] = e.opcode >> 8;
+		p[5] = e.status;
+		e.p_cback(p_evt);
+
+		pthread_mutex_lock(&xmit_lock);
+	}
+	pthread_mutex_unlock(&xmit_lock);
+
+	return NULL;
+}
+
+static void samples_init(struct samples *s, const char *name, int max)
+{
+	s->name = name;
+	s->us = calloc(max, sizeof(*s->us));
+	s->num = 0;
+	s->max = max;
+	s->failures = 0;
+}
+
+static void samples_add(struct samples *s, uint64_t start, int failed)
+{
+	if (s->num < s->max)
+		s->us[s->num++] = bench_now_us() - start;
+	if (failed)
+		s->failures++;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void samples_report(struct samples *s)
+{
+	uint64_t *v = s->us;
+	int n = s->num;
+
+	if (!n) {
+		printf("%-16s no samples\n", s->name);
+		return;
+	}
+
+	qsort(v, n, sizeof(*v), cmp_u64);
+	printf("%-16s n %6d fail %4d  p50 %8llu  p90 %8llu  p99 %8llu  max %8llu us\n",
+	       s->name, n, s->failures,
+	       (unsigned long long) v[n * 50 / 100],
+	       (unsigned long long) v[n * 90 / 100],
+	       (unsigned long long) v[n * 99 / 100],
+	       (unsigned long long) v[n - 1]);
+}
+
+static int op_wait(struct op_wait *w)
+{
+	struct timespec ts;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += FW_CFG_TIMEOUT_US / 1000000;
+
+	pthread_mutex_lock(&op_lock);
+	while (!w->done && ret == 0)
+		ret = pthread_cond_timedwait(&op_cond, &op_lock, &ts);
+	ret = w->done && !w->failed ? 0 : -1;
+	if (w->done)
+		w->done--;
+	if (w->failed)
+		w->failed--;
+	pthread_mutex_unlock(&op_lock);
+
+	return ret;
+}
+
+/*
+ * A real radio takes longer to come back than the emulated one, do not
+ * let the next cycle find the controller still registered, or see the
+ * index the closed user channel gives back to mgmt after it is gone.
+ */
+static void wait_index(int index, int present)
+{
+	uint64_t start = bench_now_us();
+
+	while (mgmt_monitor_index_present(index) != present &&
+	       bench_now_us() - start < 1000000)
+		bench_sleep_us(100);
+}
+
+static int read_full(int fd, uint8_t *buf, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = read(fd, buf, len);
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Command to Command Complete on the sockets given by USERIAL_OPEN, the
+ * way the stack reads them: a single H4 stream, or per channel sockets
+ * with the events served first.
+ */
+static int hci_round_trip(int *fds, int demux, int timeout_ms)
+{
+	uint8_t buf[HCI_MAX_FRAME_SIZE];
+	struct pollfd pfd[2];
+	int n, off = demux ? 1 : 0;
+
+	buf[0] = HCI_COMMAND_PKT;
+	buf[1] = HCI_RTT_OPCODE & 0xff;
+	buf[2] = HCI_RTT_OPCODE >> 8;
+	buf[3] = 0;
+	if (write(fds[CH_CMD], buf + off, 4 - off) != 4 - off)
+		return -1;
+
+	pfd[0].fd = fds[CH_EVT];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fds[CH_ACL_IN];
+	pfd[1].events = POLLIN;
+
+	while (1) {
+		if (poll(pfd, demux && !rtt_acl_unread ? 2 : 1, timeout_ms) <= 0)
+			return -1;
+
+		/* Hung up by a controller reset */
+		if (pfd[0].revents & (POLLERR | POLLHUP))
+			return -1;
+
+		if (!demux) {
+			n = read(fds[CH_EVT], buf, sizeof(buf));
+			if (n <= 0)
+				return -1;
+		} else if (pfd[0].revents) {
+			/* Event code and length, then the parameters */
+			buf[0] = HCI_EVENT_PKT;
+			if (read_full(fds[CH_EVT], buf + 1, 2) ||
+			    read_full(fds[CH_EVT], buf + 3, buf[2]))
+				return -1;
+			n = 3 + buf[2];
+		} else {
+			if (read(fds[CH_ACL_IN], buf, sizeof(buf)) <= 0)
+				return -1;
+			continue;
+		}
+
+		if (n >= 6 && buf[0] == HCI_EVENT_PKT &&
+		    buf[1] == HCI_EV_CMD_COMPLETE &&
+		    (buf[4] | (buf[5] << 8)) == HCI_RTT_OPCODE)
+			return 0;
+	}
+}
+
+/* What the stack left unread on a demultiplexed channel */
+static void channel_drain(int fd)
+{
+	uint8_t buf[HCI_MAX_FRAME_SIZE];
+
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+}
+
+/*
+ * Reset the controller under the stack, the way a USB reset does, and time
+ * until the stack gets a Hardware Error and the controller answers again
+ * on the sockets the stack already holds.
+ */
+static int controller_reset(int *fds)
+{
+	uint8_t evt[2 + 255];
+	struct pollfd pfd;
+
+	bench_kernel_power(0, 0);
+	bench_kernel_power(0, 1);
+
+	pfd.fd = fds[CH_EVT];
+	pfd.events = POLLIN;
+
+	/* Events ahead of it are from the controller that went away */
+	do {
+		if (poll(&pfd, 1, RECOVERY_TIMEOUT_MS) <= 0 ||
+		    read_full(fds[CH_EVT], evt, 2) ||
+		    read_full(fds[CH_EVT], evt + 2, evt[1]))
+			return -1;
+	} while (evt[0] != HCI_EV_HARDWARE_ERROR);
+
+	return hci_round_trip(fds, 1, HCI_RTT_TIMEOUT_MS);
+}
+
+/*
+ * Patch file of num write commands, each answered by its Command Complete.
+ * Returns its path, removed by the caller.
+ */
+static char *fw_patch_create(int num)
+{
+	static char path[] = "/tmp/bt_vendor_bench_XXXXXX";
+	uint8_t rec[4 + FW_PATCH_CHUNK + 7];
+	FILE *f;
+	int fd, i;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return NULL;
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		return NULL;
+	}
+
+	rec[0] = HCI_COMMAND_PKT;
+	rec[1] = FW_PATCH_OPCODE & 0xff;
+	rec[2] = FW_PATCH_OPCODE >> 8;
+	rec[3] = FW_PATCH_CHUNK;
+	memset(rec + 4, 0xa5, FW_PATCH_CHUNK);
+	rec[4 + FW_PATCH_CHUNK] = 0x02;
+	rec[5 + FW_PATCH_CHUNK] = HCI_EV_CMD_COMPLETE;
+	rec[6 + FW_PATCH_CHUNK] = 4;
+	rec[7 + FW_PATCH_CHUNK] = 1;
+	rec[8 + FW_PATCH_CHUNK] = FW_PATCH_OPCODE & 0xff;
+	rec[9 + FW_PATCH_CHUNK] = FW_PATCH_OPCODE >> 8;
+	rec[10 + FW_PATCH_CHUNK] = 0;
+
+	for (i = 0; i < num; i++)
+		fwrite(rec, sizeof(rec), 1, f);
+
+	if (fclose(f)) {
+		unlink(path);
+		return NULL;
+	}
+
+	return path;
+}
+
+struct coex_worker {
+	pthread_t thread;
+	int id;
+	int cls;
+	int cmds;
+	/* When set, sends until it is non zero instead of cmds commands */
+	const volatile int *stop;
+	struct samples *latency;
+	pthread_mutex_t *lock;
+};
+
+static void *coex_worker_main(void *param)
+{
+	struct coex_worker *w = param;
+	/* Vendor specific opcode 0xfc01 with one parameter */
+	static const uint8_t vendor_cmd[4] = { 0x01, 0xfc, 0x01, 0x00 };
+	uint8_t afh_cmd[3 + AFH_CLASS_LEN];
+	const uint8_t *cmd = vendor_cmd;
+	size_t len = sizeof(vendor_cmd);
+	uint64_t start;
+	int i, ret;
+
+	if (coex_afh_maps && w->cls == HCI_CMD_CLASS_URGENT) {
+		afh_cmd[0] = AFH_CLASS_OPCODE & 0xff;
+		afh_cmd[1] = AFH_CLASS_OPCODE >> 8;
+		afh_cmd[2] = AFH_CLASS_LEN;
+		memset(afh_cmd + 3, 0xff, AFH_CLASS_LEN);
+		cmd = afh_cmd;
+		len = sizeof(afh_cmd);
+	}
+
+	for (i = 0; w->stop ? !*w->stop : i < w->cmds; i++) {
+		/* A cellular band change masks a different channel range */
+		if (cmd == afh_cmd)
+			afh_cmd[3 + AFH_CLASS_LEN - 1] =
+				0x7f >> ((w->id + i) % coex_afh_maps);
+
+		start = bench_now_us();
+		ret = hci_cmd_send_class(len, cmd, w->cls);
+		pthread_mutex_lock(w->lock);
+		samples_add(w->latency, start, ret != 0);
+		pthread_mutex_unlock(w->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Send background commands while urgent senders keep the controller busy.
+ * Each background command must get through. Returns the number of failed
+ * checks.
+ */
+static int coex_load_test(int num, struct samples *urgent,
+			  struct samples *background)
+{
+	int threads = LOAD_URGENT_SENDERS;
+	struct coex_worker *workers;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	volatile int stop = 0;
+	int i;
+
+	workers = calloc(threads + 1, sizeof(*workers));
+	for (i = 0; i <= threads; i++) {
+		workers[i].id = i;
+		workers[i].cls = i < threads ? HCI_CMD_CLASS_URGENT :
+					       HCI_CMD_CLASS_BACKGROUND;
+		workers[i].cmds = num;
+		workers[i].stop = i < threads ? &stop : NULL;
+		workers[i].latency = i < threads ? urgent : background;
+		workers[i].lock = &lock;
+		pthread_create(&workers[i].thread, NULL, coex_worker_main, &workers[i]);
+	}
+
+	/* The urgent load lasts until the last background command is done */
+	pthread_join(workers[threads].thread, NULL);
+	stop = 1;
+	for (i = 0; i < threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	free(workers);
+
+	return background->failures + urgent->failures +
+	       (background->num != num);
+}
+
+struct blocked_sender {
+	pthread_t thread;
+	int status;
+	int *started;
+};
+
+static void *blocked_sender_main(void *param)
+{
+	static const uint8_t vendor_cmd[4] = { 0x01, 0xfc, 0x01, 0x00 };
+	struct blocked_sender *s = param;
+
+	__atomic_fetch_add(s->started, 1, __ATOMIC_RELEASE);
+	s->status = hci_cmd_send(sizeof(vendor_cmd), vendor_cmd);
+
+	return NULL;
+}
+
+/*
+ * Clean the coex service up while senders wait for a completion that never
+ * comes or for a command credit. Cleanup must fail them all rather than
+ * let them time out, and the service must work again once initialized.
+ * Returns the number of failed checks.
+ */
+static int coex_cleanup_test(int num, struct samples *cleanup)
+{
+	static const uint8_t vendor_cmd[4] = { 0x01, 0xfc, 0x01, 0x00 };
+	struct blocked_sender senders[BLOCKED_SENDERS_MAX];
+	int started = 0;
+	uint64_t start;
+	int i, failed = 0;
+
+	xmit_drop = 1;
+	for (i = 0; i < num; i++) {
+		senders[i].started = &started;
+		pthread_create(&senders[i].thread, NULL, blocked_sender_main, &senders[i]);
+	}
+	while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) < num)
+		bench_sleep_us(1000);
+	/* For them to block, well within the command timeout */
+	bench_sleep_us(BLOCKED_SENDERS_WAIT_US);
+
+	start = bench_now_us();
+	hci_bind_client_cleanup();
+	samples_add(cleanup, start, 0);
+
+	for (i = 0; i < num; i++) {
+		pthread_join(senders[i].thread, NULL);
+		if (senders[i].status != BTCELLCOEX_STATUS_INVALID_OPERATION)
+			failed++;
+	}
+
+	xmit_drop = 0;
+	hci_bind_client_init();
+	if (hci_cmd_send(sizeof(vendor_cmd), vendor_cmd) != BTCELLCOEX_STATUS_OK)
+		failed++;
+
+	return failed;
+}
+
+/*
+ * Send vendor commands up to the largest parameter block, then one whose
+ * buffer length disagrees with its parameter length. Returns the number of
+ * failed checks.
+ */
+static int coex_length_test(void)
+{
+	uint8_t cmd[3 + HCI_CMD_PARAMS_MAX + 1];
+	int plen, failed = 0;
+
+	cmd[0] = 0x01;
+	cmd[1] = 0xfc;
+	memset(cmd + 3, 0x5a, sizeof(cmd) - 3);
+	for (plen = HCI_CMD_PARAMS_MAX - 3; plen <= HCI_CMD_PARAMS_MAX; plen++) {
+		cmd[2] = plen;
+		if (hci_cmd_send(3 + plen, cmd) != BTCELLCOEX_STATUS_OK)
+			failed++;
+	}
+
+	/* Agrees with the parameter length on the low byte only */
+	cmd[2] = 0;
+	if (hci_cmd_send(3 + 256, cmd) != BTCELLCOEX_STATUS_BAD_VALUE)
+		failed++;
+
+	return failed + __atomic_load_n(&xmit_malformed, __ATOMIC_RELAXED);
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * Dump the trace ring and look for the Command of the last LPM mode change
+ * and for a controller index event of hci0, decoded as btmon would.
+ * Returns the number of failed checks.
+ */
+static int trace_dump_test(void)
+{
+	char path[] = "/tmp/bt_vendor_bench_XXXXXX";
+	uint8_t rec[BTSNOOP_REC_SIZE + 64];
+	uint32_t flags, len;
+	uint16_t code;
+	int fd, hci_cmd = 0, mgmt_ev = 0;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return 1;
+	unlink(path);
+
+	if (bt_vendor_trace_dump(fd) < 1 ||
+	    lseek(fd, BTSNOOP_HDR_SIZE, SEEK_SET) != BTSNOOP_HDR_SIZE) {
+		close(fd);
+		return 1;
+	}
+
+	while (read(fd, rec, BTSNOOP_REC_SIZE) == BTSNOOP_REC_SIZE) {
+		len = get_be32(rec + 4);
+		flags = get_be32(rec + 8);
+		if (len > sizeof(rec) - BTSNOOP_REC_SIZE ||
+		    read(fd, rec + BTSNOOP_REC_SIZE, len) != (ssize_t)len)
+			break;
+
+		switch (flags & 0xffff) {
+		case MONITOR_COMMAND_PKT:
+			/* Opcode and parameter length, then the parameters */
+			code = rec[24] | (rec[25] << 8);
+			if (len == 3 + LPM_SLEEP_MODE_LEN &&
+			    code == LPM_SLEEP_MODE_OPCODE &&
+			    rec[26] == LPM_SLEEP_MODE_LEN)
+				hci_cmd = 1;
+			break;
+		case MONITOR_CTRL_EVENT:
+			/* Cookie, then the mgmt event code */
+			code = rec[28] | (rec[29] << 8);
+			if (len >= 6 && (flags >> 16) == 0 &&
+			    (code == MGMT_EV_INDEX_ADDED ||
+			     code == MGMT_EV_INDEX_REMOVED))
+				mgmt_ev = 1;
+			break;
+		}
+	}
+	close(fd);
+
+	return !hci_cmd + !mgmt_ev;
+}
+
+static void lost_cb(int status, void *user_data)
+{
+	pthread_mutex_lock(&op_lock);
+	lost_done++;
+	lost_status = status;
+	pthread_cond_broadcast(&op_cond);
+	pthread_mutex_unlock(&op_lock);
+}
+
+/*
+ * Send asynchronous commands whose completion the stack loses, one at a
+ * time. No other command comes to notice it, the callback must still
+ * report the timeout and the slot be free again. Returns the number of
+ * failed checks.
+ */
+static int coex_lost_test(int num, struct samples *lost)
+{
+	/* Another opcode, the check is not taken for the late completion */
+	static const uint8_t lost_cmd[4] = { 0x02, 0xfc, 0x01, 0x00 };
+	static const uint8_t vendor_cmd[4] = { 0x01, 0xfc, 0x01, 0x00 };
+	struct timespec ts;
+	uint64_t start;
+	int i, ret, done, status, failed = 0;
+
+	for (i = 0; i < num; i++) {
+		pthread_mutex_lock(&op_lock);
+		lost_done = 0;
+		pthread_mutex_unlock(&op_lock);
+
+		xmit_drop = 1;
+		start = bench_now_us();
+		ret = hci_cmd_send_async(sizeof(lost_cmd), lost_cmd, lost_cb, NULL);
+		xmit_drop = 0;
+		if (ret != BTCELLCOEX_STATUS_OK) {
+			samples_add(lost, start, 1);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += LOST_CMD_WAIT_US / 1000000;
+
+		ret = 0;
+		pthread_mutex_lock(&op_lock);
+		while (!lost_done && ret == 0)
+			ret = pthread_cond_timedwait(&op_cond, &op_lock, &ts);
+		done = lost_done;
+		status = lost_status;
+		pthread_mutex_unlock(&op_lock);
+
+		samples_add(lost, start,
+			    !done || status != BTCELLCOEX_STATUS_UNKNOWN_ERROR);
+		if (!done)
+			break;
+	}
+
+	if (hci_cmd_send(sizeof(vendor_cmd), vendor_cmd) != BTCELLCOEX_STATUS_OK)
+		failed++;
+
+	return failed;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options]\n"
+	       "  -n <cycles>       power/FW_CFG cycles (20)\n"
+	       "  -b <bursts>       coex command bursts (10)\n"
+	       "  -c <commands>     commands per burst (64)\n"
+	       "  -t <threads>      coex sender threads (4)\n"
+	       "  -m <us>           mgmt reply delay (200)\n"
+	       "  -e <us>           controller enumeration delay (20000)\n"
+	       "  -d <us>           HCIDEVDOWN delay (1000)\n"
+	       "  -B <us>           user channel bind delay (500)\n"
+	       "  -C <us>           Command Complete delay (300)\n"
+	       "  -D <us>           stack delay from USERIAL_OPEN to FW_CFG (0)\n"
+	       "  -k <credits>      controller command credits (1)\n"
+	       "  -r <commands>     HCI round trips per cycle (0)\n"
+	       "  -a <packets>      ACL packets ahead of each Command Complete (0)\n"
+	       "  -L                round trips leave the ACL data unread (demux)\n"
+	       "  -f <commands>     patch download of this many commands (0)\n"
+	       "  -x <maps>         coex AFH channel maps cycled through (0)\n"
+	       "  -g <commands>     background coex commands per burst (0)\n"
+	       "  -G <commands>     background coex commands under urgent load (0)\n"
+	       "  -w <resets>       controller resets per cycle (0)\n"
+	       "  -u <senders>      coex senders blocked across a service cleanup (0)\n"
+	       "  -l <commands>     async coex commands whose completion is lost (0)\n"
+	       "  -p <key=value>    set a property\n"
+	       "  -T                check the trace ring dump\n"
+	       "  -s                dump the library statistics\n"
+	       "Set BENCH_LOG to see the library logs.\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	const bt_vendor_interface_t *iface = &BLUETOOTH_VENDOR_LIB_INTERFACE;
+	unsigned char bdaddr[6] = { 0 };
+	struct samples power_on, power_off, open, close, fw_cfg, cycle, rtt;
+	struct samples lpm, recovery, coex, coex_bg, burst, coex_cleanup;
+	struct samples load, load_bg, lost;
+	struct coex_worker *workers;
+	pthread_mutex_t coex_lock = PTHREAD_MUTEX_INITIALIZER;
+	char prop[PROPERTY_VALUE_MAX];
+	int cycles = 20, bursts = 10, cmds = 64, threads = 4, rtts = 0, stats = 0;
+	int fw_cmds = 0, resets = 0, bg_cmds = 0, blocked = 0, cleanup_failures = 0;
+	int length_failures, load_cmds = 0, load_failures = 0, fw_cfg_delay_us = 0;
+	int binds, warm_failures, trace = 0, trace_failures = 0;
+	int lost_cmds = 0, lost_failures = 0;
+	char *fw_patch = NULL;
+	int fds[CH_MAX], channels, pwr, warm, i, j, opt, ret;
+	uint32_t idle_ms, coex_timeout_ms, coex_stale, shadow_hits, shadow_collapsed;
+	uint32_t class_depth[HCI_CMD_CLASS_MAX], class_throttled[HCI_CMD_CLASS_MAX];
+	uint8_t state;
+	uint64_t start, cycle_start;
+
+	property_set("bluetooth.interface", "hci0");
+	property_set("bluetooth.hcidev_timeout", "2000");
+
+	while ((opt = getopt(argc, argv, "n:b:c:t:m:e:d:B:C:D:k:r:a:f:w:x:g:G:u:l:p:LTsh")) != -1) {
+		switch (opt) {
+		case 'n': cycles = atoi(optarg); break;
+		case 'b': bursts = atoi(optarg); break;
+		case 'c': cmds = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		case 'm': bench_config.mgmt_delay_us = atoi(optarg); break;
+		case 'e': bench_config.enum_delay_us = atoi(optarg); break;
+		case 'd': bench_config.devdown_delay_us = atoi(optarg); break;
+		case 'B': bench_config.bind_delay_us = atoi(optarg); break;
+		case 'C': bench_config.cmd_delay_us = atoi(optarg); break;
+		case 'D': fw_cfg_delay_us = atoi(optarg); break;
+		case 'k': bench_config.cmd_credits = atoi(optarg); break;
+		case 'r': rtts = atoi(optarg); break;
+		case 'a': bench_config.acl_burst = atoi(optarg); break;
+		case 'f': fw_cmds = atoi(optarg); break;
+		case 'w': resets = atoi(optarg); break;
+		case 'x': coex_afh_maps = atoi(optarg); break;
+		case 'g': bg_cmds = atoi(optarg); break;
+		case 'G': load_cmds = atoi(optarg); break;
+		case 'u': blocked = atoi(optarg); break;
+		case 'l': lost_cmds = atoi(optarg); break;
+		case 'p':
+			if (bench_property_parse(optarg)) {
+				fprintf(stderr, "Invalid property %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'L': rtt_acl_unread = 1; break;
+		case 'T': trace = 1; break;
+		case 's': stats = 1; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (cycles < 0 || bursts < 0 || rtts < 0 || resets < 0 || threads < 1 ||
+	    cmds < threads || coex_afh_maps < 0 || coex_afh_maps > 8 || bg_cmds < 0 ||
+	    load_cmds < 0 || lost_cmds < 0 || blocked < 0 || blocked > BLOCKED_SENDERS_MAX) {
+		usage(argv[0]);
+		return 1;
+	}
+	coex_cmds_per_thread = cmds / threads;
+
+	if (fw_cmds > 0) {
+		fw_patch = fw_patch_create(fw_cmds);
+		if (!fw_patch) {
+			fprintf(stderr, "Unable to create the patch file\n");
+			return 1;
+		}
+		property_set("bluetooth.fw.patch", fw_patch);
+	}
+
+	property_get("bluetooth.warmstandby", prop, "0");
+	warm = atoi(prop);
+
+	samples_init(&power_on, "power_on", cycles);
+	samples_init(&open, "userial_open", cycles);
+	samples_init(&fw_cfg, "fw_cfg", cycles);
+	samples_init(&close, "userial_close", cycles);
+	samples_init(&power_off, "power_off", cycles);
+	samples_init(&cycle, "cycle", cycles);
+	samples_init(&rtt, "hci_rtt", cycles * rtts);
+	samples_init(&lpm, "lpm_set_mode", cycles);
+	samples_init(&recovery, "recovery", cycles * resets);
+	samples_init(&coex, "coex_cmd", bursts * coex_cmds_per_thread * threads);
+	samples_init(&coex_bg, "coex_cmd_bg", bursts * bg_cmds);
+	samples_init(&burst, "coex_burst", bursts);
+	samples_init(&coex_cleanup, "coex_cleanup", 1);
+	/* The urgent senders run for as long as the background ones need */
+	samples_init(&load, "coex_cmd_load", 65536);
+	samples_init(&load_bg, "coex_cmd_bg_load", load_cmds);
+	samples_init(&lost, "coex_cmd_lost", lost_cmds);
+
+	/* Writes to a hung up user channel */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (bench_kernel_start()) {
+		fprintf(stderr, "Unable to start the kernel emulation\n");
+		return 1;
+	}
+
+	xmit_running = 1;
+	pthread_create(&xmit_thread, NULL, xmit_thread_main, NULL);
+
+	if (iface->init(&callbacks, bdaddr)) {
+		fprintf(stderr, "init failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < cycles; i++) {
+		cycle_start = bench_now_us();
+
+		start = bench_now_us();
+		pwr = BT_VND_PWR_ON;
+		ret = iface->op(BT_VND_OP_POWER_CTRL, &pwr);
+		samples_add(&power_on, start, ret != 0);
+		/* The radio comes up, the controller enumerates */
+		bench_kernel_power(0, 1);
+
+		start = bench_now_us();
+		channels = iface->op(BT_VND_OP_USERIAL_OPEN, fds);
+		samples_add(&open, start, channels < 1);
+
+		/* Long enough, a fast claim binds before FW_CFG looks */
+		bench_sleep_us(fw_cfg_delay_us);
+
+		start = bench_now_us();
+		iface->op(BT_VND_OP_FW_CFG, NULL);
+		ret = op_wait(&fw_cfg_wait);
+		samples_add(&fw_cfg, start, ret != 0);
+
+		for (j = 0; !ret && j < rtts; j++) {
+			/* As the stack does before sending */
+			state = BT_VND_LPM_WAKE_ASSERT;
+			iface->op(BT_VND_OP_LPM_WAKE_SET_STATE, &state);
+
+			start = bench_now_us();
+			samples_add(&rtt, start,
+				    hci_round_trip(fds, channels == CH_MAX,
+						   HCI_RTT_TIMEOUT_MS) != 0);
+		}
+		if (rtt_acl_unread && channels == CH_MAX)
+			channel_drain(fds[CH_ACL_IN]);
+
+		/* Recovered by the watchdog through the demux only */
+		for (j = 0; !ret && channels == CH_MAX && j < resets; j++) {
+			start = bench_now_us();
+			samples_add(&recovery, start, controller_reset(fds) != 0);
+		}
+
+		/* The second mode change waits for the first one to complete */
+		if (!ret) {
+			start = bench_now_us();
+			state = BT_VND_LPM_DISABLE;
+			iface->op(BT_VND_OP_LPM_SET_MODE, &state);
+			state = BT_VND_LPM_ENABLE;
+			iface->op(BT_VND_OP_LPM_SET_MODE, &state);
+			ret = op_wait(&lpm_wait);
+			samples_add(&lpm, start, op_wait(&lpm_wait) != 0 || ret);
+		}
+
+		start = bench_now_us();
+		ret = iface->op(BT_VND_OP_USERIAL_CLOSE, NULL);
+		samples_add(&close, start, ret != 0);
+
+		start = bench_now_us();
+		pwr = BT_VND_PWR_OFF;
+		ret = iface->op(BT_VND_OP_POWER_CTRL, &pwr);
+		samples_add(&power_off, start, ret != 0);
+		if (!warm) {
+			wait_index(0, 1);
+			bench_kernel_power(0, 0);
+			wait_index(0, 0);
+		}
+
+		samples_add(&cycle, cycle_start, 0);
+	}
+
+	/* Before the coex bursts overwrite the ring */
+	if (trace)
+		trace_failures = trace_dump_test();
+
+	/* The last worker sends the background commands, along the others */
+	workers = calloc(threads + 1, sizeof(*workers));
+	for (i = 0; i < bursts; i++) {
+		start = bench_now_us();
+		for (j = 0; j <= threads; j++) {
+			workers[j].id = j;
+			workers[j].cls = j < threads ? HCI_CMD_CLASS_URGENT :
+						       HCI_CMD_CLASS_BACKGROUND;
+			workers[j].cmds = j < threads ? coex_cmds_per_thread : bg_cmds;
+			workers[j].latency = j < threads ? &coex : &coex_bg;
+			workers[j].lock = &coex_lock;
+			pthread_create(&workers[j].thread, NULL, coex_worker_main,
+				       &workers[j]);
+		}
+		for (j = 0; j <= threads; j++)
+			pthread_join(workers[j].thread, NULL);
+		samples_add(&burst, start, 0);
+	}
+	free(workers);
+
+	length_failures = coex_length_test();
+
+	if (load_cmds)
+		load_failures = coex_load_test(load_cmds, &load, &load_bg);
+
+	if (lost_cmds)
+		lost_failures = coex_lost_test(lost_cmds, &lost);
+
+	if (blocked)
+		cleanup_failures = coex_cleanup_test(blocked, &coex_cleanup);
+
+	if (stats)
+		bt_vendor_stats_dump(1);
+
+	iface->op(BT_VND_OP_GET_LPM_IDLE_TIMEOUT, &idle_ms);
+	hci_cmd_timeout_stats(&coex_timeout_ms, &coex_stale);
+	hci_cmd_shadow_stats(&shadow_hits, &shadow_collapsed);
+	for (i = 0; i < HCI_CMD_CLASS_MAX; i++)
+		hci_cmd_class_stats(i, &class_depth[i], &class_throttled[i]);
+
+	iface->cleanup();
+
+	pthread_mutex_lock(&xmit_lock);
+	xmit_running = 0;
+	pthread_cond_broadcast(&xmit_cond);
+	pthread_mutex_unlock(&xmit_lock);
+	pthread_join(xmit_thread, NULL);
+
+	/* Warm standby binds once, the next cycles reuse the channel */
+	binds = bench_kernel_binds();
+	warm_failures = warm && !resets && binds != 1;
+
+	bench_kernel_stop();
+
+	if (fw_patch)
+		unlink(fw_patch);
+
+	samples_report(&power_on);
+	samples_report(&open);
+	samples_report(&fw_cfg);
+	samples_report(&close);
+	samples_report(&power_off);
+	samples_report(&cycle);
+	samples_report(&rtt);
+	samples_report(&lpm);
+	samples_report(&recovery);
+	samples_report(&coex);
+	samples_report(&coex_bg);
+	samples_report(&burst);
+	samples_report(&load);
+	samples_report(&load_bg);
+	samples_report(&lost);
+	samples_report(&coex_cleanup);
+	printf("lpm idle timeout %u ms\n", idle_ms);
+	printf("coex cmd timeout %u ms, %u late completions dropped\n",
+	       coex_timeout_ms, coex_stale);
+	printf("coex cmd shadow %u already applied, %u superseded\n",
+	       shadow_hits, shadow_collapsed);
+	printf("coex urgent max depth %u, %u throttled\n",
+	       class_depth[HCI_CMD_CLASS_URGENT],
+	       class_throttled[HCI_CMD_CLASS_URGENT]);
+	printf("coex background max depth %u, %u throttled\n",
+	       class_depth[HCI_CMD_CLASS_BACKGROUND],
+	       class_throttled[HCI_CMD_CLASS_BACKGROUND]);
+	printf("coex max length commands, %d failed checks\n", length_failures);
+	if (lost_cmds)
+		printf("coex %d lost completions, %d failed checks\n",
+		       lost_cmds, lost_failures);
+	if (blocked)
+		printf("coex cleanup with %d blocked senders, %d failed checks\n",
+		       blocked, cleanup_failures);
+	if (trace)
+		printf("trace ring dump, %d failed checks\n", trace_failures);
+	if (warm)
+		printf("warm standby, %d user channel binds in %d cycles\n",
+		       binds, cycles);
+
+	return fw_cfg.failures || rtt.failures || lpm.failures ||
+	       recovery.failures || coex.failures || coex_bg.failures ||
+	       lost.failures || lost_failures ||
+	       length_failures || load_failures || cleanup_failures ||
+	       warm_failures || trace_failures ? 2 : 0;
+}
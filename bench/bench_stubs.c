@@ -0,0 +1,146 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * Host build stand-ins for the Android libraries: logging, properties
+ * and the coex client binding.
+ */
+
+#define LOG_TAG "bench"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/properties.h>
+#include <utils/Log.h>
+
+#include "libbtcellcoex-client.h"
+#include "bench.h"
+
+#define PROPERTY_MAX	64
+
+struct property {
+	char key[PROPERTY_KEY_MAX];
+	char value[PROPERTY_VALUE_MAX];
+};
+
+static struct property properties[PROPERTY_MAX];
+static int num_properties;
+static pthread_mutex_t property_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void bench_log(char prio, const char *tag, const char *fmt, ...)
+{
+	static int enabled = -1;
+	va_list ap;
+
+	if (enabled < 0)
+		enabled = getenv("BENCH_LOG") != NULL;
+	if (!enabled)
+		return;
+
+	fprintf(stderr, "%c/%s: ", prio, tag);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static struct property *property_find(const char *key)
+{
+	int i;
+
+	for (i = 0; i < num_properties; i++) {
+		if (!strcmp(properties[i].key, key))
+			return &properties[i];
+	}
+
+	return NULL;
+}
+
+int property_get(const char *key, char *value, const char *default_value)
+{
+	struct property *p;
+	int len = 0;
+
+	pthread_mutex_lock(&property_lock);
+	p = property_find(key);
+	if (p) {
+		strcpy(value, p->value);
+		len = strlen(value);
+	} else if (default_value) {
+		len = strlen(default_value);
+		if (len >= PROPERTY_VALUE_MAX)
+			len = PROPERTY_VALUE_MAX - 1;
+		memcpy(value, default_value, len);
+		value[len] = '\0';
+	} else {
+		value[0] = '\0';
+	}
+	pthread_mutex_unlock(&property_lock);
+
+	return len;
+}
+
+int property_set(const char *key, const char *value)
+{
+	struct property *p;
+	int ret = 0;
+
+	if (strlen(key) >= PROPERTY_KEY_MAX || strlen(value) >= PROPERTY_VALUE_MAX)
+		return -1;
+
+	pthread_mutex_lock(&property_lock);
+	p = property_find(key);
+	if (!p && num_properties < PROPERTY_MAX)
+		p = &properties[num_properties++];
+	if (p) {
+		strcpy(p->key, key);
+		strcpy(p->value, value);
+	} else {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&property_lock);
+
+	return ret;
+}
+
+/* "key=value" from the command line */
+int bench_property_parse(const char *arg)
+{
+	char key[PROPERTY_KEY_MAX];
+	const char *eq = strchr(arg, '=');
+
+	if (!eq || eq == arg || eq - arg >= PROPERTY_KEY_MAX)
+		return -1;
+
+	memcpy(key, arg, eq - arg);
+	key[eq - arg] = '\0';
+
+	return property_set(key, eq + 1);
+}
+
+/* The service is always there, the harness calls hci_cmd_send() directly */
+int bindToCoexService(int (*cb)(const size_t, const void *))
+{
+	(void)cb;
+
+	return BTCELLCOEX_STATUS_OK;
+}
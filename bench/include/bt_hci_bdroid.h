@@ -0,0 +1,37 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/* Host build stand-in for bluedroid's hci/include/bt_hci_bdroid.h */
+
+#ifndef BT_HCI_BDROID_H
+#define BT_HCI_BDROID_H
+
+#include <stdint.h>
+
+#define MSG_STACK_TO_HC_HCI_CMD	0x2000
+
+typedef struct {
+	uint16_t event;
+	uint16_t len;
+	uint16_t offset;
+	uint16_t layer_specific;
+} HC_BT_HDR;
+
+#define BT_HC_HDR_SIZE	(sizeof(HC_BT_HDR))
+
+#endif /* BT_HCI_BDROID_H */
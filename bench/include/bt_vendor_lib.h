@@ -0,0 +1,106 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * Host build stand-in for bluedroid's hci/include/bt_vendor_lib.h, the
+ * parts used by libbt-vendor only. Keep in sync with the stack.
+ */
+
+#ifndef BT_VENDOR_LIB_H
+#define BT_VENDOR_LIB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifndef TRUE
+#define TRUE	1
+#define FALSE	0
+#endif
+
+typedef enum {
+	BT_VND_OP_POWER_CTRL,
+	BT_VND_OP_FW_CFG,
+	BT_VND_OP_SCO_CFG,
+	BT_VND_OP_USERIAL_OPEN,
+	BT_VND_OP_USERIAL_CLOSE,
+	BT_VND_OP_GET_LPM_IDLE_TIMEOUT,
+	BT_VND_OP_LPM_SET_MODE,
+	BT_VND_OP_LPM_WAKE_SET_STATE,
+	BT_VND_OP_SET_AUDIO_STATE,
+	BT_VND_OP_EPILOG,
+} bt_vendor_opcode_t;
+
+enum {
+	BT_VND_PWR_OFF,
+	BT_VND_PWR_ON,
+};
+
+enum {
+	BT_VND_LPM_DISABLE,
+	BT_VND_LPM_ENABLE,
+};
+
+enum {
+	BT_VND_LPM_WAKE_ASSERT,
+	BT_VND_LPM_WAKE_DEASSERT,
+};
+
+enum {
+	CH_CMD,
+	CH_EVT,
+	CH_ACL_OUT,
+	CH_ACL_IN,
+	CH_MAX
+};
+
+typedef enum {
+	BT_VND_OP_RESULT_SUCCESS,
+	BT_VND_OP_RESULT_FAIL,
+} bt_vendor_op_result_t;
+
+typedef void (*cfg_result_cb)(bt_vendor_op_result_t result);
+typedef void *(*malloc_cb)(int size);
+typedef void (*mdealloc_cb)(void *p_buf);
+typedef void (*tINT_CMD_CBACK)(void *p_mem);
+typedef uint8_t (*cmd_xmit_cb)(uint16_t opcode, void *p_buf,
+			       tINT_CMD_CBACK p_cback);
+
+typedef struct {
+	size_t size;
+	cfg_result_cb fwcfg_cb;
+	cfg_result_cb scocfg_cb;
+	cfg_result_cb lpm_cb;
+	cfg_result_cb audio_state_cb;
+	malloc_cb alloc;
+	mdealloc_cb dealloc;
+	cmd_xmit_cb xmit_cb;
+	cfg_result_cb epilog_cb;
+} bt_vendor_callbacks_t;
+
+typedef struct {
+	size_t size;
+	int (*init)(const bt_vendor_callbacks_t *p_cb, unsigned char *local_bdaddr);
+	int (*op)(bt_vendor_opcode_t opcode, void *param);
+	void (*cleanup)(void);
+} bt_vendor_interface_t;
+
+#endif /* BT_VENDOR_LIB_H */
@@ -0,0 +1,30 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/* Host build properties, an in-memory table, see bench_stubs.c */
+
+#ifndef BENCH_CUTILS_PROPERTIES_H
+#define BENCH_CUTILS_PROPERTIES_H
+
+#define PROPERTY_KEY_MAX	32
+#define PROPERTY_VALUE_MAX	92
+
+int property_get(const char *key, char *value, const char *default_value);
+int property_set(const char *key, const char *value);
+
+#endif /* BENCH_CUTILS_PROPERTIES_H */
@@ -0,0 +1,32 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/* Host build tracing, systrace markers are compiled out */
+
+#ifndef BENCH_CUTILS_TRACE_H
+#define BENCH_CUTILS_TRACE_H
+
+#define ATRACE_TAG_HAL	(1 << 11)
+
+#define ATRACE_BEGIN(name)		do { } while (0)
+#define ATRACE_END()			do { } while (0)
+#define ATRACE_ASYNC_BEGIN(name, cookie)	do { (void)(cookie); } while (0)
+#define ATRACE_ASYNC_END(name, cookie)	do { (void)(cookie); } while (0)
+#define ATRACE_INT(name, value)		do { (void)(value); } while (0)
+
+#endif /* BENCH_CUTILS_TRACE_H */
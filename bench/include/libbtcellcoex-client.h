@@ -0,0 +1,37 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/* Host build stand-in for the coex client library, see bench_stubs.c */
+
+#ifndef LIBBTCELLCOEX_CLIENT_H
+#define LIBBTCELLCOEX_CLIENT_H
+
+#include <stddef.h>
+
+enum {
+	BTCELLCOEX_STATUS_OK = 0,
+	BTCELLCOEX_STATUS_NO_INIT,
+	BTCELLCOEX_STATUS_INVALID_OPERATION,
+	BTCELLCOEX_STATUS_BAD_VALUE,
+	BTCELLCOEX_STATUS_UNKNOWN_ERROR,
+	BTCELLCOEX_STATUS_CMD_FAILED,
+};
+
+int bindToCoexService(int (*cb)(const size_t, const void *));
+
+#endif /* LIBBTCELLCOEX_CLIENT_H */
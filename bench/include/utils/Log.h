@@ -0,0 +1,33 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/* Host build logging, printed to stderr when BENCH_LOG is set */
+
+#ifndef BENCH_UTILS_LOG_H
+#define BENCH_UTILS_LOG_H
+
+void bench_log(char prio, const char *tag, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+#define ALOGV(...)	bench_log('V', LOG_TAG, __VA_ARGS__)
+#define ALOGD(...)	bench_log('D', LOG_TAG, __VA_ARGS__)
+#define ALOGI(...)	bench_log('I', LOG_TAG, __VA_ARGS__)
+#define ALOGW(...)	bench_log('W', LOG_TAG, __VA_ARGS__)
+#define ALOGE(...)	bench_log('E', LOG_TAG, __VA_ARGS__)
+
+#endif /* BENCH_UTILS_LOG_H */
@@ -0,0 +1,246 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * Controller capabilities read once after the user channel bind, cached
+ * by controller address and firmware version so that warm restarts and
+ * power cycles of the same controller skip most round trips, while a
+ * firmware update is read again.
+ */
+
+#define LOG_TAG "bt_vendor_caps"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <utils/Log.h>
+
+#include "bt_vendor_linux.h"
+
+#define CAPS_CACHE_MAX		4
+#define CAPS_CMD_TIMEOUT	1000 /* 1000ms */
+
+struct caps_entry {
+	int valid;
+	/* Least recently used goes first */
+	unsigned int used;
+	struct hci_caps caps;
+};
+
+/*
+ * Supported Commands bit of the commands the coex path may send, octet * 8
+ * + bit as listed in Core spec Vol 4 Part E 6.27
+ */
+struct caps_cmd_bit {
+	uint16_t opcode;
+	uint16_t bit;
+};
+
+static const struct caps_cmd_bit caps_cmd_bits[] = {
+	{ 0x0c3f, 97 },		/* Set AFH Host Channel Classification, 12.1 */
+	{ 0x0c6e, 238 },	/* Set MWS Channel Parameters, 29.6 */
+	{ 0x0c6f, 239 },	/* Set External Frame Configuration, 29.7 */
+	{ 0x0c70, 240 },	/* Set MWS Signaling, 30.0 */
+	{ 0x0c71, 241 },	/* Set MWS Transport Layer, 30.1 */
+	{ 0x0c72, 242 },	/* Set MWS Scan Frequency Table, 30.2 */
+	{ 0x140c, 243 },	/* Get MWS Transport Layer Configuration, 30.3 */
+	{ 0x0c73, 244 },	/* Set MWS PATTERN Configuration, 30.4 */
+	{ 0x2014, 217 },	/* LE Set Host Channel Classification, 27.1 */
+};
+
+static pthread_mutex_t caps_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct caps_entry caps_cache[CAPS_CACHE_MAX];
+static unsigned int caps_clock;
+
+/* Same controller running the same firmware */
+static int caps_same_version(const struct hci_caps *a, const struct hci_caps *b)
+{
+	return !memcmp(a->bdaddr, b->bdaddr, 6) && a->hci_ver == b->hci_ver &&
+	       a->hci_rev == b->hci_rev && a->lmp_ver == b->lmp_ver &&
+	       a->manufacturer == b->manufacturer &&
+	       a->lmp_subver == b->lmp_subver;
+}
+
+/* Fills caps, which holds the address and version, from the cache */
+static int caps_lookup(struct hci_caps *caps)
+{
+	uint8_t ncmd = caps->ncmd;
+	int i, ret = -1;
+
+	pthread_mutex_lock(&caps_lock);
+	for (i = 0; i < CAPS_CACHE_MAX; i++) {
+		if (caps_cache[i].valid &&
+		    caps_same_version(&caps_cache[i].caps, caps)) {
+			caps_cache[i].used = ++caps_clock;
+			*caps = caps_cache[i].caps;
+			caps->ncmd = ncmd;
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&caps_lock);
+
+	return ret;
+}
+
+static void caps_store(const struct hci_caps *caps)
+{
+	struct caps_entry *e = &caps_cache[0];
+	int i;
+
+	/* Replaces what another firmware of this controller left */
+	pthread_mutex_lock(&caps_lock);
+	for (i = 0; i < CAPS_CACHE_MAX; i++) {
+		if (caps_cache[i].valid &&
+		    !memcmp(caps_cache[i].caps.bdaddr, caps->bdaddr, 6)) {
+			e = &caps_cache[i];
+			break;
+		}
+		if (!caps_cache[i].valid || caps_cache[i].used < e->used)
+			e = &caps_cache[i];
+	}
+	e->caps = *caps;
+	e->valid = 1;
+	e->used = ++caps_clock;
+	pthread_mutex_unlock(&caps_lock);
+}
+
+/* Command with return parameters of exactly len bytes after the status */
+static int caps_cmd(int fd, uint16_t opcode, uint8_t *rsp, int len,
+		    struct hci_caps *caps)
+{
+	int ret;
+
+	ret = hci_send_cmd_sync(fd, opcode, NULL, 0, rsp, len + 1, &caps->ncmd,
+				CAPS_CMD_TIMEOUT);
+	if (ret < 0)
+		return ret;
+
+	if (ret < len + 1 || rsp[0]) {
+		ALOGE("Command 0x%04x returned status 0x%02x, length %d",
+		      opcode, rsp[0], ret);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/* Identifies the firmware, a patch download changes the revisions */
+static int caps_read_version(int fd, struct hci_caps *caps)
+{
+	uint8_t rsp[9];
+	int ret;
+
+	ret = caps_cmd(fd, HCI_OP_READ_LOCAL_VERSION, rsp, 8, caps);
+	if (ret)
+		return ret;
+	caps->hci_ver = rsp[1];
+	caps->hci_rev = rsp[2] | (rsp[3] << 8);
+	caps->lmp_ver = rsp[4];
+	caps->manufacturer = rsp[5] | (rsp[6] << 8);
+	caps->lmp_subver = rsp[7] | (rsp[8] << 8);
+
+	return 0;
+}
+
+static int caps_read_controller(int fd, struct hci_caps *caps)
+{
+	uint8_t rsp[1 + sizeof(caps->commands)];
+	int ret;
+
+	ret = caps_cmd(fd, HCI_OP_READ_LOCAL_COMMANDS, rsp,
+		       sizeof(caps->commands), caps);
+	if (ret)
+		return ret;
+	memcpy(caps->commands, rsp + 1, sizeof(caps->commands));
+
+	ret = caps_cmd(fd, HCI_OP_READ_LOCAL_FEATURES, rsp,
+		       sizeof(caps->features), caps);
+	if (ret)
+		return ret;
+	memcpy(caps->features, rsp + 1, sizeof(caps->features));
+
+	ret = caps_cmd(fd, HCI_OP_READ_BUFFER_SIZE, rsp, 7, caps);
+	if (ret)
+		return ret;
+	caps->acl_mtu = rsp[1] | (rsp[2] << 8);
+	caps->sco_mtu = rsp[3];
+	caps->acl_max_pkt = rsp[4] | (rsp[5] << 8);
+	caps->sco_max_pkt = rsp[6] | (rsp[7] << 8);
+
+	return 0;
+}
+
+/*
+ * Capabilities of the controller bound to fd, hci<index>. The address
+ * known to the mgmt monitor spares reading it. The version is always read,
+ * the rest comes from the cache when this controller was seen before with
+ * the same firmware. Returns 0 or -errno.
+ */
+int hci_caps_read(int fd, int index, struct hci_caps *caps)
+{
+	uint8_t rsp[7];
+	int ret;
+
+	memset(caps, 0, sizeof(*caps));
+
+	if (mgmt_monitor_index_addr(index, caps->bdaddr)) {
+		ret = caps_cmd(fd, HCI_OP_READ_BD_ADDR, rsp, 6, caps);
+		if (ret)
+			return ret;
+		memcpy(caps->bdaddr, rsp + 1, 6);
+	}
+
+	ret = caps_read_version(fd, caps);
+	if (ret)
+		return ret;
+
+	if (!caps_lookup(caps))
+		return 0;
+
+	ret = caps_read_controller(fd, caps);
+	if (ret)
+		return ret;
+
+	ALOGI("HCI %u rev %u, LMP %u subversion %u, manufacturer %u, ACL %u x %u",
+	      caps->hci_ver, caps->hci_rev, caps->lmp_ver, caps->lmp_subver,
+	      caps->manufacturer, caps->acl_max_pkt, caps->acl_mtu);
+
+	caps_store(caps);
+
+	return 0;
+}
+
+/*
+ * Returns 1 if the controller supports opcode, 0 if it does not and -1
+ * for commands not tracked, vendor commands included.
+ */
+int hci_caps_cmd_supported(const struct hci_caps *caps, uint16_t opcode)
+{
+	unsigned int i, bit;
+
+	for (i = 0; i < sizeof(caps_cmd_bits) / sizeof(caps_cmd_bits[0]); i++) {
+		if (caps_cmd_bits[i].opcode != opcode)
+			continue;
+		bit = caps_cmd_bits[i].bit;
+		return !!(caps->commands[bit / 8] & (1 << (bit % 8)));
+	}
+
+	return -1;
+}
@@ -0,0 +1,532 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * Optional demultiplexing of the HCI user channel into one socket per
+ * transport channel, for stacks built for a multi-channel transport
+ * (packets without the H4 type indicator). Events and commands are moved
+ * ahead of the ACL data of the same batch, so that command round trips do
+ * not wait behind bulk transfers.
+ *
+ * The demux never blocks on a stack socket: what a channel cannot take is
+ * queued for it, so a stack slow to read its ACL data still gets its
+ * events and has its commands sent. A queue without room for another batch
+ * stops the reads from the user channel until the stack catches up, the
+ * kernel socket buffer then holds the traffic.
+ *
+ * A lost user channel hangs up the stack ends, unless the demux was started
+ * to be kept: the controller watchdog then rebinds it, queues an event for
+ * the stack and starts the demux again.
+ */
+
+#define LOG_TAG "bt_vendor_demux"
+/* recvmmsg() and sendmmsg() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <utils/Log.h>
+
+#include "bt_vendor_linux.h"
+
+/* Packets moved per recvmmsg/sendmmsg call */
+#define DEMUX_BATCH		16
+/* Room for bursts of ACL data the stack is slow to read */
+#define DEMUX_SNDBUF		(256 * 1024)
+/* Bytes queued for a stack channel at most, allocated as needed */
+#define DEMUX_INQ_MAX		(1024 * 1024)
+/* Enough for a batch of the largest packets */
+#define DEMUX_INQ_ROOM		(DEMUX_BATCH * HCI_MAX_FRAME_SIZE)
+
+#define HCI_COMMAND_HDR_SIZE	3
+#define HCI_ACL_HDR_SIZE	4
+
+/* Packet written by the stack, reassembled from its stream */
+struct demux_out {
+	uint8_t buf[1 + HCI_MAX_FRAME_SIZE];
+	int len;
+};
+
+/* Bytes for the stack its socket could not take yet */
+struct demux_in {
+	uint8_t *buf;
+	int size;
+	int off;
+	int len;
+};
+
+struct hci_demux {
+	/* User channel */
+	int fd;
+	/* Told about the traffic, or NULL */
+	struct bt_vendor_lpm *lpm;
+	/* Demux and stack ends of the socketpair of each channel */
+	int ends[CH_MAX];
+	int stack[CH_MAX];
+	int stop_fd;
+	pthread_t thread;
+	int started;
+	int keep;
+	int lost;
+
+	struct demux_out cmd;
+	struct demux_out acl;
+	struct demux_in evt_q;
+	struct demux_in acl_q;
+
+	uint8_t rx[DEMUX_BATCH][1 + HCI_MAX_FRAME_SIZE];
+	struct iovec rx_iov[DEMUX_BATCH];
+	struct mmsghdr rx_msgs[DEMUX_BATCH];
+
+	uint8_t tx[DEMUX_BATCH][1 + HCI_MAX_FRAME_SIZE];
+	struct iovec tx_iov[DEMUX_BATCH];
+	struct mmsghdr tx_msgs[DEMUX_BATCH];
+	int tx_num;
+};
+
+/* Bytes written on a non blocking channel end, 0 when it is full */
+static int demux_write(int fd, const uint8_t *buf, int len)
+{
+	int n;
+
+	do {
+		n = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		return errno == EAGAIN ? 0 : -errno;
+
+	return n;
+}
+
+/* Write what is queued for a channel, as much as it takes */
+static int demux_flush(struct hci_demux *dm, int ch, struct demux_in *q)
+{
+	int n;
+
+	while (q->len > 0) {
+		n = demux_write(dm->ends[ch], q->buf + q->off, q->len);
+		if (n <= 0)
+			return n;
+		q->off += n;
+		q->len -= n;
+	}
+	q->off = 0;
+
+	return 0;
+}
+
+/* Room left in a queue, the user channel is read only if it takes a batch */
+static int demux_room(const struct demux_in *q)
+{
+	return DEMUX_INQ_MAX - q->len;
+}
+
+/* Write a packet on a channel, queue what it cannot take */
+static int demux_put(struct hci_demux *dm, int ch, struct demux_in *q,
+		     const uint8_t *buf, int len)
+{
+	uint8_t *p;
+	int n = 0, size;
+
+	if (!q->len) {
+		n = demux_write(dm->ends[ch], buf, len);
+		if (n < 0)
+			return n;
+		if (n == len)
+			return 0;
+	}
+	buf += n;
+	len -= n;
+
+	if (q->off + q->len + len > q->size) {
+		if (q->off) {
+			memmove(q->buf, q->buf + q->off, q->len);
+			q->off = 0;
+		}
+		if (q->len + len > q->size) {
+			for (size = q->size ? q->size : DEMUX_INQ_ROOM;
+			     size < q->len + len; size *= 2)
+				;
+			p = realloc(q->buf, size);
+			if (!p)
+				return -ENOMEM;
+			q->buf = p;
+			q->size = size;
+		}
+	}
+
+	memcpy(q->buf + q->off + q->len, buf, len);
+	q->len += len;
+
+	return 0;
+}
+
+/* Hand the packets of a batch of one type to the stack */
+static int demux_deliver(struct hci_demux *dm, int num, uint8_t type, int ch,
+			 struct demux_in *q)
+{
+	int i, ret;
+
+	for (i = 0; i < num; i++) {
+		int len = dm->rx_msgs[i].msg_len;
+
+		if (len < 2 || dm->rx[i][0] != type)
+			continue;
+
+		ret = demux_put(dm, ch, q, dm->rx[i] + 1, len - 1);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int demux_receive(struct hci_demux *dm)
+{
+	int i, num, ret;
+
+	num = recvmmsg(dm->fd, dm->rx_msgs, DEMUX_BATCH, MSG_DONTWAIT, NULL);
+	if (num < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		dm->lost = 1;
+		return -errno;
+	}
+
+	/* Events first, then the ACL data received along */
+	ret = demux_deliver(dm, num, HCI_EVENT_PKT, CH_EVT, &dm->evt_q);
+	if (!ret)
+		ret = demux_deliver(dm, num, HCI_ACLDATA_PKT, CH_ACL_IN, &dm->acl_q);
+
+	for (i = 0; i < num; i++) {
+		if (dm->rx_msgs[i].msg_len > 0 &&
+		    dm->rx[i][0] != HCI_EVENT_PKT && dm->rx[i][0] != HCI_ACLDATA_PKT)
+			ALOGW("Dropping packet type 0x%02x", dm->rx[i][0]);
+	}
+
+	return ret;
+}
+
+/*
+ * Read what the stack wrote on a channel and queue the complete packets,
+ * H4 type added, for the next sendmmsg.
+ */
+static int demux_read_out(struct hci_demux *dm, int ch, struct demux_out *out,
+			  uint8_t type)
+{
+	int hdr = type == HCI_COMMAND_PKT ? HCI_COMMAND_HDR_SIZE : HCI_ACL_HDR_SIZE;
+	int need, n;
+
+	while (dm->tx_num < DEMUX_BATCH) {
+		if (out->len < 1 + hdr) {
+			need = 1 + hdr;
+		} else if (type == HCI_COMMAND_PKT) {
+			need = 1 + hdr + out->buf[3];
+		} else {
+			need = 1 + hdr + (out->buf[3] | (out->buf[4] << 8));
+			if (need > (int) sizeof(out->buf)) {
+				ALOGE("Invalid ACL length %d", need);
+				return -EINVAL;
+			}
+		}
+
+		if (out->len == need) {
+			memcpy(dm->tx[dm->tx_num], out->buf, need);
+			dm->tx_iov[dm->tx_num].iov_len = need;
+			dm->tx_num++;
+			out->len = 1;
+			continue;
+		}
+
+		n = read(dm->ends[ch], out->buf + out->len, need - out->len);
+		if (n == 0)
+			return -EPIPE;
+		if (n < 0)
+			return errno == EAGAIN || errno == EINTR ? 0 : -errno;
+		out->len += n;
+	}
+
+	return 0;
+}
+
+static int demux_send(struct hci_demux *dm)
+{
+	int sent = 0, n;
+
+	while (sent < dm->tx_num) {
+		n = sendmmsg(dm->fd, dm->tx_msgs + sent, dm->tx_num - sent, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			dm->lost = 1;
+			return -errno;
+		}
+		sent += n;
+	}
+
+	dm->tx_num = 0;
+
+	return 0;
+}
+
+/* The stack sees the hang up on its ends */
+void hci_demux_hangup(struct hci_demux *dm)
+{
+	int i;
+
+	for (i = 0; i < CH_MAX; i++)
+		shutdown(dm->ends[i], SHUT_RDWR);
+}
+
+static void *demux_thread(void *param)
+{
+	struct hci_demux *dm = param;
+	struct pollfd fds[6];
+	int i, ret = 0;
+
+	ALOGI("%s", __func__);
+
+	fds[0].fd = dm->fd;
+	fds[1].fd = dm->ends[CH_CMD];
+	fds[2].fd = dm->ends[CH_ACL_OUT];
+	fds[3].fd = dm->stop_fd;
+	for (i = 0; i < 4; i++)
+		fds[i].events = POLLIN;
+	fds[4].events = POLLOUT;
+	fds[5].events = POLLOUT;
+
+	while (!ret) {
+		/* Backpressure: the user channel waits for the stack */
+		fds[0].events = demux_room(&dm->evt_q) >= DEMUX_INQ_ROOM &&
+				demux_room(&dm->acl_q) >= DEMUX_INQ_ROOM ? POLLIN : 0;
+		/* Polled only with something queued, a closed end hangs up */
+		fds[4].fd = dm->evt_q.len ? dm->ends[CH_EVT] : -1;
+		fds[5].fd = dm->acl_q.len ? dm->ends[CH_ACL_IN] : -1;
+
+		if (poll(fds, 6, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+
+		if (fds[3].revents)
+			break;
+
+		if (fds[0].revents & (POLLERR | POLLHUP)) {
+			dm->lost = 1;
+			ret = -ENODEV;
+			break;
+		}
+
+		if (dm->lpm && (fds[0].revents & POLLIN || fds[1].revents ||
+				fds[2].revents))
+			bt_vendor_lpm_activity(dm->lpm);
+
+		if (fds[4].revents)
+			ret = demux_flush(dm, CH_EVT, &dm->evt_q);
+		if (!ret && fds[5].revents)
+			ret = demux_flush(dm, CH_ACL_IN, &dm->acl_q);
+
+		if (!ret && fds[0].revents & POLLIN)
+			ret = demux_receive(dm);
+
+		/* Commands go ahead of the ACL data in the same batch */
+		if (!ret && fds[1].revents)
+			ret = demux_read_out(dm, CH_CMD, &dm->cmd, HCI_COMMAND_PKT);
+		if (!ret && fds[2].revents)
+			ret = demux_read_out(dm, CH_ACL_OUT, &dm->acl, HCI_ACLDATA_PKT);
+		if (!ret && dm->tx_num)
+			ret = demux_send(dm);
+	}
+
+	if (ret && dm->keep && dm->lost) {
+		/* The batch is for the lost controller */
+		dm->tx_num = 0;
+		ALOGW("User channel lost, demux waiting for recovery");
+	} else if (ret) {
+		ALOGE("User channel demux stopped: %s", strerror(-ret));
+		hci_demux_hangup(dm);
+	}
+
+	return NULL;
+}
+
+/*
+ * Create the per-channel sockets, their stack ends are stored in
+ * fd_array. The user channel is only read once hci_demux_start() is
+ * called, after the bind.
+ */
+struct hci_demux *hci_demux_new(int fd, int *fd_array, struct bt_vendor_lpm *lpm)
+{
+	struct hci_demux *dm;
+	int sv[2], i, size = DEMUX_SNDBUF;
+
+	dm = calloc(1, sizeof(*dm));
+	if (!dm)
+		return NULL;
+
+	dm->fd = fd;
+	dm->lpm = lpm;
+	dm->stop_fd = -1;
+	for (i = 0; i < CH_MAX; i++)
+		dm->ends[i] = dm->stack[i] = -1;
+
+	for (i = 0; i < CH_MAX; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+			ALOGE("socketpair error %s", strerror(errno));
+			goto failure;
+		}
+		dm->ends[i] = sv[0];
+		dm->stack[i] = sv[1];
+		fd_array[i] = sv[1];
+	}
+
+	/* The stack writes on these, the demux reads them as they come */
+	for (i = 0; i < CH_MAX; i++) {
+		if (i == CH_CMD || i == CH_ACL_OUT)
+			shutdown(dm->ends[i], SHUT_WR);
+		else
+			shutdown(dm->ends[i], SHUT_RD);
+	}
+
+	setsockopt(dm->ends[CH_ACL_IN], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	dm->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (dm->stop_fd < 0)
+		goto failure;
+
+	for (i = 0; i < DEMUX_BATCH; i++) {
+		dm->rx_iov[i].iov_base = dm->rx[i];
+		dm->rx_iov[i].iov_len = sizeof(dm->rx[i]);
+		dm->rx_msgs[i].msg_hdr.msg_iov = &dm->rx_iov[i];
+		dm->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+
+		dm->tx_iov[i].iov_base = dm->tx[i];
+		dm->tx_msgs[i].msg_hdr.msg_iov = &dm->tx_iov[i];
+		dm->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	dm->cmd.buf[0] = HCI_COMMAND_PKT;
+	dm->cmd.len = 1;
+	dm->acl.buf[0] = HCI_ACLDATA_PKT;
+	dm->acl.len = 1;
+
+	return dm;
+
+failure:
+	hci_demux_free(dm);
+	return NULL;
+}
+
+/*
+ * Start moving packets. With keep set, a lost user channel only stops the
+ * demux, see hci_demux_stop().
+ */
+int hci_demux_start(struct hci_demux *dm, int keep)
+{
+	int i, ret;
+
+	if (dm->started)
+		return 0;
+
+	dm->keep = keep;
+	dm->lost = 0;
+
+	/*
+	 * Reads are drained until EAGAIN, the stack may write in pieces.
+	 * Writes never wait for the stack to read, see demux_put().
+	 */
+	for (i = 0; i < CH_MAX; i++)
+		fcntl(dm->ends[i], F_SETFL, O_NONBLOCK);
+
+	ret = pthread_create(&dm->thread, NULL, demux_thread, dm);
+	if (ret) {
+		ALOGE("Unable to create demux thread: %s", strerror(ret));
+		return -1;
+	}
+
+	dm->started = 1;
+
+	return 0;
+}
+
+/*
+ * Stop the demux thread, for the user channel to be replaced. The stack
+ * ends stay open, what the stack writes meanwhile waits in their buffers.
+ */
+void hci_demux_stop(struct hci_demux *dm)
+{
+	uint64_t one = 1;
+
+	if (!dm->started)
+		return;
+
+	if (write(dm->stop_fd, &one, sizeof(one)) < 0)
+		ALOGW("Unable to stop demux: %s", strerror(errno));
+	pthread_join(dm->thread, NULL);
+
+	/* Not to stop the next start right away */
+	if (read(dm->stop_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		ALOGW("Unable to reset demux stop: %s", strerror(errno));
+
+	dm->started = 0;
+}
+
+/*
+ * Queue an event for the stack, delivered ahead of what the user channel
+ * gives once started. The demux must be stopped.
+ */
+int hci_demux_event(struct hci_demux *dm, const uint8_t *evt, int len)
+{
+	return demux_put(dm, CH_EVT, &dm->evt_q, evt, len);
+}
+
+/* Stop the demux and close all the channel sockets, stack ends included */
+void hci_demux_free(struct hci_demux *dm)
+{
+	int i;
+
+	if (!dm)
+		return;
+
+	hci_demux_stop(dm);
+
+	for (i = 0; i < CH_MAX; i++) {
+		if (dm->ends[i] >= 0)
+			close(dm->ends[i]);
+		if (dm->stack[i] >= 0)
+			close(dm->stack[i]);
+	}
+
+	if (dm->stop_fd >= 0)
+		close(dm->stop_fd);
+
+	free(dm->evt_q.buf);
+	free(dm->acl_q.buf);
+	free(dm);
+}
@@ -0,0 +1,377 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * Patch download on the user channel, from a bseq file: command records
+ * (0x01, opcode, length, parameters) each followed by the event records
+ * (0x02, code, length, parameters) the controller must answer with.
+ * Commands only answered by their Command Complete are pipelined up to
+ * the command credits of the controller, the others are sent alone.
+ */
+
+#define LOG_TAG "bt_vendor_fw"
+#define ATRACE_TAG ATRACE_TAG_HAL
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <utils/Log.h>
+#include <cutils/trace.h>
+
+#include "bt_vendor_linux.h"
+
+#define FW_RECORD_CMD		0x01
+#define FW_RECORD_EVT		0x02
+
+#define FW_EVENT_TIMEOUT	2000 /* 2000ms */
+/* Events expected from the commands in flight */
+#define FW_PENDING_MAX		64
+
+#define HCI_OP_INTEL_MFG	0xfc11
+#define HCI_OP_INTEL_VERSION	0xfc05
+
+/* Manufacturer mode exit: keep patches, drop them */
+#define FW_MFG_EXIT_ACTIVATE	0x02
+#define FW_MFG_EXIT_DEACTIVATE	0x01
+
+struct fw_event {
+	const uint8_t *data;	/* Code, length, parameters */
+	int len;
+	/* Command Complete of a command in flight */
+	int completes;
+};
+
+struct fw_download {
+	int fd;
+	const uint8_t *map;
+	size_t size;
+	size_t pos;
+	/* Command credits from the last Command Complete */
+	int credits;
+	int inflight;
+	struct fw_event pending[FW_PENDING_MAX];
+	int head, num;
+	int progress;
+};
+
+/* Bytes of the record at pos, 0 if truncated */
+static int fw_record_len(const struct fw_download *fw, size_t pos)
+{
+	size_t hdr, len;
+
+	if (pos >= fw->size)
+		return 0;
+
+	if (fw->map[pos] == FW_RECORD_CMD)
+		hdr = 4;
+	else if (fw->map[pos] == FW_RECORD_EVT)
+		hdr = 3;
+	else
+		return 0;
+
+	if (pos + hdr > fw->size)
+		return 0;
+
+	len = hdr + fw->map[pos + hdr - 1];
+
+	return pos + len <= fw->size ? (int) len : 0;
+}
+
+/*
+ * Number of events answering the command at pos. A command can share the
+ * controller with others when its only answer is its own Command Complete.
+ */
+static int fw_cmd_events(const struct fw_download *fw, size_t pos, int *pipelined)
+{
+	const uint8_t *cmd = fw->map + pos, *evt;
+	int len, n = 0;
+
+	*pipelined = 0;
+
+	pos += fw_record_len(fw, pos);
+	while ((len = fw_record_len(fw, pos)) && fw->map[pos] == FW_RECORD_EVT) {
+		evt = fw->map + pos;
+		if (!n && evt[1] == HCI_EV_CMD_COMPLETE && evt[2] >= 3 &&
+		    evt[4] == cmd[1] && evt[5] == cmd[2])
+			*pipelined = 1;
+		pos += len;
+		n++;
+	}
+
+	if (n != 1)
+		*pipelined = 0;
+
+	return n;
+}
+
+/* Send the command at fw->pos and queue the events it expects */
+static int fw_send(struct fw_download *fw)
+{
+	int len = fw_record_len(fw, fw->pos);
+	int i, n = 0;
+
+	/* The record type of a command is its H4 type */
+	bt_vendor_trace(TRACE_HCI_COMMAND, fw->map + fw->pos + 1, len - 1);
+
+	if (write(fw->fd, fw->map + fw->pos, len) != len) {
+		ALOGE("Unable to send patch command: %s", strerror(errno));
+		return -EIO;
+	}
+
+	fw->pos += len;
+
+	while ((len = fw_record_len(fw, fw->pos)) &&
+	       fw->map[fw->pos] == FW_RECORD_EVT) {
+		i = (fw->head + fw->num++) % FW_PENDING_MAX;
+		fw->pending[i].data = fw->map + fw->pos + 1;
+		fw->pending[i].len = len - 1;
+		fw->pending[i].completes = 0;
+		fw->pos += len;
+		n++;
+	}
+
+	/* The last event of a command ends it */
+	if (n) {
+		fw->pending[(fw->head + fw->num - 1) % FW_PENDING_MAX].completes = 1;
+		fw->inflight++;
+	}
+
+	return 0;
+}
+
+/* Read one event and check it against the oldest one expected */
+static int fw_receive(struct fw_download *fw)
+{
+	uint8_t buf[HCI_MAX_FRAME_SIZE];
+	struct fw_event *e = &fw->pending[fw->head];
+	struct pollfd pfd;
+	int len;
+
+	pfd.fd = fw->fd;
+	pfd.events = POLLIN;
+
+	while (1) {
+		if (poll(&pfd, 1, FW_EVENT_TIMEOUT) <= 0) {
+			ALOGE("Patch event timed out");
+			return -ETIMEDOUT;
+		}
+
+		len = read(fw->fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -errno;
+		}
+
+		if (len >= 3 && buf[0] == HCI_EVENT_PKT)
+			break;
+	}
+
+	bt_vendor_trace(TRACE_HCI_EVENT, buf + 1, len - 1);
+
+	/* The credits given back depend on the commands in flight */
+	if (buf[1] == HCI_EV_CMD_COMPLETE && len >= 4) {
+		fw->credits = buf[3];
+		if (e->len >= 3)
+			buf[3] = e->data[2];
+	}
+
+	if (len - 1 != e->len || memcmp(buf + 1, e->data, e->len)) {
+		ALOGE("Unexpected patch event 0x%02x at offset %zu",
+		      buf[1], (size_t)(e->data - fw->map));
+		return -EIO;
+	}
+
+	if (e->completes)
+		fw->inflight--;
+	fw->head = (fw->head + 1) % FW_PENDING_MAX;
+	fw->num--;
+
+	return 0;
+}
+
+static int fw_stream(struct fw_download *fw)
+{
+	int ret, events, pipelined, percent;
+	/* A command with answers other than its Command Complete is in flight */
+	int barrier = 0;
+
+	while (fw->pos < fw->size || fw->num) {
+		while (fw->pos < fw->size && !barrier) {
+			if (!fw_record_len(fw, fw->pos) ||
+			    fw->map[fw->pos] != FW_RECORD_CMD) {
+				ALOGE("Invalid patch record at offset %zu", fw->pos);
+				return -EINVAL;
+			}
+
+			events = fw_cmd_events(fw, fw->pos, &pipelined);
+			if (events > FW_PENDING_MAX) {
+				ALOGE("Too many events at offset %zu", fw->pos);
+				return -E2BIG;
+			}
+
+			if (pipelined ? fw->inflight >= (fw->credits ? fw->credits : 1) :
+					fw->inflight > 0)
+				break;
+			if (fw->num + events > FW_PENDING_MAX)
+				break;
+
+			ret = fw_send(fw);
+			if (ret)
+				return ret;
+
+			barrier = !pipelined && events;
+		}
+
+		if (!fw->num)
+			continue;
+
+		ret = fw_receive(fw);
+		if (ret)
+			return ret;
+
+		if (!fw->num)
+			barrier = 0;
+
+		percent = fw->pos * 100 / fw->size;
+		if (percent / 25 != fw->progress / 25)
+			ALOGI("Patch download %d%%", percent);
+		fw->progress = percent;
+		ATRACE_INT("bt fw download", percent);
+	}
+
+	return 0;
+}
+
+static int fw_mfg(int fd, uint8_t enable, uint8_t reset)
+{
+	uint8_t param[2] = { enable, reset };
+	uint8_t status;
+	int len;
+
+	len = hci_send_cmd_sync(fd, HCI_OP_INTEL_MFG, param, sizeof(param),
+				&status, 1, NULL, FW_EVENT_TIMEOUT);
+	if (len < 1 || status) {
+		ALOGE("Manufacturer mode %s failed", enable ? "enter" : "exit");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Patch number of the running firmware, 0 if unpatched, -1 when the
+ * controller does not tell.
+ */
+static int fw_patch_num(int fd)
+{
+	/* Status, platform, variant, revision, fw variant, revision, build num, ww, yy, patch */
+	uint8_t rsp[10];
+	int len;
+
+	len = hci_send_cmd_sync(fd, HCI_OP_INTEL_VERSION, NULL, 0, rsp,
+				sizeof(rsp), NULL, FW_EVENT_TIMEOUT);
+	if (len < (int) sizeof(rsp) || rsp[0])
+		return -1;
+
+	return rsp[9];
+}
+
+/*
+ * Download the patch file at path to the controller bound to fd, unless
+ * it already runs a patched firmware. Returns 0 or -errno.
+ */
+int hci_fw_download(int fd, const char *path)
+{
+	struct fw_download fw;
+	struct stat st;
+	void *map;
+	int map_fd, ret, patch;
+
+	patch = fw_patch_num(fd);
+	if (patch > 0) {
+		ALOGI("Firmware already patched (%d)", patch);
+		return 0;
+	}
+
+	map_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (map_fd < 0) {
+		ALOGE("Unable to open %s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	if (fstat(map_fd, &st) < 0) {
+		ret = -errno;
+		close(map_fd);
+		return ret;
+	}
+
+	if (st.st_size == 0) {
+		ALOGE("Empty patch file %s", path);
+		close(map_fd);
+		return -EINVAL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, map_fd, 0);
+	close(map_fd);
+	if (map == MAP_FAILED) {
+		ALOGE("Unable to map %s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	/* Read once, front to back */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	madvise(map, st.st_size, MADV_WILLNEED);
+
+	memset(&fw, 0, sizeof(fw));
+	fw.fd = fd;
+	fw.map = map;
+	fw.size = st.st_size;
+	fw.credits = 1;
+
+	ALOGI("Downloading %s, %zu bytes", path, fw.size);
+
+	ATRACE_BEGIN("bt fw download");
+	ret = fw_mfg(fd, 1, 0);
+	if (!ret) {
+		ret = fw_stream(&fw);
+		/* The controller resets, with the patches only if all went in */
+		if (fw_mfg(fd, 0, ret ? FW_MFG_EXIT_DEACTIVATE : FW_MFG_EXIT_ACTIVATE) && !ret)
+			ret = -EIO;
+	}
+	ATRACE_END();
+
+	munmap(map, st.st_size);
+
+	if (!ret && fw_patch_num(fd) == 0) {
+		ALOGE("Patch not active after download");
+		ret = -EIO;
+	}
+
+	if (ret)
+		ALOGE("Patch download failed: %s", strerror(-ret));
+	else
+		ALOGI("Patch download complete");
+
+	return ret;
+}
@@ -0,0 +1,128 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * HCI commands issued by the vendor library itself on the user channel,
+ * while it still owns the socket: between the bind in FW_CFG and fwcfg_cb.
+ */
+
+#define LOG_TAG "bt_vendor_hci"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <utils/Log.h>
+
+#include "bt_vendor_linux.h"
+
+static int hci_elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Send a command and wait for its Command Complete event, any other
+ * packet read in the meantime is dropped. The return parameters, starting
+ * with the status, are copied to rsp and the command credits given back
+ * to ncmd, if not NULL. Returns the parameters length or -errno.
+ */
+int hci_send_cmd_sync(int fd, uint16_t opcode, const void *param, uint8_t plen,
+		      uint8_t *rsp, int rsp_size, uint8_t *ncmd, int timeout_ms)
+{
+	uint8_t buf[HCI_MAX_FRAME_SIZE];
+	struct timespec start;
+	struct pollfd pfd;
+	int len, remaining;
+
+	buf[0] = HCI_COMMAND_PKT;
+	buf[1] = opcode & 0xff;
+	buf[2] = opcode >> 8;
+	buf[3] = plen;
+	if (plen)
+		memcpy(buf + 4, param, plen);
+
+	bt_vendor_trace(TRACE_HCI_COMMAND, buf + 1, 3 + plen);
+
+	if (write(fd, buf, 4 + plen) != 4 + plen) {
+		ALOGE("Unable to send command 0x%04x: %s", opcode, strerror(errno));
+		return -EIO;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (1) {
+		remaining = timeout_ms - hci_elapsed_ms(&start);
+		if (remaining <= 0 || poll(&pfd, 1, remaining) <= 0) {
+			ALOGE("Command 0x%04x timed out", opcode);
+			return -ETIMEDOUT;
+		}
+
+		if (pfd.revents & (POLLERR | POLLHUP))
+			return -EIO;
+
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -errno;
+		}
+
+		/* H4 type, event code, parameter length */
+		if (len < 3 || buf[0] != HCI_EVENT_PKT)
+			continue;
+
+		bt_vendor_trace(TRACE_HCI_EVENT, buf + 1, len - 1);
+
+		if (buf[1] == HCI_EV_CMD_STATUS && len >= 7 &&
+		    (buf[5] | (buf[6] << 8)) == opcode) {
+			if (buf[3] != 0) {
+				ALOGE("Command 0x%04x failed with status 0x%02x",
+				      opcode, buf[3]);
+				return -EIO;
+			}
+			continue;
+		}
+
+		/* ncmd, opcode and at least the status */
+		if (buf[1] != HCI_EV_CMD_COMPLETE || len < 7 ||
+		    (buf[4] | (buf[5] << 8)) != opcode)
+			continue;
+
+		if (ncmd)
+			*ncmd = buf[3];
+
+		len -= 6;
+		if (len > rsp_size)
+			len = rsp_size;
+		if (rsp)
+			memcpy(rsp, buf + 6, len);
+
+		return len;
+	}
+}
@@ -17,47 +17,60 @@
  ******************************************************************************/
 
 #define LOG_TAG "bt_vendor"
+#define ATRACE_TAG ATRACE_TAG_HAL
 
 #include <errno.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 
 #include "bt_vendor_lib.h"
+#include "bt_vendor_linux.h"
 #include <utils/Log.h>
 #include <cutils/properties.h>
-
-#define BTPROTO_HCI	1
-#define HCI_CHANNEL_USER	1
-#define HCI_CHANNEL_CONTROL	3
-#define HCI_DEV_NONE	0xffff
+#include <cutils/trace.h>
 
 #define RFKILL_TYPE_BLUETOOTH	2
+#define RFKILL_OP_ADD		0
+#define RFKILL_OP_DEL		1
+#define RFKILL_OP_CHANGE	2
 #define RFKILL_OP_CHANGE_ALL	3
-
-#define MGMT_OP_INDEX_LIST	0x0003
-#define MGMT_EV_INDEX_ADDED	0x0004
-#define MGMT_EV_COMMAND_COMP	0x0001
-#define MGMT_EV_SIZE_MAX	1024
-#define MGMT_EV_POLL_TIMEOUT	3000 /* 3000ms */
+#define RFKILL_RADIO_MAX	8
+#define RFKILL_CONFIRM_TIMEOUT	1000 /* 1000ms */
+
+/*
+ * The HCI device wait deadline is learned from the last enumeration
+ * times, between MIN and the bluetooth.hcidev_timeout property. DEFAULT
+ * applies until a first enumeration is seen.
+ */
+#define HCIDEV_TIMEOUT_MIN	1000 /* 1000ms */
+#define HCIDEV_TIMEOUT_DEFAULT	3000 /* 3000ms */
+#define HCIDEV_TIMEOUT_MAX	10000 /* 10000ms */
+#define HCIDEV_TIMEOUT_MARGIN	500 /* 500ms */
+#define HCIDEV_SAMPLES		8
+
+#define WARM_RESET_TIMEOUT	1000 /* 1000ms */
+
+/* Time a lost controller has to come back, and between bind attempts */
+#define RECOVERY_TIMEOUT	5000 /* 5000ms */
+#define RECOVERY_RETRY_US	20000 /* 20ms */
 
 #define IOCTL_HCIDEVDOWN	_IOW('H', 202, int)
 
 #ifdef USE_CELLULAR_COEX
-int hci_bind_client_init(void);
-int hci_bind_client_cleanup(void);
+#include "hci_service.h"
 #endif
 
-struct sockaddr_hci {
-	sa_family_t    hci_family;
-	unsigned short hci_dev;
-	unsigned short hci_channel;
-};
-
 struct rfkill_event {
 	uint32_t idx;
 	uint8_t  type;
@@ -65,28 +78,110 @@ struct rfkill_event {
 	uint8_t  soft, hard;
 } __attribute__((packed));
 
-struct mgmt_pkt {
-        uint16_t opcode;
-        uint16_t index;
-        uint16_t len;
-        uint8_t  data[MGMT_EV_SIZE_MAX];
-} __attribute__((packed));
+/* Bluetooth radios known to /dev/rfkill, kept up to date from its events */
+struct rfkill_radio {
+	uint32_t idx;
+	uint8_t  soft, hard;
+};
 
-struct mgmt_event_read_index {
-	uint16_t cc_opcode;
-	uint8_t  status;
-	uint16_t num_intf;
-	uint16_t index[0];
-} __attribute__((packed));
+/*
+ * State of one controller binding. The library interface drives the
+ * default instance, bt_vendor_ctx_new() gives independent ones to hosts
+ * handling several controllers.
+ */
+struct bt_vendor_ctx {
+	const bt_vendor_callbacks_t *callbacks;
+	unsigned char local_bdaddr[6];
+	int fd;
+	/* fd is bound to the HCI user channel */
+	int fd_bound;
+	int hci_interface;
+	/* Selection policy when bluetooth.interface is "auto", or NULL */
+	char *hci_match;
+	int rfkill_en;
+	int bt_hwcfg_en;
+	int fast_pwr_on_en;
+	/* Bind the user channel as soon as the controller registers */
+	int fast_claim_en;
+	int hcidev_timeout_max;
+	int warm_standby_en;
+	/* Per channel sockets for multi-channel transport stacks */
+	int demux_en;
+	struct hci_demux *demux;
+	/* Controller capabilities, valid from FW_CFG on */
+	struct hci_caps caps;
+	int caps_valid;
+	/* Low power mode policy, survives cleanup */
+	struct bt_vendor_lpm *lpm;
+	/* Where to dump the trace ring on failures and cleanup, or empty */
+	char trace_file[PROPERTY_VALUE_MAX];
+	/* Where to keep the operation statistics current, or empty */
+	char stats_file[PROPERTY_VALUE_MAX];
+	/* Patch downloaded after the bind, or empty */
+	char fw_patch[PROPERTY_VALUE_MAX];
+
+	/*
+	 * Bound user channel socket kept by bt_vendor_close() in warm standby,
+	 * handed back by the next bt_vendor_open(). Survives cleanup.
+	 */
+	int parked_fd;
+	int parked_index;
+
+	/* Recent HCI device enumeration times in ms, see bt_vendor_wait_hcidev() */
+	int hcidev_samples[HCIDEV_SAMPLES];
+	int hcidev_num_samples;
+	int hcidev_next_sample;
+
+	int rfkill_fd;
+	struct rfkill_radio rfkill_radios[RFKILL_RADIO_MAX];
+	int rfkill_num_radios;
+	/* Duration of the last confirmed rfkill transition */
+	int rfkill_transition_ms;
+
+	/* FW_CFG worker, see bt_vendor_fw_cfg() */
+	pthread_t fw_cfg_thread;
+	/* When the stack asked for FW_CFG, for the statistics */
+	uint64_t fw_cfg_start_us;
+	pthread_mutex_t fw_cfg_lock;
+	pthread_cond_t fw_cfg_cond;
+	int fw_cfg_thread_started;
+	int fw_cfg_requested;
+	volatile int fw_cfg_cancelled;
+	/* Started with a warm standby channel to reuse, its index off mgmt */
+	int fw_cfg_warm;
+
+	/* Rebinds the user channel when the controller goes away */
+	int watchdog_en;
+	pthread_t watchdog_thread;
+	int watchdog_started;
+	/* Signalled by the mgmt monitor on removal, and to stop */
+	int watchdog_fd;
+	int watchdog_stop_fd;
+	volatile int watchdog_stop;
+};
 
+/* Callbacks of the default instance, used by hci_service.c */
 const bt_vendor_callbacks_t *bt_vendor_callbacks = NULL;
-static unsigned char bt_vendor_local_bdaddr[6];
-static int bt_vendor_fd = -1;
-static int hci_interface = 0;
-static int rfkill_en = 0;
-static int bt_hwcfg_en = 0;
 
-static int bt_vendor_init(const bt_vendor_callbacks_t *p_cb, unsigned char *local_bdaddr)
+static struct bt_vendor_ctx bt_vendor_default = {
+	.fd = -1,
+	.hcidev_timeout_max = HCIDEV_TIMEOUT_MAX,
+	.parked_fd = -1,
+	.parked_index = -1,
+	.rfkill_fd = -1,
+	.rfkill_transition_ms = -1,
+	.watchdog_fd = -1,
+	.watchdog_stop_fd = -1,
+	.fw_cfg_lock = PTHREAD_MUTEX_INITIALIZER,
+	.fw_cfg_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void bt_vendor_fw_cfg_cancel(struct bt_vendor_ctx *ctx);
+static void bt_vendor_watchdog_stop(struct bt_vendor_ctx *ctx);
+static int bt_vendor_rfkill_open(struct bt_vendor_ctx *ctx);
+
+int bt_vendor_ctx_init(struct bt_vendor_ctx *ctx, const bt_vendor_callbacks_t *p_cb,
+		       unsigned char *local_bdaddr)
 {
 	char prop_value[PROPERTY_VALUE_MAX];
 
@@ -97,316 +192,1206 @@ static int bt_vendor_init(const bt_vendor_callbacks_t *p_cb, unsigned char *loca
 		return -1;
 	}
 
-	bt_vendor_callbacks = p_cb;
+	ctx->callbacks = p_cb;
 
-	memcpy(bt_vendor_local_bdaddr, local_bdaddr, sizeof(bt_vendor_local_bdaddr));
+	memcpy(ctx->local_bdaddr, local_bdaddr, sizeof(ctx->local_bdaddr));
 
 	property_get("bluetooth.interface", prop_value, "0");
 
-	errno = 0;
-	if (memcmp(prop_value, "hci", 3))
-		hci_interface = strtol(prop_value, (char **)NULL, 10);
-	else
-		hci_interface = strtol(prop_value + 3, (char **)NULL, 10);
-	if (errno)
-		hci_interface = 0;
+	free(ctx->hci_match);
+	ctx->hci_match = NULL;
 
-	ALOGI("Using interface hci%d", hci_interface);
+	if (!strcmp(prop_value, "auto")) {
+		/* "any", a bus name such as "usb", or a bdaddr */
+		property_get("bluetooth.interface.match", prop_value, "any");
+		ctx->hci_match = strdup(prop_value);
+		if (!ctx->hci_match)
+			return -1;
+		ctx->hci_interface = -1;
+
+		ALOGI("Selecting interface matching %s", ctx->hci_match);
+	} else {
+		errno = 0;
+		if (memcmp(prop_value, "hci", 3))
+			ctx->hci_interface = strtol(prop_value, (char **)NULL, 10);
+		else
+			ctx->hci_interface = strtol(prop_value + 3, (char **)NULL, 10);
+		if (errno)
+			ctx->hci_interface = 0;
+
+		ALOGI("Using interface hci%d", ctx->hci_interface);
+	}
 
 	property_get("bluetooth.rfkill", prop_value, "0");
 
-	rfkill_en = atoi(prop_value);
-	if (rfkill_en)
+	ctx->rfkill_en = atoi(prop_value);
+	if (ctx->rfkill_en) {
 		ALOGI("RFKILL enabled");
+		/* Not fatal, retried on power control */
+		bt_vendor_rfkill_open(ctx);
+	}
 
-	bt_hwcfg_en = property_get("bluetooth.hwcfg", prop_value, NULL) > 0 ? 1 : 0;
-	if (bt_hwcfg_en)
+	ctx->bt_hwcfg_en = property_get("bluetooth.hwcfg", prop_value, NULL) > 0 ? 1 : 0;
+	if (ctx->bt_hwcfg_en)
 		ALOGI("HWCFG enabled");
 
-#ifdef USE_CELLULAR_COEX
-	hci_bind_client_init();
-#endif
+	property_get("bluetooth.hcidev_timeout", prop_value, "0");
+
+	ctx->hcidev_timeout_max = atoi(prop_value);
+	if (ctx->hcidev_timeout_max < HCIDEV_TIMEOUT_MIN)
+		ctx->hcidev_timeout_max = HCIDEV_TIMEOUT_MAX;
+
+	property_get("bluetooth.warmstandby", prop_value, "0");
+
+	ctx->warm_standby_en = atoi(prop_value);
+	if (ctx->warm_standby_en)
+		ALOGI("Warm standby enabled");
+
+	property_get("bluetooth.demux", prop_value, "0");
+
+	ctx->demux_en = atoi(prop_value);
+	if (ctx->demux_en)
+		ALOGI("User channel demux enabled");
+
+	/* Vendor command driving the controller sleep, board specific */
+	property_get("bluetooth.lpm.opcode", prop_value, "0");
+
+	if (!ctx->lpm) {
+		ctx->lpm = bt_vendor_lpm_new();
+		if (!ctx->lpm)
+			return -1;
+	}
+	bt_vendor_lpm_init(ctx->lpm, p_cb, strtol(prop_value, (char **)NULL, 16));
+
+	property_get("bluetooth.trace.file", ctx->trace_file, "");
+	property_get("bluetooth.stats.file", ctx->stats_file, "");
+	property_get("bluetooth.fw.patch", ctx->fw_patch, "");
+
+	property_get("bluetooth.watchdog", prop_value, "0");
+
+	ctx->watchdog_en = atoi(prop_value);
+	if (ctx->watchdog_en)
+		ALOGI("Controller watchdog enabled");
+
+	property_get("bluetooth.fastclaim", prop_value, "0");
+
+	ctx->fast_claim_en = atoi(prop_value);
+	if (ctx->fast_claim_en)
+		ALOGI("Fast claim enabled");
+
+	property_get("bluetooth.fastpoweron", prop_value, "0");
+
+	ctx->fast_pwr_on_en = atoi(prop_value);
+	if (ctx->fast_pwr_on_en)
+		ALOGI("Fast power on enabled");
+
+	/* Not fatal, FW_CFG retries to start it */
+	if (mgmt_monitor_start())
+		ALOGE("Unable to start mgmt monitor");
 
 	return 0;
 }
 
-static int bt_vendor_hw_cfg(int stop)
+static int bt_vendor_hw_cfg(struct bt_vendor_ctx *ctx, int stop)
 {
-	if (!bt_hwcfg_en)
+	int ret;
+
+	if (!ctx->bt_hwcfg_en)
 		return 0;
 
-	if (stop) {
-		if (property_set("bluetooth.hwcfg", "stop") < 0) {
-			ALOGE("%s cannot stop btcfg service via prop", __func__);
-			return 1;
-		}
-	} else {
-		if (property_set("bluetooth.hwcfg", "start") < 0) {
-			ALOGE("%s cannot start btcfg service via prop", __func__);
-			return 1;
-		}
+	ATRACE_BEGIN(stop ? "bt hwcfg stop" : "bt hwcfg start");
+	ret = property_set("bluetooth.hwcfg", stop ? "stop" : "start");
+	ATRACE_END();
+
+	if (ret < 0) {
+		ALOGE("%s cannot %s btcfg service via prop", __func__,
+		      stop ? "stop" : "start");
+		return 1;
 	}
 	return 0;
 }
 
-static int bt_vendor_wait_hcidev(void)
+/*
+ * Twice the slowest recent enumeration plus a margin. Until a first
+ * enumeration is seen, DEFAULT. Either way uevent
+ * activity extends it up to the bluetooth.hcidev_timeout maximum.
+ */
+static int bt_vendor_hcidev_timeout(struct bt_vendor_ctx *ctx)
 {
-	struct sockaddr_hci addr;
-	struct pollfd fds[1];
-	struct mgmt_pkt ev;
-	int fd;
-	int ret = 0;
+	int i, timeout = 0;
 
-	ALOGI("%s", __func__);
-
-	fd = socket(PF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
-	if (fd < 0) {
-		ALOGE("Bluetooth socket error: %s", strerror(errno));
-		return -1;
+	if (!ctx->hcidev_num_samples) {
+		timeout = HCIDEV_TIMEOUT_DEFAULT;
+	} else {
+		for (i = 0; i < ctx->hcidev_num_samples; i++) {
+			if (ctx->hcidev_samples[i] > timeout)
+				timeout = ctx->hcidev_samples[i];
+		}
+		timeout = 2 * timeout + HCIDEV_TIMEOUT_MARGIN;
 	}
 
-	memset(&addr, 0, sizeof(addr));
-	addr.hci_family = AF_BLUETOOTH;
-	addr.hci_dev = HCI_DEV_NONE;
-	addr.hci_channel = HCI_CHANNEL_CONTROL;
+	if (timeout < HCIDEV_TIMEOUT_MIN)
+		timeout = HCIDEV_TIMEOUT_MIN;
+	if (timeout > ctx->hcidev_timeout_max)
+		timeout = ctx->hcidev_timeout_max;
 
-	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-		ALOGE("HCI Channel Control: %s", strerror(errno));
-		close(fd);
-		return -1;
+	return timeout;
+}
+
+static int bt_vendor_wait_hcidev(struct bt_vendor_ctx *ctx)
+{
+	struct timespec start, end;
+	int timeout = bt_vendor_hcidev_timeout(ctx);
+	uint64_t start_us = bt_vendor_stats_now();
+	int ret;
+
+	ALOGI("%s timeout %d ms", __func__, timeout);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* The deadline is pushed back while devices keep showing up */
+	ATRACE_BEGIN("bt wait hcidev");
+	if (ctx->hci_match) {
+		/* Keeps the controller selected on a previous power cycle */
+		ret = mgmt_monitor_select_index(ctx->hci_match, ctx, timeout,
+						ctx->hcidev_timeout_max,
+						&ctx->fw_cfg_cancelled);
+		if (ret >= 0) {
+			ctx->hci_interface = ret;
+			ALOGI("Selected interface hci%d", ret);
+			ret = 0;
+		}
+	} else {
+		/* Also done once the fast claim is bound, see FW_CFG */
+		ret = mgmt_monitor_wait_index(ctx->hci_interface, ctx, timeout,
+					      ctx->hcidev_timeout_max,
+					      &ctx->fw_cfg_cancelled);
 	}
+	ATRACE_END();
 
-	fds[0].fd = fd;
-	fds[0].events = POLLIN;
+	if (ret != -ECANCELED)
+		bt_vendor_stats_record(STATS_WAIT_HCIDEV, start_us, ret != 0);
 
-	/* Read Controller Index List Command */
-	ev.opcode = MGMT_OP_INDEX_LIST;
-	ev.index = HCI_DEV_NONE;
-	ev.len = 0;
-	if (write(fd, &ev, 6) != 6) {
-		ALOGE("Unable to write mgmt command: %s", strerror(errno));
-		ret = -1;
-		goto end;
+	switch (ret) {
+	case 0:
+		break;
+	case -ECANCELED:
+		ALOGI("Waiting for HCI device cancelled");
+		return -1;
+	case -ENODEV:
+		ALOGE("HCI device transport removed");
+		return -1;
+	case -ETIMEDOUT:
+		ALOGE("Timeout, no HCI device detected");
+		return -1;
+	default:
+		ALOGE("Waiting for HCI device failed: %s", strerror(-ret));
+		return -1;
 	}
 
-	while (1) {
-		int n = poll(fds, 1, MGMT_EV_POLL_TIMEOUT);
-		if (n == -1) {
-			ALOGE("Poll error: %s", strerror(errno));
-			ret = -1;
-			break;
-		} else if (n == 0) {
-			ALOGE("Timeout, no HCI device detected");
-			ret = -1;
-			break;
-		}
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-		if (fds[0].revents & POLLIN) {
-			n = read(fd, &ev, sizeof(struct mgmt_pkt));
-			if (n < 0) {
-				ALOGE("Error reading control channel");
-				ret = -1;
-				break;
-			}
+	ctx->hcidev_samples[ctx->hcidev_next_sample] =
+		(end.tv_sec - start.tv_sec) * 1000 +
+		(end.tv_nsec - start.tv_nsec) / 1000000;
+	ctx->hcidev_next_sample = (ctx->hcidev_next_sample + 1) % HCIDEV_SAMPLES;
+	if (ctx->hcidev_num_samples < HCIDEV_SAMPLES)
+		ctx->hcidev_num_samples++;
 
-			if (ev.opcode == MGMT_EV_INDEX_ADDED &&
-			    ev.index == hci_interface) {
-				goto end;
-			} else if (ev.opcode == MGMT_EV_COMMAND_COMP) {
-				struct mgmt_event_read_index *cc;
-				int i;
+	return 0;
+}
 
-				cc = (struct mgmt_event_read_index *)ev.data;
+/*
+ * Whether the channel parked in warm standby is still bound to the
+ * interface in use. The bind keeps its index off the mgmt index list, the
+ * socket itself reports the loss of the controller.
+ */
+static int bt_vendor_parked_alive(struct bt_vendor_ctx *ctx)
+{
+	struct pollfd pfd;
 
-				if ((cc->cc_opcode != MGMT_OP_INDEX_LIST)
-				    || (cc->status != 0))
-					continue;
+	if (ctx->parked_index != ctx->hci_interface)
+		return 0;
 
-				for (i = 0; i < cc->num_intf; i++) {
-					if (cc->index[i] == hci_interface)
-						goto end;
-				}
-			}
-		}
-	}
+	pfd.fd = ctx->parked_fd;
+	pfd.events = 0;
 
-end:
-	close(fd);
-	return ret;
+	return poll(&pfd, 1, 0) == 0;
 }
 
-static int bt_vendor_open(void *param)
+static int bt_vendor_open(struct bt_vendor_ctx *ctx, void *param)
 {
 	int (*fd_array)[] = (int (*) []) param;
 	int fd;
 
 	ALOGI("%s", __func__);
 
+	if (ctx->parked_fd != -1) {
+		if (bt_vendor_parked_alive(ctx)) {
+			ALOGI("Reusing user channel from warm standby");
+			fd = ctx->parked_fd;
+			ctx->parked_fd = -1;
+			ctx->fd_bound = 1;
+			goto done;
+		}
+
+		close(ctx->parked_fd);
+		ctx->parked_fd = -1;
+	}
+
 	fd = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
 	if (fd < 0) {
 		ALOGE("socket create error %s", strerror(errno));
 		return -1;
 	}
 
+	ctx->fd_bound = 0;
+
+	/* Left to the normal path if the controller is already there */
+	if (ctx->fast_claim_en &&
+	    mgmt_monitor_claim(ctx, fd, ctx->hci_match ? -1 : ctx->hci_interface,
+			       ctx->hci_match))
+		ALOGW("Unable to claim the controller");
+
+done:
+	ctx->fd = fd;
+
+	if (ctx->demux_en) {
+		/* The user channel is only read once bound, see FW_CFG */
+		ctx->demux = hci_demux_new(fd, *fd_array, ctx->lpm);
+		if (ctx->demux) {
+			ALOGI("%s returning %d channels", __func__, CH_MAX);
+			return CH_MAX;
+		}
+
+		ALOGW("Unable to demux user channel, sharing it");
+	}
+
 	(*fd_array)[CH_CMD] = fd;
 	(*fd_array)[CH_EVT] = fd;
 	(*fd_array)[CH_ACL_OUT] = fd;
 	(*fd_array)[CH_ACL_IN] = fd;
 
-	bt_vendor_fd = fd;
-
-	ALOGI("%s returning %d", __func__, bt_vendor_fd);
+	ALOGI("%s returning %d", __func__, ctx->fd);
 
 	return 1;
 }
 
-static int bt_vendor_close(void *param)
+static int bt_vendor_close(struct bt_vendor_ctx *ctx, void *param)
 {
 	(void)(param);
 
 	ALOGI("%s", __func__);
 
-	if (bt_vendor_fd != -1) {
-		close(bt_vendor_fd);
-		bt_vendor_fd = -1;
+	bt_vendor_fw_cfg_cancel(ctx);
+	bt_vendor_watchdog_stop(ctx);
+	mgmt_monitor_unclaim(ctx);
+
+	/* Closes the stack ends as well */
+	hci_demux_free(ctx->demux);
+	ctx->demux = NULL;
+
+	if (ctx->fd != -1) {
+		if (ctx->warm_standby_en && ctx->fd_bound) {
+			ALOGI("Parking user channel for warm standby");
+			if (ctx->parked_fd != -1)
+				close(ctx->parked_fd);
+			ctx->parked_fd = ctx->fd;
+			ctx->parked_index = ctx->hci_interface;
+		} else {
+			close(ctx->fd);
+		}
+		ctx->fd = -1;
+		ctx->fd_bound = 0;
 	}
 
 	return 0;
 }
 
-static int bt_vendor_rfkill(int block)
+/*
+ * Swap the socket behind fd for a fresh unbound one, keeping the
+ * descriptor number the stack knows about.
+ */
+static int bt_vendor_fd_replace(struct bt_vendor_ctx *ctx, int fd)
+{
+	int new_fd;
+
+	new_fd = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+	if (new_fd < 0) {
+		ALOGE("socket create error %s", strerror(errno));
+		return -1;
+	}
+
+	if (dup2(new_fd, fd) < 0) {
+		ALOGE("socket dup error %s", strerror(errno));
+		close(new_fd);
+		return -1;
+	}
+
+	close(new_fd);
+	ctx->fd_bound = 0;
+
+	return 0;
+}
+
+/* Bring a controller reused from warm standby back to its reset state */
+static int bt_vendor_warm_reset(int fd)
+{
+	uint8_t status;
+	int len;
+
+	len = hci_send_cmd_sync(fd, HCI_OP_RESET, NULL, 0, &status, 1, NULL,
+				WARM_RESET_TIMEOUT);
+	if (len < 1 || status) {
+		ALOGE("Warm standby reset failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void bt_vendor_rfkill_handle(struct bt_vendor_ctx *ctx, struct rfkill_event *event)
+{
+	int i;
+
+	if (event->type != RFKILL_TYPE_BLUETOOTH)
+		return;
+
+	for (i = 0; i < ctx->rfkill_num_radios; i++) {
+		if (ctx->rfkill_radios[i].idx == event->idx)
+			break;
+	}
+
+	switch (event->op) {
+	case RFKILL_OP_ADD:
+	case RFKILL_OP_CHANGE:
+		if (i == ctx->rfkill_num_radios) {
+			if (ctx->rfkill_num_radios == RFKILL_RADIO_MAX) {
+				ALOGW("Too many rfkill radios, ignoring %u", event->idx);
+				return;
+			}
+			ctx->rfkill_num_radios++;
+		}
+		ctx->rfkill_radios[i].idx = event->idx;
+		ctx->rfkill_radios[i].soft = event->soft;
+		ctx->rfkill_radios[i].hard = event->hard;
+		break;
+
+	case RFKILL_OP_DEL:
+		if (i == ctx->rfkill_num_radios)
+			return;
+		ctx->rfkill_radios[i] = ctx->rfkill_radios[--ctx->rfkill_num_radios];
+		break;
+	}
+}
+
+/* Consume the pending rfkill events, the state table is then current */
+static void bt_vendor_rfkill_drain(struct bt_vendor_ctx *ctx)
 {
 	struct rfkill_event event;
-	int fd, len;
 
-	ALOGI("%s", __func__);
+	while (read(ctx->rfkill_fd, &event, sizeof(event)) == sizeof(event))
+		bt_vendor_rfkill_handle(ctx, &event);
+}
 
-	fd = open("/dev/rfkill", O_WRONLY);
-	if (fd < 0) {
+static int bt_vendor_rfkill_open(struct bt_vendor_ctx *ctx)
+{
+	ctx->rfkill_fd = open("/dev/rfkill", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (ctx->rfkill_fd < 0) {
 		ALOGE("Unable to open /dev/rfkill");
 		return -1;
 	}
 
+	/* The kernel queues an ADD event for every existing radio */
+	ctx->rfkill_num_radios = 0;
+	bt_vendor_rfkill_drain(ctx);
+
+	return 0;
+}
+
+static void bt_vendor_rfkill_close(struct bt_vendor_ctx *ctx)
+{
+	if (ctx->rfkill_fd < 0)
+		return;
+
+	close(ctx->rfkill_fd);
+	ctx->rfkill_fd = -1;
+	ctx->rfkill_num_radios = 0;
+}
+
+/*
+ * Pick the radio of hci<index>, named after it by the kernel, or the only
+ * Bluetooth radio when there is a single one (platform rfkill of UART
+ * controllers). Returns its position in ctx->rfkill_radios, -EAGAIN if the
+ * index is not selected yet or -ENOENT if none of the radios matches.
+ */
+static int bt_vendor_rfkill_find(struct bt_vendor_ctx *ctx, int index)
+{
+	char path[64], name[32], hci_name[16];
+	FILE *f;
+	int i, len;
+
+	if (ctx->rfkill_num_radios == 1)
+		return 0;
+
+	if (index < 0)
+		return -EAGAIN;
+
+	snprintf(hci_name, sizeof(hci_name), "hci%d", index);
+
+	for (i = 0; i < ctx->rfkill_num_radios; i++) {
+		snprintf(path, sizeof(path), "/sys/class/rfkill/rfkill%u/name",
+			 ctx->rfkill_radios[i].idx);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		len = fgets(name, sizeof(name), f) ? strcspn(name, "\n") : 0;
+		fclose(f);
+		name[len] = '\0';
+
+		if (!strcmp(name, hci_name))
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+static int bt_vendor_rfkill_done(struct bt_vendor_ctx *ctx, uint32_t idx, int block)
+{
+	int i;
+
+	for (i = 0; i < ctx->rfkill_num_radios; i++) {
+		if (ctx->rfkill_radios[i].idx != idx)
+			continue;
+		if (ctx->rfkill_radios[i].soft != block)
+			return 0;
+		return block || !ctx->rfkill_radios[i].hard;
+	}
+
+	/* Removed along with its controller */
+	return block;
+}
+
+/*
+ * Block or unblock the radio of hci<index>. With several Bluetooth radios,
+ * the index must be known: a negative one, not selected yet, leaves the
+ * radios as they are.
+ */
+static int bt_vendor_rfkill(struct bt_vendor_ctx *ctx, int block, int index)
+{
+	struct rfkill_event event;
+	struct timespec start, end;
+	struct pollfd pfd;
+	int radio, len, timeout;
+
+	ALOGI("%s", __func__);
+
+	if (ctx->rfkill_fd < 0 && bt_vendor_rfkill_open(ctx))
+		return -1;
+
+	bt_vendor_rfkill_drain(ctx);
+
+	if (!ctx->rfkill_num_radios) {
+		ALOGW("No Bluetooth rfkill radio");
+		return 0;
+	}
+
+	radio = bt_vendor_rfkill_find(ctx, index);
+	if (radio == -EAGAIN) {
+		ALOGI("rfkill radio chosen once the controller is selected");
+		return 0;
+	}
+	if (radio < 0) {
+		/* Changing all of them would take the other controllers down */
+		ALOGE("No rfkill radio for hci%d among %d", index,
+		      ctx->rfkill_num_radios);
+		return 1;
+	}
+
+	if (bt_vendor_rfkill_done(ctx, ctx->rfkill_radios[radio].idx, block))
+		return 0;
+
+	if (!block && ctx->rfkill_radios[radio].hard) {
+		ALOGE("rfkill%u is hard blocked", ctx->rfkill_radios[radio].idx);
+		return 1;
+	}
+
 	memset(&event, 0, sizeof(struct rfkill_event));
-	event.op = RFKILL_OP_CHANGE_ALL;
+	event.op = RFKILL_OP_CHANGE;
+	event.idx = ctx->rfkill_radios[radio].idx;
 	event.type = RFKILL_TYPE_BLUETOOTH;
 	event.hard = block;
 	event.soft = block;
 
-	len = write(fd, &event, sizeof(event));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ATRACE_BEGIN("bt rfkill write");
+	len = write(ctx->rfkill_fd, &event, sizeof(event));
+	ATRACE_END();
 	if (len < 0) {
 		ALOGE("Failed to change rfkill state");
-		close(fd);
 		return 1;
 	}
 
-	close(fd);
+	/* Wait for the kernel to report the new state */
+	pfd.fd = ctx->rfkill_fd;
+	pfd.events = POLLIN;
+	timeout = RFKILL_CONFIRM_TIMEOUT;
+
+	ATRACE_BEGIN("bt rfkill confirm");
+	while (!bt_vendor_rfkill_done(ctx, event.idx, block)) {
+		if (timeout <= 0 || poll(&pfd, 1, timeout) <= 0) {
+			ATRACE_END();
+			ALOGE("rfkill change not confirmed");
+			return 1;
+		}
+
+		bt_vendor_rfkill_drain(ctx);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		timeout = RFKILL_CONFIRM_TIMEOUT -
+			  ((end.tv_sec - start.tv_sec) * 1000 +
+			   (end.tv_nsec - start.tv_nsec) / 1000000);
+	}
+	ATRACE_END();
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ctx->rfkill_transition_ms = (end.tv_sec - start.tv_sec) * 1000 +
+				    (end.tv_nsec - start.tv_nsec) / 1000000;
+
+	ALOGI("rfkill %s in %d ms", block ? "blocked" : "unblocked",
+	      ctx->rfkill_transition_ms);
+
 	return 0;
 }
 
-/* TODO: fw config should thread the device waiting and return immedialty */
-static void bt_vendor_fw_cfg(void)
+/* Refresh the statistics file, if any, at the end of each phase */
+static void bt_vendor_stats_update(struct bt_vendor_ctx *ctx)
+{
+	if (ctx->stats_file[0])
+		bt_vendor_stats_dump_file(ctx->stats_file);
+}
+
+/* Force the interface down and bind fd to its user channel */
+static int bt_vendor_bind(struct bt_vendor_ctx *ctx, int fd)
 {
 	struct sockaddr_hci addr;
-	int fd = bt_vendor_fd;
+	uint64_t start_us;
+	int ret;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = ctx->hci_interface;
+	addr.hci_channel = HCI_CHANNEL_USER;
+
+	/* Force interface down to use HCI user channel */
+	start_us = bt_vendor_stats_now();
+	ATRACE_BEGIN("bt HCIDEVDOWN");
+	ret = ioctl(fd, IOCTL_HCIDEVDOWN, ctx->hci_interface);
+	ATRACE_END();
+	bt_vendor_stats_record(STATS_HCIDEVDOWN, start_us, ret != 0);
+	if (ret) {
+		ALOGE("HCIDEVDOWN ioctl error: %s", strerror(errno));
+		return -1;
+	}
+
+	start_us = bt_vendor_stats_now();
+	ATRACE_BEGIN("bt user channel bind");
+	ret = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+	ATRACE_END();
+	bt_vendor_stats_record(STATS_BIND, start_us, ret < 0);
+	if (ret < 0) {
+		ALOGE("socket bind error %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bt_vendor_fw_download(struct bt_vendor_ctx *ctx, int fd)
+{
+	uint64_t start_us;
+	int ret;
+
+	if (!ctx->fw_patch[0])
+		return 0;
+
+	start_us = bt_vendor_stats_now();
+	ret = hci_fw_download(fd, ctx->fw_patch);
+	bt_vendor_stats_record(STATS_FW_DOWNLOAD, start_us, ret != 0);
+
+	return ret;
+}
+
+static void bt_vendor_caps_update(struct bt_vendor_ctx *ctx, int fd)
+{
+	uint64_t start_us;
+	int ret;
+
+	start_us = bt_vendor_stats_now();
+	ATRACE_BEGIN("bt read caps");
+	ret = hci_caps_read(fd, ctx->hci_interface, &ctx->caps);
+	ATRACE_END();
+	bt_vendor_stats_record(STATS_READ_CAPS, start_us, ret != 0);
+	ctx->caps_valid = !ret;
+	if (ret)
+		ALOGW("Controller capabilities unknown: %s", strerror(-ret));
+
+#ifdef USE_CELLULAR_COEX
+	if (ctx == &bt_vendor_default)
+		hci_cmd_set_caps(ctx->caps_valid ? &ctx->caps : NULL);
+#endif
+}
+
+static void bt_vendor_watchdog_start(struct bt_vendor_ctx *ctx);
+
+static void *bt_vendor_fw_cfg_thread(void *param)
+{
+	struct bt_vendor_ctx *ctx = param;
+	int found;
+	int index;
+	int fd;
 
 	ALOGI("%s", __func__);
 
+	/*
+	 * A fast claim binds the controller as it registers, which takes it
+	 * off the mgmt index list: the wait ends on the claim as well. A
+	 * channel kept bound from warm standby is not waited for at all.
+	 */
+	found = ctx->fw_cfg_warm || !bt_vendor_wait_hcidev(ctx);
+
+	/* When started at power on, wait for the stack to ask for FW_CFG */
+	pthread_mutex_lock(&ctx->fw_cfg_lock);
+	while (!ctx->fw_cfg_requested && !ctx->fw_cfg_cancelled)
+		pthread_cond_wait(&ctx->fw_cfg_cond, &ctx->fw_cfg_lock);
+	pthread_mutex_unlock(&ctx->fw_cfg_lock);
+
+	if (ctx->fw_cfg_cancelled)
+		goto failure;
+
+	/* Parked channel dropped by bt_vendor_open() after all */
+	if (ctx->fw_cfg_warm && !ctx->fd_bound)
+		found = !bt_vendor_wait_hcidev(ctx);
+
+	if (!found) {
+		ALOGE("HCI interface (%d) not found", ctx->hci_interface);
+		goto failure;
+	}
+
+	/* Radio of the selected controller, it must be up to bind */
+	if (ctx->rfkill_en && ctx->hci_match &&
+	    bt_vendor_rfkill(ctx, 0, ctx->hci_interface))
+		goto failure;
+
+	fd = ctx->fd;
 	if (fd == -1) {
 		ALOGE("bt_vendor_fd: %s", strerror(EBADF));
 		goto failure;
 	}
 
-	memset(&addr, 0, sizeof(addr));
-        addr.hci_family = AF_BLUETOOTH;
-        addr.hci_dev = hci_interface;
-        addr.hci_channel = HCI_CHANNEL_USER;
+	/* Bound by the mgmt monitor as the controller registered */
+	if (ctx->fast_claim_en && !ctx->fd_bound) {
+		index = mgmt_monitor_unclaim(ctx);
+		if (index >= 0) {
+			ctx->hci_interface = index;
+			ctx->fd_bound = 1;
+			goto bound;
+		}
+	}
+
+	if (ctx->fd_bound) {
+		/* Kept bound from warm standby, a reset is enough */
+		if (!bt_vendor_warm_reset(fd))
+			goto ready;
 
-        if (bt_vendor_wait_hcidev()) {
-                ALOGE("HCI interface (%d) not found", hci_interface);
+		if (bt_vendor_fd_replace(ctx, fd))
+			goto failure;
+	}
+
+	if (bt_vendor_bind(ctx, fd))
 		goto failure;
+
+	ctx->fd_bound = 1;
+
+bound:
+	/* Kept by the controller across warm standby */
+	if (bt_vendor_fw_download(ctx, fd))
+		goto failure;
+
+ready:
+	/* Before the demux, the replies are read from the user channel */
+	bt_vendor_caps_update(ctx, fd);
+
+	/* Kept across a lost controller for the watchdog to recover */
+	if (ctx->demux && hci_demux_start(ctx->demux, ctx->watchdog_en))
+		goto failure;
+
+	bt_vendor_watchdog_start(ctx);
+
+	ALOGI("HCI device ready");
+
+	bt_vendor_stats_record(STATS_FW_CFG, ctx->fw_cfg_start_us, 0);
+	bt_vendor_stats_update(ctx);
+
+	ctx->callbacks->fwcfg_cb(BT_VND_OP_RESULT_SUCCESS);
+
+	return NULL;
+
+failure:
+	/* Nobody is waiting for the result of a cancelled config */
+	if (ctx->fw_cfg_cancelled) {
+		ALOGI("%s cancelled", __func__);
+		return NULL;
 	}
 
-        /* Force interface down to use HCI user channel */
-        if (ioctl(fd, IOCTL_HCIDEVDOWN, hci_interface)) {
-                ALOGE("HCIDEVDOWN ioctl error: %s", strerror(errno));
+	ALOGE("Hardware Config Error");
+	if (ctx->trace_file[0])
+		bt_vendor_trace_dump_file(ctx->trace_file);
+	bt_vendor_stats_record(STATS_FW_CFG, ctx->fw_cfg_start_us, 1);
+	bt_vendor_stats_update(ctx);
+	ctx->callbacks->fwcfg_cb(BT_VND_OP_RESULT_FAIL);
+
+	return NULL;
+}
+
+/*
+ * Stop a pending FW_CFG worker and release its resources. Must be called
+ * before ctx->fd is closed, the worker may still be using it.
+ */
+static void bt_vendor_fw_cfg_cancel(struct bt_vendor_ctx *ctx)
+{
+	int ret;
+
+	if (!ctx->fw_cfg_thread_started)
+		return;
+
+	pthread_mutex_lock(&ctx->fw_cfg_lock);
+	ctx->fw_cfg_cancelled = 1;
+	pthread_cond_broadcast(&ctx->fw_cfg_cond);
+	pthread_mutex_unlock(&ctx->fw_cfg_lock);
+	mgmt_monitor_wake();
+
+	if (pthread_equal(pthread_self(), ctx->fw_cfg_thread)) {
+		/* Called back from fwcfg_cb, cannot join ourselves */
+		pthread_detach(ctx->fw_cfg_thread);
+	} else {
+		ret = pthread_join(ctx->fw_cfg_thread, NULL);
+		if (ret)
+			ALOGW("Unable to join FW_CFG worker: %s", strerror(ret));
+	}
+	ctx->fw_cfg_thread_started = 0;
+}
+
+/*
+ * Start the FW_CFG worker. With requested unset, it only waits for the HCI
+ * device until bt_vendor_fw_cfg() hands it the rest of the sequence.
+ */
+static int bt_vendor_fw_cfg_start(struct bt_vendor_ctx *ctx, int requested)
+{
+	int ret;
+
+	if (mgmt_monitor_check()) {
+		ALOGE("Unable to start mgmt monitor");
+		return -1;
+	}
+
+	ctx->fw_cfg_cancelled = 0;
+	ctx->fw_cfg_requested = requested;
+	/* Before USERIAL_OPEN at power on, after it otherwise */
+	ctx->fw_cfg_warm = ctx->parked_fd != -1 || ctx->fd_bound;
+
+	ret = pthread_create(&ctx->fw_cfg_thread, NULL, bt_vendor_fw_cfg_thread, ctx);
+	if (ret) {
+		ALOGE("Unable to create FW_CFG worker: %s", strerror(ret));
+		return -1;
+	}
+
+	ctx->fw_cfg_thread_started = 1;
+
+	return 0;
+}
+
+static int bt_vendor_elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Wait for the lost controller to register again and bind a new user
+ * channel to it, returned once the patch is applied.
+ */
+static int bt_vendor_recover_bind(struct bt_vendor_ctx *ctx)
+{
+	struct timespec start;
+	int remaining, ret;
+	int fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (!ctx->watchdog_stop) {
+		remaining = RECOVERY_TIMEOUT - bt_vendor_elapsed_ms(&start);
+		if (remaining <= 0)
+			return -ETIMEDOUT;
+
+		if (ctx->hci_match) {
+			ret = mgmt_monitor_select_index(ctx->hci_match, ctx,
+							remaining, remaining,
+							&ctx->watchdog_stop);
+			if (ret >= 0) {
+				ctx->hci_interface = ret;
+				ret = 0;
+			}
+		} else {
+			ret = mgmt_monitor_wait_index(ctx->hci_interface, NULL,
+						      remaining, remaining,
+						      &ctx->watchdog_stop);
+		}
+		if (ret)
+			return ret;
+
+		fd = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+		if (fd < 0)
+			return -errno;
+
+		/* The removal may not be seen by the monitor yet */
+		if (!bt_vendor_bind(ctx, fd) && !bt_vendor_fw_download(ctx, fd))
+			return fd;
+
+		close(fd);
+		usleep(RECOVERY_RETRY_US);
+	}
+
+	return -ECANCELED;
+}
+
+/*
+ * Rebind the demux to the controller that came back and report a Hardware
+ * Error to the stack: bluedroid resets the controller and reinitializes on
+ * it, a Reset complete it did not ask for would just be dropped.
+ */
+static int bt_vendor_recover(struct bt_vendor_ctx *ctx)
+{
+	static const uint8_t hw_error[] = { HCI_EV_HARDWARE_ERROR, 1, 0x00 };
+	uint64_t start_us = bt_vendor_stats_now();
+	int new_fd;
+
+	ALOGW("Controller hci%d lost, recovering", ctx->hci_interface);
+
+	if (ctx->trace_file[0])
+		bt_vendor_trace_dump_file(ctx->trace_file);
+
+	ATRACE_BEGIN("bt recovery");
+	new_fd = bt_vendor_recover_bind(ctx);
+	if (new_fd >= 0)
+		bt_vendor_caps_update(ctx, new_fd);
+	ATRACE_END();
+
+	if (new_fd == -ECANCELED)
+		return -1;
+
+	if (new_fd < 0) {
+		ALOGE("Controller recovery failed: %s", strerror(-new_fd));
 		goto failure;
 	}
 
-        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-                ALOGE("socket bind error %s", strerror(errno));
-                goto failure;
-        }
+	/* Reads ctx->fd, stopped if it did not see the loss yet */
+	hci_demux_stop(ctx->demux);
 
-	ALOGI("HCI device ready");
+	if (dup2(new_fd, ctx->fd) < 0) {
+		ALOGE("socket dup error %s", strerror(errno));
+		close(new_fd);
+		goto failure;
+	}
+	close(new_fd);
 
-	bt_vendor_callbacks->fwcfg_cb(BT_VND_OP_RESULT_SUCCESS);
+	bt_vendor_trace(TRACE_HCI_EVENT, hw_error, sizeof(hw_error));
+	if (hci_demux_event(ctx->demux, hw_error, sizeof(hw_error)) ||
+	    hci_demux_start(ctx->demux, 1)) {
+		ALOGE("Unable to restart the demux");
+		goto failure;
+	}
+
+	ALOGI("Controller hci%d recovered", ctx->hci_interface);
+	bt_vendor_stats_record(STATS_RECOVERY, start_us, 0);
+	bt_vendor_stats_update(ctx);
+
+	return 0;
+
+failure:
+	hci_demux_stop(ctx->demux);
+	hci_demux_hangup(ctx->demux);
+	bt_vendor_stats_record(STATS_RECOVERY, start_us, 1);
+	bt_vendor_stats_update(ctx);
+
+	return -1;
+}
+
+/*
+ * Follow the bound controller: the user channel reports an error on a
+ * transport reset, the mgmt monitor signals the index removal. Binding a
+ * user channel removes its index from mgmt as well, the removals of an
+ * index still bound are only acted on with the user channel in error.
+ */
+static void *bt_vendor_watchdog_thread(void *param)
+{
+	struct bt_vendor_ctx *ctx = param;
+	struct pollfd pfd[3];
+	uint64_t count;
+
+	while (!ctx->watchdog_stop) {
+		mgmt_monitor_notify(ctx, ctx->hci_interface, ctx->watchdog_fd);
+
+		/* Only errors are polled, the stack reads the socket */
+		pfd[0].fd = ctx->fd;
+		pfd[0].events = 0;
+		pfd[1].fd = ctx->watchdog_fd;
+		pfd[1].events = POLLIN;
+		pfd[2].fd = ctx->watchdog_stop_fd;
+		pfd[2].events = POLLIN;
+
+		if (poll(pfd, 3, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("%s poll error: %s", __func__, strerror(errno));
+			break;
+		}
+
+		if (ctx->watchdog_stop || pfd[2].revents)
+			break;
+
+		if (pfd[1].revents & POLLIN &&
+		    read(ctx->watchdog_fd, &count, sizeof(count)) < 0)
+			ALOGW("%s read error: %s", __func__, strerror(errno));
+
+		/* A lost controller hangs up the user channel after its removal */
+		if (!(pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL)))
+			continue;
+
+		if (bt_vendor_recover(ctx))
+			break;
+
+		/* The removal seen while recovering is the one handled */
+		if (read(ctx->watchdog_fd, &count, sizeof(count)) < 0 &&
+		    errno != EAGAIN)
+			ALOGW("%s read error: %s", __func__, strerror(errno));
+	}
+
+	mgmt_monitor_unnotify(ctx);
+
+	return NULL;
+}
+
+static void bt_vendor_watchdog_start(struct bt_vendor_ctx *ctx)
+{
+	int ret;
+
+	if (!ctx->watchdog_en || ctx->watchdog_started)
+		return;
+
+	/* Events for the stack are only injected through the demux */
+	if (!ctx->demux) {
+		ALOGW("Controller watchdog needs the demux");
+		return;
+	}
+
+	ctx->watchdog_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ctx->watchdog_stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (ctx->watchdog_fd < 0 || ctx->watchdog_stop_fd < 0) {
+		ALOGE("Unable to create watchdog eventfd: %s", strerror(errno));
+		goto failure;
+	}
+
+	ctx->watchdog_stop = 0;
+
+	ret = pthread_create(&ctx->watchdog_thread, NULL,
+			     bt_vendor_watchdog_thread, ctx);
+	if (ret) {
+		ALOGE("Unable to create watchdog: %s", strerror(ret));
+		goto failure;
+	}
+
+	ctx->watchdog_started = 1;
+
+	return;
+
+failure:
+	if (ctx->watchdog_fd >= 0)
+		close(ctx->watchdog_fd);
+	if (ctx->watchdog_stop_fd >= 0)
+		close(ctx->watchdog_stop_fd);
+	ctx->watchdog_fd = -1;
+	ctx->watchdog_stop_fd = -1;
+}
+
+/* Must be called before ctx->fd is closed, like bt_vendor_fw_cfg_cancel() */
+static void bt_vendor_watchdog_stop(struct bt_vendor_ctx *ctx)
+{
+	uint64_t one = 1;
+	int ret;
+
+	if (!ctx->watchdog_started)
+		return;
+
+	ctx->watchdog_stop = 1;
+	if (write(ctx->watchdog_stop_fd, &one, sizeof(one)) < 0)
+		ALOGW("Unable to stop watchdog: %s", strerror(errno));
+	mgmt_monitor_wake();
+
+	ret = pthread_join(ctx->watchdog_thread, NULL);
+	if (ret)
+		ALOGW("Unable to join watchdog: %s", strerror(ret));
+
+	close(ctx->watchdog_fd);
+	close(ctx->watchdog_stop_fd);
+	ctx->watchdog_fd = -1;
+	ctx->watchdog_stop_fd = -1;
+	ctx->watchdog_started = 0;
+}
+
+static int bt_vendor_power_off(struct bt_vendor_ctx *ctx)
+{
+	int retval;
+
+	bt_vendor_fw_cfg_cancel(ctx);
+
+	if (!ctx->rfkill_en)
+		return 0;
+
+	/* Warm standby keeps the radio up with the channel bound */
+	if (ctx->warm_standby_en &&
+	    (ctx->fd_bound || ctx->parked_fd != -1)) {
+		ALOGI("Warm standby, radio left on");
+		return 0;
+	}
+
+	retval = bt_vendor_hw_cfg(ctx, 1);
+	if (!retval)
+		retval = bt_vendor_rfkill(ctx, 1, ctx->hci_interface);
+
+	return retval;
+}
+
+/*
+ * Waiting for the HCI device can take seconds, run it from a worker thread
+ * and report the result through fwcfg_cb.
+ */
+static void bt_vendor_fw_cfg(struct bt_vendor_ctx *ctx)
+{
+	ALOGI("%s", __func__);
+
+	ctx->fw_cfg_start_us = bt_vendor_stats_now();
+
+	/* Device discovery already running since power on */
+	if (ctx->fw_cfg_thread_started && !ctx->fw_cfg_requested) {
+		pthread_mutex_lock(&ctx->fw_cfg_lock);
+		ctx->fw_cfg_requested = 1;
+		pthread_cond_broadcast(&ctx->fw_cfg_cond);
+		pthread_mutex_unlock(&ctx->fw_cfg_lock);
+		return;
+	}
+
+	/* Only one configuration at a time */
+	bt_vendor_fw_cfg_cancel(ctx);
+
+	if (bt_vendor_fw_cfg_start(ctx, 1))
+		goto failure;
 
 	return;
 
 failure:
 	ALOGE("Hardware Config Error");
-	bt_vendor_callbacks->fwcfg_cb(BT_VND_OP_RESULT_FAIL);
+	bt_vendor_stats_record(STATS_FW_CFG, ctx->fw_cfg_start_us, 1);
+	ctx->callbacks->fwcfg_cb(BT_VND_OP_RESULT_FAIL);
 }
 
-static int bt_vendor_op(bt_vendor_opcode_t opcode, void *param)
+int bt_vendor_ctx_op(struct bt_vendor_ctx *ctx, bt_vendor_opcode_t opcode, void *param)
 {
+	uint64_t start_us = bt_vendor_stats_now();
 	int retval = 0;
 
 	ALOGI("%s op %d", __func__, opcode);
 
 	switch (opcode) {
 	case BT_VND_OP_POWER_CTRL:
-		if (!rfkill_en || !param)
+		if (!param)
 			break;
 
 		if (*((int*)param) == BT_VND_PWR_ON) {
-			retval = bt_vendor_rfkill(0);
-			if (!retval)
-				retval = bt_vendor_hw_cfg(0);
+			/* In auto mode, the FW_CFG worker picks the radio */
+			if (ctx->rfkill_en)
+				retval = bt_vendor_rfkill(ctx, 0,
+					ctx->hci_match ? -1 : ctx->hci_interface);
+
+			/*
+			 * Look for the controller while the hwcfg service
+			 * starts, instead of once the stack asks for FW_CFG.
+			 */
+			if (!retval && ctx->fast_pwr_on_en) {
+				bt_vendor_fw_cfg_cancel(ctx);
+				if (bt_vendor_fw_cfg_start(ctx, 0))
+					ALOGW("Early HCI device discovery failed");
+			}
+
+			if (!retval && ctx->rfkill_en)
+				retval = bt_vendor_hw_cfg(ctx, 0);
 		}
 		else {
-			retval = bt_vendor_hw_cfg(1);
-			if (!retval)
-				retval = bt_vendor_rfkill(1);
+			retval = bt_vendor_power_off(ctx);
 		}
 
+		if (*((int*)param) == BT_VND_PWR_ON) {
+			bt_vendor_stats_record(STATS_POWER_ON, start_us, retval);
+		} else {
+			bt_vendor_stats_record(STATS_POWER_OFF, start_us, retval);
+			bt_vendor_stats_update(ctx);
+		}
 		break;
 
 	case BT_VND_OP_FW_CFG:
-		bt_vendor_fw_cfg();
+		bt_vendor_fw_cfg(ctx);
 		break;
 
 	case BT_VND_OP_SCO_CFG:
-		bt_vendor_callbacks->scocfg_cb(BT_VND_OP_RESULT_SUCCESS);
+		ctx->callbacks->scocfg_cb(BT_VND_OP_RESULT_SUCCESS);
 		break;
 
 	case BT_VND_OP_USERIAL_OPEN:
-		retval = bt_vendor_open(param);
+		retval = bt_vendor_open(ctx, param);
+		bt_vendor_stats_record(STATS_USERIAL_OPEN, start_us, retval < 0);
 		break;
 
 	case BT_VND_OP_USERIAL_CLOSE:
-		retval = bt_vendor_close(param);
+		retval = bt_vendor_close(ctx, param);
+		bt_vendor_stats_record(STATS_USERIAL_CLOSE, start_us, retval);
 		break;
 
         case BT_VND_OP_GET_LPM_IDLE_TIMEOUT:
-		*((uint32_t *)param) = 3000;
+		*((uint32_t *)param) = bt_vendor_lpm_idle_timeout(ctx->lpm);
 		retval = 0;
 		break;
 
 	case BT_VND_OP_LPM_SET_MODE:
-		bt_vendor_callbacks->lpm_cb(BT_VND_OP_RESULT_SUCCESS);
+		bt_vendor_lpm_set_mode(ctx->lpm,
+				       *((uint8_t *)param) == BT_VND_LPM_ENABLE);
 		break;
 
 	case BT_VND_OP_LPM_WAKE_SET_STATE:
+		bt_vendor_lpm_wake(ctx->lpm,
+				   *((uint8_t *)param) == BT_VND_LPM_WAKE_ASSERT);
 		break;
 
 	case BT_VND_OP_SET_AUDIO_STATE:
-		bt_vendor_callbacks->audio_state_cb(BT_VND_OP_RESULT_SUCCESS);
+		ctx->callbacks->audio_state_cb(BT_VND_OP_RESULT_SUCCESS);
 		break;
 
 	case BT_VND_OP_EPILOG:
-		bt_vendor_callbacks->epilog_cb(BT_VND_OP_RESULT_SUCCESS);
+		ctx->callbacks->epilog_cb(BT_VND_OP_RESULT_SUCCESS);
 		break;
 	}
 
@@ -415,15 +1400,93 @@ static int bt_vendor_op(bt_vendor_opcode_t opcode, void *param)
 	return retval;
 }
 
-static void bt_vendor_cleanup( void )
+void bt_vendor_ctx_cleanup(struct bt_vendor_ctx *ctx)
 {
 	ALOGI("%s", __func__);
 
-	bt_vendor_callbacks = NULL;
+	bt_vendor_fw_cfg_cancel(ctx);
+	bt_vendor_watchdog_stop(ctx);
+	if (ctx->hci_match)
+		mgmt_monitor_release_index(ctx);
+	mgmt_monitor_stop();
+	bt_vendor_rfkill_close(ctx);
+
+	if (ctx->trace_file[0])
+		bt_vendor_trace_dump_file(ctx->trace_file);
+	bt_vendor_stats_update(ctx);
+
+	ctx->callbacks = NULL;
+}
+
+struct bt_vendor_ctx *bt_vendor_ctx_new(void)
+{
+	struct bt_vendor_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	ctx->fd = -1;
+	ctx->hcidev_timeout_max = HCIDEV_TIMEOUT_MAX;
+	ctx->parked_fd = -1;
+	ctx->parked_index = -1;
+	ctx->rfkill_fd = -1;
+	ctx->rfkill_transition_ms = -1;
+	ctx->watchdog_fd = -1;
+	ctx->watchdog_stop_fd = -1;
+	pthread_mutex_init(&ctx->fw_cfg_lock, NULL);
+	pthread_cond_init(&ctx->fw_cfg_cond, NULL);
+
+	return ctx;
+}
+
+/* The instance must be cleaned up, a parked channel is closed here */
+void bt_vendor_ctx_free(struct bt_vendor_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	if (ctx->parked_fd != -1)
+		close(ctx->parked_fd);
+	free(ctx->hci_match);
+	bt_vendor_lpm_free(ctx->lpm);
+	pthread_cond_destroy(&ctx->fw_cfg_cond);
+	pthread_mutex_destroy(&ctx->fw_cfg_lock);
+	free(ctx);
+}
+
+static int bt_vendor_init(const bt_vendor_callbacks_t *p_cb, unsigned char *local_bdaddr)
+{
+	int ret;
+
+	ret = bt_vendor_ctx_init(&bt_vendor_default, p_cb, local_bdaddr);
+	if (ret)
+		return ret;
+
+	bt_vendor_callbacks = p_cb;
 
 #ifdef USE_CELLULAR_COEX
+	hci_bind_client_init();
+#endif
+
+	return 0;
+}
+
+static int bt_vendor_op(bt_vendor_opcode_t opcode, void *param)
+{
+	return bt_vendor_ctx_op(&bt_vendor_default, opcode, param);
+}
+
+static void bt_vendor_cleanup( void )
+{
+	bt_vendor_ctx_cleanup(&bt_vendor_default);
+
+#ifdef USE_CELLULAR_COEX
+	/* Returns its buffers through the callbacks */
 	hci_bind_client_cleanup();
 #endif
+
+	bt_vendor_callbacks = NULL;
 }
 
 const bt_vendor_interface_t BLUETOOTH_VENDOR_LIB_INTERFACE = {
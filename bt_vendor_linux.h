@@ -0,0 +1,196 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+#ifndef BT_VENDOR_LINUX_H
+#define BT_VENDOR_LINUX_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "bt_vendor_lib.h"
+
+#define BTPROTO_HCI	1
+#define HCI_CHANNEL_USER	1
+#define HCI_CHANNEL_CONTROL	3
+#define HCI_DEV_NONE	0xffff
+
+#define MGMT_OP_INDEX_LIST	0x0003
+#define MGMT_OP_READ_INFO	0x0004
+#define MGMT_EV_COMMAND_COMP	0x0001
+#define MGMT_EV_INDEX_ADDED	0x0004
+#define MGMT_EV_INDEX_REMOVED	0x0005
+#define MGMT_EV_SIZE_MAX	1024
+#define MGMT_HDR_SIZE		6
+
+#define HCI_COMMAND_PKT		0x01
+#define HCI_ACLDATA_PKT		0x02
+#define HCI_SCODATA_PKT		0x03
+#define HCI_EVENT_PKT		0x04
+#define HCI_MAX_FRAME_SIZE	1028
+
+#define HCI_EV_CMD_COMPLETE	0x0e
+#define HCI_EV_CMD_STATUS	0x0f
+#define HCI_EV_HARDWARE_ERROR	0x10
+
+#define HCI_OP_RESET		0x0c03
+#define HCI_OP_READ_LOCAL_VERSION	0x1001
+#define HCI_OP_READ_LOCAL_COMMANDS	0x1002
+#define HCI_OP_READ_LOCAL_FEATURES	0x1003
+#define HCI_OP_READ_BUFFER_SIZE		0x1005
+#define HCI_OP_READ_BD_ADDR		0x1009
+
+/* Highest controller index tracked by the mgmt monitor */
+#define MGMT_INDEX_MAX		256
+
+struct sockaddr_hci {
+	sa_family_t    hci_family;
+	unsigned short hci_dev;
+	unsigned short hci_channel;
+};
+
+struct mgmt_pkt {
+	uint16_t opcode;
+	uint16_t index;
+	uint16_t len;
+	uint8_t  data[MGMT_EV_SIZE_MAX];
+} __attribute__((packed));
+
+struct mgmt_event_read_index {
+	uint16_t cc_opcode;
+	uint8_t  status;
+	uint16_t num_intf;
+	uint16_t index[0];
+} __attribute__((packed));
+
+/*
+ * bt_vendor_linux.c, one instance per controller. The library interface
+ * uses a built-in instance.
+ */
+struct bt_vendor_ctx;
+
+struct bt_vendor_ctx *bt_vendor_ctx_new(void);
+void bt_vendor_ctx_free(struct bt_vendor_ctx *ctx);
+int bt_vendor_ctx_init(struct bt_vendor_ctx *ctx, const bt_vendor_callbacks_t *p_cb,
+		       unsigned char *local_bdaddr);
+int bt_vendor_ctx_op(struct bt_vendor_ctx *ctx, bt_vendor_opcode_t opcode, void *param);
+void bt_vendor_ctx_cleanup(struct bt_vendor_ctx *ctx);
+
+/* bt_vendor_mgmt.c */
+int mgmt_monitor_start(void);
+void mgmt_monitor_stop(void);
+int mgmt_monitor_check(void);
+int mgmt_monitor_index_present(int index);
+int mgmt_monitor_wait_index(int index, void *owner, int timeout_ms,
+			    int max_timeout_ms, volatile int *cancel);
+int mgmt_monitor_select_index(const char *match, void *owner, int timeout_ms,
+			      int max_timeout_ms, volatile int *cancel);
+void mgmt_monitor_release_index(void *owner);
+int mgmt_monitor_index_addr(int index, uint8_t *addr);
+int mgmt_monitor_claim(void *owner, int fd, int index, const char *match);
+int mgmt_monitor_unclaim(void *owner);
+int mgmt_monitor_notify(void *owner, int index, int efd);
+void mgmt_monitor_unnotify(void *owner);
+void mgmt_monitor_wake(void);
+
+/* bt_vendor_trace.c, types are Linux monitor opcodes */
+#define TRACE_HCI_COMMAND	2
+#define TRACE_HCI_EVENT		3
+#define TRACE_MGMT_COMMAND	16
+#define TRACE_MGMT_EVENT	17
+
+/* HCI packets without their H4 type, mgmt packets with their header */
+void bt_vendor_trace(uint16_t type, const void *data, int len);
+int bt_vendor_trace_dump(int fd);
+int bt_vendor_trace_dump_file(const char *path);
+
+/* bt_vendor_stats.c */
+enum {
+	STATS_POWER_ON,
+	STATS_POWER_OFF,
+	STATS_FW_CFG,
+	STATS_WAIT_HCIDEV,
+	STATS_HCIDEVDOWN,
+	STATS_BIND,
+	STATS_FW_DOWNLOAD,
+	STATS_READ_CAPS,
+	STATS_USERIAL_OPEN,
+	STATS_USERIAL_CLOSE,
+	STATS_COEX_CMD,
+	STATS_COEX_URGENT_WAIT,
+	STATS_COEX_BACKGROUND_WAIT,
+	STATS_RECOVERY,
+	STATS_MAX
+};
+
+/* Monotonic time in us, to pass as start to bt_vendor_stats_record() */
+uint64_t bt_vendor_stats_now(void);
+void bt_vendor_stats_record(int id, uint64_t start_us, int failed);
+int bt_vendor_stats_dump(int fd);
+int bt_vendor_stats_dump_file(const char *path);
+
+/* bt_vendor_lpm.c */
+struct bt_vendor_lpm;
+
+struct bt_vendor_lpm *bt_vendor_lpm_new(void);
+void bt_vendor_lpm_init(struct bt_vendor_lpm *lpm,
+			const bt_vendor_callbacks_t *callbacks, uint16_t opcode);
+void bt_vendor_lpm_free(struct bt_vendor_lpm *lpm);
+uint32_t bt_vendor_lpm_idle_timeout(struct bt_vendor_lpm *lpm);
+int bt_vendor_lpm_set_mode(struct bt_vendor_lpm *lpm, int enable);
+void bt_vendor_lpm_activity(struct bt_vendor_lpm *lpm);
+void bt_vendor_lpm_wake(struct bt_vendor_lpm *lpm, int assert);
+
+/* bt_vendor_demux.c, traffic is reported to lpm if not NULL */
+struct hci_demux;
+
+struct hci_demux *hci_demux_new(int fd, int *fd_array, struct bt_vendor_lpm *lpm);
+int hci_demux_start(struct hci_demux *dm, int keep);
+void hci_demux_stop(struct hci_demux *dm);
+int hci_demux_event(struct hci_demux *dm, const uint8_t *evt, int len);
+void hci_demux_hangup(struct hci_demux *dm);
+void hci_demux_free(struct hci_demux *dm);
+
+/* bt_vendor_hci.c */
+int hci_send_cmd_sync(int fd, uint16_t opcode, const void *param, uint8_t plen,
+		      uint8_t *rsp, int rsp_size, uint8_t *ncmd, int timeout_ms);
+
+/* bt_vendor_fw.c */
+int hci_fw_download(int fd, const char *path);
+
+/* bt_vendor_caps.c, what the controller reports about itself */
+struct hci_caps {
+	uint8_t  bdaddr[6];
+	uint8_t  hci_ver;
+	uint16_t hci_rev;
+	uint8_t  lmp_ver;
+	uint16_t manufacturer;
+	uint16_t lmp_subver;
+	uint8_t  commands[64];
+	uint8_t  features[8];
+	uint16_t acl_mtu;
+	uint8_t  sco_mtu;
+	uint16_t acl_max_pkt;
+	uint16_t sco_max_pkt;
+	/* Command credits given with the last reply */
+	uint8_t  ncmd;
+};
+
+int hci_caps_read(int fd, int index, struct hci_caps *caps);
+int hci_caps_cmd_supported(const struct hci_caps *caps, uint16_t opcode);
+
+#endif /* BT_VENDOR_LINUX_H */
@@ -0,0 +1,429 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * Low power mode policy. The idle timeout follows the traffic: it is
+ * learned from the time between bursts, as seen through the stack wake
+ * requests and, when the user channel is demultiplexed, every packet.
+ * With an LPM command configured, the controller is told to sleep past
+ * that timeout, and again each time it moves enough. Only vendor commands
+ * of a known parameter layout are supported, see lpm_formats.
+ */
+
+#define LOG_TAG "bt_vendor_lpm"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/Log.h>
+
+#include "bt_vendor_linux.h"
+#include "bt_hci_bdroid.h"
+
+/* Until enough samples are learned, what the stack always got so far */
+#define LPM_IDLE_DEFAULT_MS	3000
+#define LPM_IDLE_MIN_MS		100
+#define LPM_IDLE_MAX_MS		10000
+#define LPM_MIN_SAMPLES		8
+/* Packets closer than this belong to the same burst */
+#define LPM_BURST_US		2000
+/* Controller updates for changes of more than 1/LPM_UPDATE_RATIO only */
+#define LPM_UPDATE_RATIO	4
+#define LPM_UPDATE_INTERVAL_US	1000000
+
+/* Broadcom Write_Sleep_Mode, thresholds in units of 300 ms on UART */
+#define BRCM_SLEEP_PARAM_SIZE	12
+#define BRCM_SLEEP_UNIT_MS	300
+
+/* Vendor command driving the controller sleep */
+struct lpm_cmd_format {
+	uint16_t opcode;
+	const char *name;
+	uint8_t param_len;
+	void (*fill)(uint8_t *p, int enable, uint32_t idle_ms);
+};
+
+struct bt_vendor_lpm {
+	const bt_vendor_callbacks_t *callbacks;
+	/* NULL if the controller is not driven, idle timeout only */
+	const struct lpm_cmd_format *cmd;
+	pthread_mutex_t lock;
+
+	int enabled;
+	/* Completion of LPM_SET_MODE is reported once the command completes */
+	int mode_pending;
+	/* LPM_SET_MODE waits for the command in flight */
+	int mode_queued;
+
+	/* Burst gap average and mean deviation, in us */
+	uint64_t last_us;
+	uint64_t gap_avg;
+	uint64_t gap_dev;
+	int num_samples;
+
+	uint32_t sent_ms;
+	uint64_t sent_at_us;
+};
+
+/*
+ * The stack completion callback carries no context, one LPM command is
+ * in flight at a time.
+ */
+static pthread_mutex_t lpm_cmd_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bt_vendor_lpm *lpm_cmd_owner;
+static const bt_vendor_callbacks_t *lpm_cmd_callbacks;
+
+/*
+ * Broadcom Write_Sleep_Mode, as sent by the AOSP Broadcom vendor library:
+ * UART sleep mode, host and controller idle thresholds, BT_WAKE and
+ * HOST_WAKE active high, sleep allowed during SCO, sleep mode combined
+ * with LPM, the rest unused. Sleep mode 0 turns sleep off.
+ */
+static void lpm_fill_brcm(uint8_t *p, int enable, uint32_t idle_ms)
+{
+	uint32_t units = (idle_ms + BRCM_SLEEP_UNIT_MS - 1) / BRCM_SLEEP_UNIT_MS;
+
+	memset(p, 0, BRCM_SLEEP_PARAM_SIZE);
+	if (!enable)
+		return;
+
+	if (units < 1)
+		units = 1;
+	if (units > 0xff)
+		units = 0xff;
+
+	p[0] = 1;
+	p[1] = units;
+	p[2] = units;
+	p[3] = 1;
+	p[4] = 1;
+	p[5] = 1;
+	p[6] = 1;
+}
+
+static const struct lpm_cmd_format lpm_formats[] = {
+	{ 0xfc27, "Broadcom Write_Sleep_Mode", BRCM_SLEEP_PARAM_SIZE, lpm_fill_brcm },
+};
+
+/* What is learned is kept across library init and cleanup */
+struct bt_vendor_lpm *bt_vendor_lpm_new(void)
+{
+	struct bt_vendor_lpm *lpm;
+
+	lpm = calloc(1, sizeof(*lpm));
+	if (!lpm)
+		return NULL;
+
+	pthread_mutex_init(&lpm->lock, NULL);
+
+	return lpm;
+}
+
+void bt_vendor_lpm_init(struct bt_vendor_lpm *lpm,
+			const bt_vendor_callbacks_t *callbacks, uint16_t opcode)
+{
+	const struct lpm_cmd_format *cmd = NULL;
+	size_t i;
+
+	for (i = 0; opcode && i < sizeof(lpm_formats) / sizeof(lpm_formats[0]); i++) {
+		if (lpm_formats[i].opcode == opcode)
+			cmd = &lpm_formats[i];
+	}
+	if (opcode && !cmd)
+		ALOGE("Unknown LPM command 0x%04x, managing the idle timeout only",
+		      opcode);
+
+	pthread_mutex_lock(&lpm->lock);
+	lpm->callbacks = callbacks;
+	lpm->cmd = cmd;
+	lpm->enabled = 0;
+	lpm->mode_pending = 0;
+	lpm->mode_queued = 0;
+	pthread_mutex_unlock(&lpm->lock);
+}
+
+void bt_vendor_lpm_free(struct bt_vendor_lpm *lpm)
+{
+	if (!lpm)
+		return;
+
+	pthread_mutex_lock(&lpm_cmd_lock);
+	if (lpm_cmd_owner == lpm)
+		lpm_cmd_owner = NULL;
+	pthread_mutex_unlock(&lpm_cmd_lock);
+
+	pthread_mutex_destroy(&lpm->lock);
+	free(lpm);
+}
+
+/* Called with lpm->lock held */
+static uint32_t lpm_idle_timeout_locked(struct bt_vendor_lpm *lpm)
+{
+	uint64_t ms;
+
+	if (lpm->num_samples < LPM_MIN_SAMPLES)
+		return LPM_IDLE_DEFAULT_MS;
+
+	/* Past the usual gaps, the traffic pattern has ended */
+	ms = (lpm->gap_avg + 4 * lpm->gap_dev) / 1000;
+	if (ms < LPM_IDLE_MIN_MS)
+		ms = LPM_IDLE_MIN_MS;
+	if (ms > LPM_IDLE_MAX_MS)
+		ms = LPM_IDLE_MAX_MS;
+
+	return ms;
+}
+
+uint32_t bt_vendor_lpm_idle_timeout(struct bt_vendor_lpm *lpm)
+{
+	uint32_t ms;
+
+	pthread_mutex_lock(&lpm->lock);
+	ms = lpm_idle_timeout_locked(lpm);
+	pthread_mutex_unlock(&lpm->lock);
+
+	return ms;
+}
+
+static void lpm_send_mode(struct bt_vendor_lpm *lpm);
+
+static void lpm_cmd_cback(void *p_mem)
+{
+	HC_BT_HDR *p_evt = p_mem;
+	const bt_vendor_callbacks_t *callbacks;
+	struct bt_vendor_lpm *lpm;
+	uint8_t *p = (uint8_t *)(p_evt + 1) + p_evt->offset;
+	int pending = 0, queued = 0, status;
+
+	/* Event code, length, ncmd, opcode, status */
+	status = p_evt->len >= 6 ? p[5] : -1;
+
+	bt_vendor_trace(TRACE_HCI_EVENT, p, p_evt->len);
+
+	pthread_mutex_lock(&lpm_cmd_lock);
+	lpm = lpm_cmd_owner;
+	callbacks = lpm_cmd_callbacks;
+	lpm_cmd_owner = NULL;
+	if (lpm) {
+		pthread_mutex_lock(&lpm->lock);
+		pending = lpm->mode_pending;
+		lpm->mode_pending = 0;
+		queued = lpm->mode_queued;
+		lpm->mode_queued = 0;
+		pthread_mutex_unlock(&lpm->lock);
+	}
+	pthread_mutex_unlock(&lpm_cmd_lock);
+
+	if (status)
+		ALOGE("LPM command failed with status %d", status);
+
+	if (pending)
+		callbacks->lpm_cb(status ? BT_VND_OP_RESULT_FAIL :
+				  BT_VND_OP_RESULT_SUCCESS);
+
+	if (queued)
+		lpm_send_mode(lpm);
+
+	if (callbacks)
+		callbacks->dealloc(p_evt);
+}
+
+/* Sends the LPM command once claimed, gives the claim back on failure */
+static int lpm_xmit(struct bt_vendor_lpm *lpm, int enable, uint32_t idle_ms)
+{
+	const struct lpm_cmd_format *cmd = lpm->cmd;
+	HC_BT_HDR *p_buf;
+	uint8_t *p;
+
+	p_buf = lpm->callbacks->alloc(BT_HC_HDR_SIZE + 3 + cmd->param_len);
+	if (!p_buf)
+		goto failure;
+
+	p_buf->event = MSG_STACK_TO_HC_HCI_CMD;
+	p_buf->len = 3 + cmd->param_len;
+	p_buf->offset = 0;
+	p_buf->layer_specific = 0;
+
+	p = (uint8_t *)(p_buf + 1);
+	p[0] = cmd->opcode & 0xff;
+	p[1] = cmd->opcode >> 8;
+	p[2] = cmd->param_len;
+	cmd->fill(p + 3, enable, idle_ms);
+
+	bt_vendor_trace(TRACE_HCI_COMMAND, p, p_buf->len);
+
+	/* Transmitted buffers are freed by the stack */
+	if (!lpm->callbacks->xmit_cb(cmd->opcode, p_buf, lpm_cmd_cback)) {
+		lpm->callbacks->dealloc(p_buf);
+		goto failure;
+	}
+
+	return 0;
+
+failure:
+	pthread_mutex_lock(&lpm_cmd_lock);
+	if (lpm_cmd_owner == lpm)
+		lpm_cmd_owner = NULL;
+	pthread_mutex_unlock(&lpm_cmd_lock);
+
+	return -EIO;
+}
+
+static int lpm_send(struct bt_vendor_lpm *lpm, int enable, uint32_t idle_ms)
+{
+	pthread_mutex_lock(&lpm_cmd_lock);
+	if (lpm_cmd_owner) {
+		pthread_mutex_unlock(&lpm_cmd_lock);
+		return -EBUSY;
+	}
+	lpm_cmd_owner = lpm;
+	lpm_cmd_callbacks = lpm->callbacks;
+	pthread_mutex_unlock(&lpm_cmd_lock);
+
+	return lpm_xmit(lpm, enable, idle_ms);
+}
+
+/*
+ * Sends the mode last set, reported through lpm_cb once it completes. With
+ * a command in flight, it is queued until that one completes.
+ */
+static void lpm_send_mode(struct bt_vendor_lpm *lpm)
+{
+	uint32_t idle_ms;
+	int enable, ret;
+
+	pthread_mutex_lock(&lpm_cmd_lock);
+	pthread_mutex_lock(&lpm->lock);
+	if (lpm_cmd_owner) {
+		lpm->mode_queued = 1;
+		pthread_mutex_unlock(&lpm->lock);
+		pthread_mutex_unlock(&lpm_cmd_lock);
+		return;
+	}
+	enable = lpm->enabled;
+	idle_ms = lpm_idle_timeout_locked(lpm);
+	lpm->mode_pending = 1;
+	pthread_mutex_unlock(&lpm->lock);
+	lpm_cmd_owner = lpm;
+	lpm_cmd_callbacks = lpm->callbacks;
+	pthread_mutex_unlock(&lpm_cmd_lock);
+
+	ret = lpm_xmit(lpm, enable, idle_ms);
+
+	pthread_mutex_lock(&lpm->lock);
+	if (ret)
+		lpm->mode_pending = 0;
+	else
+		lpm->sent_ms = idle_ms;
+	lpm->sent_at_us = bt_vendor_stats_now();
+	pthread_mutex_unlock(&lpm->lock);
+
+	if (ret) {
+		ALOGE("Unable to send %s: %s", lpm->cmd->name, strerror(-ret));
+		lpm->callbacks->lpm_cb(BT_VND_OP_RESULT_FAIL);
+	}
+}
+
+/*
+ * BT_VND_OP_LPM_SET_MODE. Without an LPM command, only the idle timeout
+ * is managed and the mode is acknowledged right away.
+ */
+int bt_vendor_lpm_set_mode(struct bt_vendor_lpm *lpm, int enable)
+{
+	pthread_mutex_lock(&lpm->lock);
+	lpm->enabled = enable;
+	pthread_mutex_unlock(&lpm->lock);
+
+	ALOGI("LPM %s, idle timeout %u ms", enable ? "enabled" : "disabled",
+	      bt_vendor_lpm_idle_timeout(lpm));
+
+	if (!lpm->cmd) {
+		lpm->callbacks->lpm_cb(BT_VND_OP_RESULT_SUCCESS);
+		return 0;
+	}
+
+	lpm_send_mode(lpm);
+
+	return 0;
+}
+
+/* Traffic seen on the user channel or announced by the stack */
+void bt_vendor_lpm_activity(struct bt_vendor_lpm *lpm)
+{
+	uint64_t now = bt_vendor_stats_now();
+	uint64_t gap, dev;
+	uint32_t idle_ms = 0;
+	int update = 0;
+
+	pthread_mutex_lock(&lpm->lock);
+
+	gap = lpm->last_us ? now - lpm->last_us : 0;
+	lpm->last_us = now;
+
+	if (gap < LPM_BURST_US) {
+		pthread_mutex_unlock(&lpm->lock);
+		return;
+	}
+
+	/* One long silence should not dominate the average */
+	if (gap > 2 * LPM_IDLE_MAX_MS * 1000ULL)
+		gap = 2 * LPM_IDLE_MAX_MS * 1000ULL;
+
+	if (!lpm->num_samples) {
+		lpm->gap_avg = gap;
+		lpm->gap_dev = gap / 2;
+	} else {
+		dev = gap > lpm->gap_avg ? gap - lpm->gap_avg : lpm->gap_avg - gap;
+		lpm->gap_dev = (3 * lpm->gap_dev + dev) / 4;
+		lpm->gap_avg = (7 * lpm->gap_avg + gap) / 8;
+	}
+	if (lpm->num_samples < LPM_MIN_SAMPLES)
+		lpm->num_samples++;
+
+	if (lpm->enabled && lpm->cmd &&
+	    now - lpm->sent_at_us >= LPM_UPDATE_INTERVAL_US) {
+		idle_ms = lpm_idle_timeout_locked(lpm);
+		if (idle_ms * LPM_UPDATE_RATIO > lpm->sent_ms * (LPM_UPDATE_RATIO + 1) ||
+		    idle_ms * LPM_UPDATE_RATIO < lpm->sent_ms * (LPM_UPDATE_RATIO - 1)) {
+			update = 1;
+			lpm->sent_at_us = now;
+		}
+	}
+
+	pthread_mutex_unlock(&lpm->lock);
+
+	/* Retried on later activity if a command is still in flight */
+	if (update && !lpm_send(lpm, 1, idle_ms)) {
+		ALOGI("LPM idle timeout now %u ms", idle_ms);
+		pthread_mutex_lock(&lpm->lock);
+		lpm->sent_ms = idle_ms;
+		pthread_mutex_unlock(&lpm->lock);
+	}
+}
+
+/*
+ * BT_VND_OP_LPM_WAKE_SET_STATE. The stack asserts wake when it has traffic
+ * after being idle, its timer deasserts it.
+ */
+void bt_vendor_lpm_wake(struct bt_vendor_lpm *lpm, int assert)
+{
+	if (assert)
+		bt_vendor_lpm_activity(lpm);
+}
@@ -0,0 +1,1019 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * Long-lived mgmt control channel monitor. Keeps a table of the controller
+ * indexes currently registered in the kernel, so that FW_CFG can check for
+ * its interface without opening a control socket and round tripping an
+ * index list request each time.
+ *
+ * Kernel uevents are followed as well: they tell a controller that is
+ * still enumerating apart from one whose transport device went away.
+ *
+ * The monitor is shared by all the library instances of the process. It
+ * also implements the controller selection policy for instances that are
+ * not tied to a fixed interface, see mgmt_monitor_select_index(), and
+ * binds the user channel of instances claiming a controller as soon as it
+ * registers, see mgmt_monitor_claim().
+ */
+
+#define LOG_TAG "bt_vendor_mgmt"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/netlink.h>
+
+#include <utils/Log.h>
+
+#include "bt_vendor_linux.h"
+
+#define UEVENT_MSG_LEN		2048
+#define MGMT_TRANSPORT_MAX	8
+/* Time a removed transport device has to come back before waiters fail */
+#define MGMT_TRANSPORT_GRACE	500 /* 500ms */
+#define MGMT_CLAIM_MAX		4
+
+enum {
+	CLAIM_PENDING,
+	CLAIM_BINDING,
+	CLAIM_BOUND,
+	CLAIM_FAILED,
+};
+
+/* User channel socket to bind to the next controller registering */
+struct mgmt_claim {
+	void *owner;		/* NULL when unused */
+	int fd;
+	int index;		/* -1 to select by match */
+	const char *match;
+	int state;
+	int bound_index;
+};
+
+/* Sysfs device a controller was last seen on, e.g. its USB interface */
+struct mgmt_transport {
+	int index;
+	char path[128];
+	int64_t gone_since;	/* 0 while present */
+};
+
+/* Serializes start/stop between library instances */
+static pthread_mutex_t mgmt_ctl_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mgmt_users = 0;
+static int mgmt_cond_ready = 0;
+
+static pthread_mutex_t mgmt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mgmt_cond;
+static pthread_t mgmt_thread;
+static int mgmt_running = 0;
+static int mgmt_stop_pipe[2] = { -1, -1 };
+
+/* Protected by mgmt_lock */
+static uint32_t mgmt_index_map[MGMT_INDEX_MAX / 32];
+static int mgmt_index_list_valid = 0;
+static int mgmt_failed = 0;
+static struct mgmt_transport mgmt_transports[MGMT_TRANSPORT_MAX];
+static int mgmt_num_transports = 0;
+static int64_t mgmt_last_activity = 0;
+/* Controller addresses from MGMT_OP_READ_INFO, little endian */
+static uint8_t mgmt_index_addr[MGMT_INDEX_MAX][6];
+static uint32_t mgmt_index_addr_valid[MGMT_INDEX_MAX / 32];
+/* Instance owning each selected index, see mgmt_monitor_select_index() */
+static void *mgmt_index_owner[MGMT_INDEX_MAX];
+static struct mgmt_claim mgmt_claims[MGMT_CLAIM_MAX];
+
+/* Eventfds signalled when their index is removed, see mgmt_monitor_notify() */
+struct mgmt_watch {
+	void *owner;		/* NULL when unused */
+	int index;
+	int efd;
+};
+
+static struct mgmt_watch mgmt_watches[MGMT_CLAIM_MAX];
+
+static int64_t mgmt_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct mgmt_transport *mgmt_transport_find(int index)
+{
+	int i;
+
+	for (i = 0; i < mgmt_num_transports; i++) {
+		if (mgmt_transports[i].index == index)
+			return &mgmt_transports[i];
+	}
+
+	return NULL;
+}
+
+/* Remember the parent device of hci<index>, called with mgmt_lock held */
+static void mgmt_transport_record(int index)
+{
+	struct mgmt_transport *t;
+	char link[64], path[PATH_MAX], *p;
+
+	snprintf(link, sizeof(link), "/sys/class/bluetooth/hci%d", index);
+	if (!realpath(link, path))
+		return;
+
+	/* <transport>/bluetooth/hciX */
+	p = strrchr(path, '/');
+	if (p) {
+		*p = '\0';
+		p = strrchr(path, '/');
+	}
+	if (!p || strcmp(p, "/bluetooth"))
+		return;
+	*p = '\0';
+
+	t = mgmt_transport_find(index);
+	if (!t) {
+		if (mgmt_num_transports == MGMT_TRANSPORT_MAX)
+			return;
+		t = &mgmt_transports[mgmt_num_transports++];
+		t->index = index;
+	}
+
+	strncpy(t->path, path, sizeof(t->path) - 1);
+	t->path[sizeof(t->path) - 1] = '\0';
+	t->gone_since = 0;
+}
+
+static int mgmt_bit_test(const uint32_t *map, int index)
+{
+	return !!(map[index / 32] & (1U << (index % 32)));
+}
+
+static void mgmt_bit_set(uint32_t *map, int index, int set)
+{
+	if (set)
+		map[index / 32] |= 1U << (index % 32);
+	else
+		map[index / 32] &= ~(1U << (index % 32));
+}
+
+static void mgmt_index_set(int fd, uint16_t index, int present)
+{
+	struct mgmt_pkt cmd;
+
+	if (index >= MGMT_INDEX_MAX) {
+		ALOGW("Ignoring out of range index %u", index);
+		return;
+	}
+
+	mgmt_bit_set(mgmt_index_map, index, present);
+	mgmt_bit_set(mgmt_index_addr_valid, index, 0);
+
+	if (!present)
+		return;
+
+	mgmt_transport_record(index);
+
+	/* Address for the selection policy, the reply comes in later */
+	cmd.opcode = MGMT_OP_READ_INFO;
+	cmd.index = index;
+	cmd.len = 0;
+	bt_vendor_trace(TRACE_MGMT_COMMAND, &cmd, MGMT_HDR_SIZE);
+	if (write(fd, &cmd, MGMT_HDR_SIZE) != MGMT_HDR_SIZE)
+		ALOGW("Unable to read hci%u info: %s", index, strerror(errno));
+}
+
+static int mgmt_index_match(int index, const char *match);
+
+/* Called with mgmt_lock held */
+static void mgmt_watch_signal(uint16_t index)
+{
+	uint64_t one = 1;
+	int i;
+
+	for (i = 0; i < MGMT_CLAIM_MAX; i++) {
+		if (!mgmt_watches[i].owner || mgmt_watches[i].index != index)
+			continue;
+		if (write(mgmt_watches[i].efd, &one, sizeof(one)) < 0)
+			ALOGW("Unable to signal hci%u removal: %s", index,
+			      strerror(errno));
+	}
+}
+
+/*
+ * Hand a controller that just registered to the claim waiting for it, the
+ * monitor thread binds it in mgmt_claims_bind(). Called with mgmt_lock
+ * held.
+ */
+static void mgmt_claim_check(uint16_t index)
+{
+	struct mgmt_claim *c;
+	int i;
+
+	/* Info replies may come in after the index went away */
+	if (index >= MGMT_INDEX_MAX || !mgmt_bit_test(mgmt_index_map, index))
+		return;
+
+	for (i = 0; i < MGMT_CLAIM_MAX; i++) {
+		c = &mgmt_claims[i];
+		if (!c->owner || c->state != CLAIM_PENDING)
+			continue;
+
+		if (c->index >= 0) {
+			if (c->index != index)
+				continue;
+		} else if ((mgmt_index_owner[index] &&
+			    mgmt_index_owner[index] != c->owner) ||
+			   !mgmt_index_match(index, c->match)) {
+			continue;
+		}
+
+		if (c->index < 0)
+			mgmt_index_owner[index] = c->owner;
+		c->state = CLAIM_BINDING;
+		c->bound_index = index;
+		return;
+	}
+}
+
+/*
+ * Bind the claimed controllers right away. The kernel announces a
+ * controller once its setup is done and keeps it up only until its auto
+ * power off, the bind takes it over from there without HCIDEVDOWN.
+ */
+static void mgmt_claims_bind(void)
+{
+	struct sockaddr_hci addr;
+	uint64_t start_us;
+	int i, fd, ret;
+
+	pthread_mutex_lock(&mgmt_lock);
+	for (i = 0; i < MGMT_CLAIM_MAX; i++) {
+		if (!mgmt_claims[i].owner || mgmt_claims[i].state != CLAIM_BINDING)
+			continue;
+
+		fd = mgmt_claims[i].fd;
+		memset(&addr, 0, sizeof(addr));
+		addr.hci_family = AF_BLUETOOTH;
+		addr.hci_dev = mgmt_claims[i].bound_index;
+		addr.hci_channel = HCI_CHANNEL_USER;
+
+		/* The owner waits for the result before touching fd */
+		pthread_mutex_unlock(&mgmt_lock);
+		start_us = bt_vendor_stats_now();
+		ret = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+		bt_vendor_stats_record(STATS_BIND, start_us, ret < 0);
+		if (ret < 0)
+			ALOGW("Fast claim of hci%u failed: %s", addr.hci_dev,
+			      strerror(errno));
+		else
+			ALOGI("hci%u claimed", addr.hci_dev);
+		pthread_mutex_lock(&mgmt_lock);
+
+		mgmt_claims[i].state = ret < 0 ? CLAIM_FAILED : CLAIM_BOUND;
+		pthread_cond_broadcast(&mgmt_cond);
+	}
+	pthread_mutex_unlock(&mgmt_lock);
+}
+
+static void mgmt_handle_event(int fd, struct mgmt_pkt *ev, int len)
+{
+	struct mgmt_event_read_index *cc;
+	int i;
+
+	if (len < MGMT_HDR_SIZE)
+		return;
+
+	pthread_mutex_lock(&mgmt_lock);
+
+	switch (ev->opcode) {
+	case MGMT_EV_INDEX_ADDED:
+		ALOGI("hci%u added", ev->index);
+		mgmt_index_set(fd, ev->index, 1);
+		mgmt_claim_check(ev->index);
+		break;
+
+	case MGMT_EV_INDEX_REMOVED:
+		ALOGI("hci%u removed", ev->index);
+		mgmt_index_set(fd, ev->index, 0);
+		mgmt_watch_signal(ev->index);
+		break;
+
+	case MGMT_EV_COMMAND_COMP:
+		cc = (struct mgmt_event_read_index *)ev->data;
+
+		if (len < MGMT_HDR_SIZE + (int) sizeof(*cc))
+			break;
+
+		/* Opcode, status, then the address */
+		if (cc->cc_opcode == MGMT_OP_READ_INFO) {
+			if (cc->status != 0 || ev->index >= MGMT_INDEX_MAX ||
+			    len < MGMT_HDR_SIZE + 3 + 6)
+				break;
+			memcpy(mgmt_index_addr[ev->index], ev->data + 3, 6);
+			mgmt_bit_set(mgmt_index_addr_valid, ev->index, 1);
+			/* Claims matching an address could not pick it before */
+			mgmt_claim_check(ev->index);
+			break;
+		}
+
+		if (cc->cc_opcode != MGMT_OP_INDEX_LIST)
+			break;
+
+		if (cc->status != 0) {
+			ALOGE("Index list failed with status %u", cc->status);
+			break;
+		}
+
+		if (len < MGMT_HDR_SIZE + (int) sizeof(*cc) +
+		    cc->num_intf * (int) sizeof(uint16_t))
+			break;
+
+		memset(mgmt_index_map, 0, sizeof(mgmt_index_map));
+		for (i = 0; i < cc->num_intf; i++)
+			mgmt_index_set(fd, cc->index[i], 1);
+		mgmt_index_list_valid = 1;
+		break;
+	}
+
+	pthread_cond_broadcast(&mgmt_cond);
+	pthread_mutex_unlock(&mgmt_lock);
+}
+
+/*
+ * A uevent is "ACTION@DEVPATH" followed by KEY=VALUE strings. Device
+ * additions on the transport buses count as enumeration activity, and the
+ * removal of a recorded transport device starts its grace period.
+ */
+static void mgmt_handle_uevent(char *msg, int len)
+{
+	char *action, *devpath, *subsystem = NULL;
+	char *p, *end = msg + len;
+	size_t plen;
+	int add, i;
+
+	if (len <= 0 || len >= UEVENT_MSG_LEN)
+		return;
+	msg[len] = '\0';
+
+	p = strchr(msg, '@');
+	if (!p)
+		return;
+	action = msg;
+	*p = '\0';
+	devpath = p + 1;
+
+	for (p = msg + strlen(devpath) + strlen(action) + 2; p < end; p += strlen(p) + 1) {
+		if (!strncmp(p, "SUBSYSTEM=", 10))
+			subsystem = p + 10;
+	}
+
+	if (!strcmp(action, "add"))
+		add = 1;
+	else if (!strcmp(action, "remove"))
+		add = 0;
+	else
+		return;
+
+	pthread_mutex_lock(&mgmt_lock);
+
+	if (add && subsystem && (!strcmp(subsystem, "bluetooth") ||
+				 !strcmp(subsystem, "usb") ||
+				 !strcmp(subsystem, "tty")))
+		mgmt_last_activity = mgmt_now_ms();
+
+	for (i = 0; i < mgmt_num_transports; i++) {
+		struct mgmt_transport *t = &mgmt_transports[i];
+
+		/* Recorded paths carry the /sys prefix, devpath does not */
+		plen = strlen(devpath);
+		if (strncmp(t->path, "/sys", 4) || strncmp(t->path + 4, devpath, plen))
+			continue;
+		if (t->path[4 + plen] != '\0' && t->path[4 + plen] != '/')
+			continue;
+
+		if (add) {
+			t->gone_since = 0;
+		} else if (!t->gone_since) {
+			ALOGI("hci%d transport removed", t->index);
+			t->gone_since = mgmt_now_ms();
+		}
+	}
+
+	pthread_cond_broadcast(&mgmt_cond);
+	pthread_mutex_unlock(&mgmt_lock);
+}
+
+static int mgmt_uevent_open(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		ALOGW("uevent socket error: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		ALOGW("uevent bind error: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void *mgmt_monitor_thread(void *param)
+{
+	struct sockaddr_hci addr;
+	struct pollfd fds[3];
+	struct mgmt_pkt ev;
+	char uevent[UEVENT_MSG_LEN];
+	int fd, n;
+	int uevent_fd = -1;
+
+	(void)(param);
+
+	ALOGI("%s", __func__);
+
+	fd = socket(PF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+	if (fd < 0) {
+		ALOGE("Bluetooth socket error: %s", strerror(errno));
+		goto failure;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = HCI_DEV_NONE;
+	addr.hci_channel = HCI_CHANNEL_CONTROL;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		ALOGE("HCI Channel Control: %s", strerror(errno));
+		goto failure;
+	}
+
+	/* Read Controller Index List Command */
+	ev.opcode = MGMT_OP_INDEX_LIST;
+	ev.index = HCI_DEV_NONE;
+	ev.len = 0;
+	bt_vendor_trace(TRACE_MGMT_COMMAND, &ev, MGMT_HDR_SIZE);
+	if (write(fd, &ev, MGMT_HDR_SIZE) != MGMT_HDR_SIZE) {
+		ALOGE("Unable to write mgmt command: %s", strerror(errno));
+		goto failure;
+	}
+
+	/* Optional, waits only lose the fast failure on transport removal */
+	uevent_fd = mgmt_uevent_open();
+
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = mgmt_stop_pipe[0];
+	fds[1].events = POLLIN;
+	fds[2].fd = uevent_fd;
+	fds[2].events = POLLIN;
+
+	while (1) {
+		n = poll(fds, 3, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("Poll error: %s", strerror(errno));
+			goto failure;
+		}
+
+		if (fds[1].revents & POLLIN)
+			break;
+
+		if (fds[0].revents & (POLLERR | POLLHUP)) {
+			ALOGE("Control channel closed");
+			goto failure;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			n = read(fd, &ev, sizeof(struct mgmt_pkt));
+			if (n < 0) {
+				ALOGE("Error reading control channel");
+				goto failure;
+			}
+
+			bt_vendor_trace(TRACE_MGMT_EVENT, &ev, n);
+			mgmt_handle_event(fd, &ev, n);
+			mgmt_claims_bind();
+		}
+
+		if (fds[2].revents & POLLIN) {
+			n = recv(uevent_fd, uevent, sizeof(uevent) - 1, 0);
+			if (n > 0)
+				mgmt_handle_uevent(uevent, n);
+		}
+	}
+
+	if (uevent_fd >= 0)
+		close(uevent_fd);
+	close(fd);
+	return NULL;
+
+failure:
+	if (uevent_fd >= 0)
+		close(uevent_fd);
+	if (fd >= 0)
+		close(fd);
+
+	/* Wake up waiters, they fall back to restarting the monitor */
+	pthread_mutex_lock(&mgmt_lock);
+	mgmt_failed = 1;
+	mgmt_index_list_valid = 0;
+	pthread_cond_broadcast(&mgmt_cond);
+	pthread_mutex_unlock(&mgmt_lock);
+
+	return NULL;
+}
+
+static int mgmt_monitor_spawn(void)
+{
+	pthread_condattr_t attr;
+	int ret;
+
+	if (!mgmt_cond_ready) {
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		ret = pthread_cond_init(&mgmt_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		if (ret) {
+			ALOGE("Unable to init mgmt condition: %s", strerror(ret));
+			return -1;
+		}
+		mgmt_cond_ready = 1;
+	}
+
+	if (pipe(mgmt_stop_pipe) < 0) {
+		ALOGE("Unable to create mgmt pipe: %s", strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_lock(&mgmt_lock);
+	memset(mgmt_index_map, 0, sizeof(mgmt_index_map));
+	memset(mgmt_index_addr_valid, 0, sizeof(mgmt_index_addr_valid));
+	mgmt_index_list_valid = 0;
+	mgmt_failed = 0;
+	pthread_mutex_unlock(&mgmt_lock);
+
+	ret = pthread_create(&mgmt_thread, NULL, mgmt_monitor_thread, NULL);
+	if (ret) {
+		ALOGE("Unable to create mgmt monitor: %s", strerror(ret));
+		close(mgmt_stop_pipe[0]);
+		close(mgmt_stop_pipe[1]);
+		mgmt_stop_pipe[0] = -1;
+		mgmt_stop_pipe[1] = -1;
+		return -1;
+	}
+
+	mgmt_running = 1;
+
+	return 0;
+}
+
+static void mgmt_monitor_reap(void)
+{
+	if (!mgmt_running)
+		return;
+
+	if (write(mgmt_stop_pipe[1], "s", 1) < 0)
+		ALOGW("Unable to signal mgmt monitor: %s", strerror(errno));
+
+	pthread_join(mgmt_thread, NULL);
+	mgmt_running = 0;
+
+	close(mgmt_stop_pipe[0]);
+	close(mgmt_stop_pipe[1]);
+	mgmt_stop_pipe[0] = -1;
+	mgmt_stop_pipe[1] = -1;
+}
+
+/*
+ * Take a reference on the monitor, starting it for the first user. The
+ * reference is held even when the start fails, mgmt_monitor_check()
+ * retries it.
+ */
+int mgmt_monitor_start(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&mgmt_ctl_lock);
+	mgmt_users++;
+	if (!mgmt_running)
+		ret = mgmt_monitor_spawn();
+	pthread_mutex_unlock(&mgmt_ctl_lock);
+
+	return ret;
+}
+
+void mgmt_monitor_stop(void)
+{
+	pthread_mutex_lock(&mgmt_ctl_lock);
+	if (mgmt_users > 0 && --mgmt_users == 0)
+		mgmt_monitor_reap();
+	pthread_mutex_unlock(&mgmt_ctl_lock);
+}
+
+/* Restart the monitor if it failed or could not be started */
+int mgmt_monitor_check(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&mgmt_ctl_lock);
+	if (mgmt_running && mgmt_failed)
+		mgmt_monitor_reap();
+	if (!mgmt_running)
+		ret = mgmt_users > 0 ? mgmt_monitor_spawn() : -1;
+	pthread_mutex_unlock(&mgmt_ctl_lock);
+
+	return ret;
+}
+
+/* Returns 1 if index is registered, 0 if not, -1 if not known yet */
+int mgmt_monitor_index_present(int index)
+{
+	int ret;
+
+	if (index < 0 || index >= MGMT_INDEX_MAX)
+		return 0;
+
+	pthread_mutex_lock(&mgmt_lock);
+	if (!mgmt_index_list_valid)
+		ret = -1;
+	else
+		ret = mgmt_bit_test(mgmt_index_map, index);
+	pthread_mutex_unlock(&mgmt_lock);
+
+	return ret;
+}
+
+/* Bus of hci<index>: usb, sdio, serial, platform... */
+static int mgmt_index_bus(int index, char *bus, size_t size)
+{
+	char link[64], path[PATH_MAX], *p;
+
+	snprintf(link, sizeof(link), "/sys/class/bluetooth/hci%d/device/subsystem", index);
+	if (!realpath(link, path))
+		return -1;
+
+	p = strrchr(path, '/');
+	strncpy(bus, p ? p + 1 : path, size - 1);
+	bus[size - 1] = '\0';
+
+	return 0;
+}
+
+/*
+ * A match is empty or "any", a bus name, or a controller address in the
+ * usual XX:XX:XX:XX:XX:XX form. Called with mgmt_lock held.
+ */
+static int mgmt_index_match(int index, const char *match)
+{
+	char bus[32], addr[18];
+	const uint8_t *a;
+
+	if (!match[0] || !strcmp(match, "any"))
+		return 1;
+
+	if (strlen(match) == 17 && match[2] == ':') {
+		if (!mgmt_bit_test(mgmt_index_addr_valid, index))
+			return 0;
+		a = mgmt_index_addr[index];
+		snprintf(addr, sizeof(addr), "%02X:%02X:%02X:%02X:%02X:%02X",
+			 a[5], a[4], a[3], a[2], a[1], a[0]);
+		return !strcasecmp(addr, match);
+	}
+
+	if (mgmt_index_bus(index, bus, sizeof(bus)))
+		return 0;
+
+	return !strcmp(bus, match);
+}
+
+/*
+ * Index owned by owner, or the first free registered index matching.
+ * Returns -1 when there is none yet. Called with mgmt_lock held.
+ */
+static int mgmt_index_select(const char *match, void *owner)
+{
+	int i;
+
+	for (i = 0; i < MGMT_INDEX_MAX; i++) {
+		if (mgmt_index_owner[i] == owner && mgmt_bit_test(mgmt_index_map, i))
+			return i;
+	}
+
+	for (i = 0; i < MGMT_INDEX_MAX; i++) {
+		if (!mgmt_bit_test(mgmt_index_map, i) || mgmt_index_owner[i])
+			continue;
+		if (!mgmt_index_match(i, match))
+			continue;
+
+		mgmt_index_owner[i] = owner;
+		return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Index the claim of owner got bound to, or -1. The bind takes the index
+ * off the list, it is not seen registered afterwards. Called with
+ * mgmt_lock held.
+ */
+static int mgmt_claim_bound(void *owner)
+{
+	int i;
+
+	for (i = 0; owner && i < MGMT_CLAIM_MAX; i++) {
+		if (mgmt_claims[i].owner == owner &&
+		    mgmt_claims[i].state == CLAIM_BOUND)
+			return mgmt_claims[i].bound_index;
+	}
+
+	return -1;
+}
+
+/*
+ * Wait for index to be registered, or with a match, for a controller to
+ * select, or for the claim of owner to be bound. The wait lasts
+ * timeout_ms, extended up to max_timeout_ms from the start as long as
+ * devices keep showing up.
+ * Returns the index once present, -ETIMEDOUT, -ECANCELED when *cancel is
+ * set (see mgmt_monitor_wake()), -ENODEV when the controller transport
+ * went away for good or -EIO on monitor failure.
+ */
+static int mgmt_monitor_wait(int index, const char *match, void *owner,
+			     int timeout_ms, int max_timeout_ms,
+			     volatile int *cancel)
+{
+	struct mgmt_transport *t;
+	struct timespec ts;
+	int64_t start, now, deadline, wake;
+	int ret;
+
+	if (!mgmt_running)
+		return -EIO;
+
+	start = mgmt_now_ms();
+
+	pthread_mutex_lock(&mgmt_lock);
+	while (1) {
+		if (mgmt_failed) {
+			ret = -EIO;
+			break;
+		}
+
+		if (cancel && *cancel) {
+			ret = -ECANCELED;
+			break;
+		}
+
+		ret = mgmt_claim_bound(owner);
+		if (ret >= 0)
+			break;
+
+		if (mgmt_index_list_valid) {
+			if (match) {
+				ret = mgmt_index_select(match, owner);
+				if (ret >= 0)
+					break;
+			} else if (mgmt_bit_test(mgmt_index_map, index)) {
+				ret = index;
+				break;
+			}
+		}
+
+		now = mgmt_now_ms();
+
+		deadline = start + timeout_ms;
+		if (mgmt_last_activity > start && mgmt_last_activity + timeout_ms > deadline)
+			deadline = mgmt_last_activity + timeout_ms;
+		if (deadline > start + max_timeout_ms)
+			deadline = start + max_timeout_ms;
+
+		if (now >= deadline) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+
+		wake = deadline;
+		t = match ? NULL : mgmt_transport_find(index);
+		if (t && t->gone_since) {
+			if (now >= t->gone_since + MGMT_TRANSPORT_GRACE) {
+				ret = -ENODEV;
+				break;
+			}
+			if (t->gone_since + MGMT_TRANSPORT_GRACE < wake)
+				wake = t->gone_since + MGMT_TRANSPORT_GRACE;
+		}
+
+		ts.tv_sec = wake / 1000;
+		ts.tv_nsec = (wake % 1000) * 1000000;
+		pthread_cond_timedwait(&mgmt_cond, &mgmt_lock, &ts);
+	}
+	pthread_mutex_unlock(&mgmt_lock);
+
+	return ret;
+}
+
+int mgmt_monitor_wait_index(int index, void *owner, int timeout_ms,
+			    int max_timeout_ms, volatile int *cancel)
+{
+	int ret;
+
+	if (index < 0 || index >= MGMT_INDEX_MAX)
+		return -EINVAL;
+
+	ret = mgmt_monitor_wait(index, NULL, owner, timeout_ms, max_timeout_ms,
+				cancel);
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Selection policy for hosts with several controllers: the index already
+ * selected by owner if still registered, otherwise the first registered
+ * index matching that no other owner selected. Waits as
+ * mgmt_monitor_wait_index() and returns the index or -errno.
+ */
+int mgmt_monitor_select_index(const char *match, void *owner, int timeout_ms,
+			      int max_timeout_ms, volatile int *cancel)
+{
+	return mgmt_monitor_wait(-1, match, owner, timeout_ms, max_timeout_ms,
+				 cancel);
+}
+
+/* Drop the selections of owner */
+void mgmt_monitor_release_index(void *owner)
+{
+	int i;
+
+	pthread_mutex_lock(&mgmt_lock);
+	for (i = 0; i < MGMT_INDEX_MAX; i++) {
+		if (mgmt_index_owner[i] == owner)
+			mgmt_index_owner[i] = NULL;
+	}
+	pthread_mutex_unlock(&mgmt_lock);
+}
+
+/*
+ * Fast claim: have the monitor bind fd, an unbound HCI socket, to the
+ * user channel of the next controller registering as index, or matching
+ * match with index -1. match must stay valid until the claim is dropped.
+ */
+int mgmt_monitor_claim(void *owner, int fd, int index, const char *match)
+{
+	int i, ret = -ENOSPC;
+
+	if (index >= MGMT_INDEX_MAX || (index < 0 && !match))
+		return -EINVAL;
+
+	pthread_mutex_lock(&mgmt_lock);
+	for (i = 0; i < MGMT_CLAIM_MAX; i++) {
+		if (mgmt_claims[i].owner)
+			continue;
+
+		mgmt_claims[i].owner = owner;
+		mgmt_claims[i].fd = fd;
+		mgmt_claims[i].index = index;
+		mgmt_claims[i].match = match;
+		mgmt_claims[i].state = CLAIM_PENDING;
+		mgmt_claims[i].bound_index = -1;
+		ret = 0;
+		break;
+	}
+	pthread_mutex_unlock(&mgmt_lock);
+
+	return ret;
+}
+
+/*
+ * Drop the claim of owner, once any bind in progress is over. Returns the
+ * index its socket got bound to, or -1 when it was not.
+ */
+int mgmt_monitor_unclaim(void *owner)
+{
+	int i, ret = -1;
+
+	pthread_mutex_lock(&mgmt_lock);
+	for (i = 0; i < MGMT_CLAIM_MAX; i++) {
+		if (mgmt_claims[i].owner != owner)
+			continue;
+
+		while (mgmt_claims[i].state == CLAIM_BINDING)
+			pthread_cond_wait(&mgmt_cond, &mgmt_lock);
+
+		if (mgmt_claims[i].state == CLAIM_BOUND)
+			ret = mgmt_claims[i].bound_index;
+		mgmt_claims[i].owner = NULL;
+	}
+	pthread_mutex_unlock(&mgmt_lock);
+
+	return ret;
+}
+
+/*
+ * Have efd, an eventfd, signalled each time index is removed. An owner
+ * watches one index at a time, a new call replaces the previous one.
+ */
+int mgmt_monitor_notify(void *owner, int index, int efd)
+{
+	struct mgmt_watch *w = NULL;
+	int i;
+
+	if (index < 0 || index >= MGMT_INDEX_MAX)
+		return -EINVAL;
+
+	pthread_mutex_lock(&mgmt_lock);
+	for (i = 0; i < MGMT_CLAIM_MAX; i++) {
+		if (mgmt_watches[i].owner == owner) {
+			w = &mgmt_watches[i];
+			break;
+		}
+		if (!w && !mgmt_watches[i].owner)
+			w = &mgmt_watches[i];
+	}
+	if (w) {
+		w->owner = owner;
+		w->index = index;
+		w->efd = efd;
+	}
+	pthread_mutex_unlock(&mgmt_lock);
+
+	return w ? 0 : -ENOSPC;
+}
+
+void mgmt_monitor_unnotify(void *owner)
+{
+	int i;
+
+	pthread_mutex_lock(&mgmt_lock);
+	for (i = 0; i < MGMT_CLAIM_MAX; i++) {
+		if (mgmt_watches[i].owner == owner)
+			mgmt_watches[i].owner = NULL;
+	}
+	pthread_mutex_unlock(&mgmt_lock);
+}
+
+/* Address of hci<index> as read by the monitor, little endian */
+int mgmt_monitor_index_addr(int index, uint8_t *addr)
+{
+	int ret = -1;
+
+	if (index < 0 || index >= MGMT_INDEX_MAX)
+		return -1;
+
+	pthread_mutex_lock(&mgmt_lock);
+	if (mgmt_bit_test(mgmt_index_map, index) &&
+	    mgmt_bit_test(mgmt_index_addr_valid, index)) {
+		memcpy(addr, mgmt_index_addr[index], 6);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&mgmt_lock);
+
+	return ret;
+}
+
+/* Kick waiters so they re-check their cancel flag */
+void mgmt_monitor_wake(void)
+{
+	if (!mgmt_running)
+		return;
+
+	pthread_mutex_lock(&mgmt_lock);
+	pthread_cond_broadcast(&mgmt_cond);
+	pthread_mutex_unlock(&mgmt_lock);
+}
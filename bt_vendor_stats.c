@@ -0,0 +1,178 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * Call counters and latency histograms of the vendor operations and of
+ * their phases. Updates are lock-free, readers get a consistent enough
+ * snapshot for monitoring.
+ */
+
+#define LOG_TAG "bt_vendor_stats"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <utils/Log.h>
+
+#include "bt_vendor_linux.h"
+
+/* Bucket i counts latencies below 2^i us, the last one everything above */
+#define STATS_BUCKETS		24
+
+struct stats_entry {
+	uint32_t count;
+	uint32_t failures;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint32_t hist[STATS_BUCKETS];
+};
+
+static struct stats_entry stats[STATS_MAX];
+
+static const char * const stats_names[STATS_MAX] = {
+	[STATS_POWER_ON]	= "power_on",
+	[STATS_POWER_OFF]	= "power_off",
+	[STATS_FW_CFG]		= "fw_cfg",
+	[STATS_WAIT_HCIDEV]	= "fw_cfg.wait_hcidev",
+	[STATS_HCIDEVDOWN]	= "fw_cfg.hcidevdown",
+	[STATS_BIND]		= "fw_cfg.bind",
+	[STATS_FW_DOWNLOAD]	= "fw_cfg.fw_download",
+	[STATS_READ_CAPS]	= "fw_cfg.read_caps",
+	[STATS_USERIAL_OPEN]	= "userial_open",
+	[STATS_USERIAL_CLOSE]	= "userial_close",
+	[STATS_COEX_CMD]	= "coex_cmd",
+	[STATS_COEX_URGENT_WAIT] = "coex_cmd.urgent_wait",
+	[STATS_COEX_BACKGROUND_WAIT] = "coex_cmd.background_wait",
+	[STATS_RECOVERY]	= "recovery",
+};
+
+uint64_t bt_vendor_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void bt_vendor_stats_record(int id, uint64_t start_us, int failed)
+{
+	struct stats_entry *s;
+	uint64_t us, max;
+	int bucket = 0;
+
+	if (id < 0 || id >= STATS_MAX)
+		return;
+
+	s = &stats[id];
+	us = bt_vendor_stats_now() - start_us;
+
+	while (bucket < STATS_BUCKETS - 1 && us >= (1ULL << bucket))
+		bucket++;
+
+	__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+	if (failed)
+		__atomic_fetch_add(&s->failures, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->total_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->hist[bucket], 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&s->max_us, __ATOMIC_RELAXED);
+	while (us > max &&
+	       !__atomic_compare_exchange_n(&s->max_us, &max, us, 0,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * One line per operation: count, failures, mean and max in us, then the
+ * non-empty buckets as "<upper bound in us>:<count>".
+ */
+int bt_vendor_stats_dump(int fd)
+{
+	char line[512];
+	uint32_t count, hist;
+	uint64_t total;
+	int id, i, len;
+
+	for (id = 0; id < STATS_MAX; id++) {
+		struct stats_entry *s = &stats[id];
+
+		count = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+		total = __atomic_load_n(&s->total_us, __ATOMIC_RELAXED);
+
+		len = snprintf(line, sizeof(line),
+			       "%-20s count %u failures %u mean_us %llu max_us %llu",
+			       stats_names[id], count,
+			       __atomic_load_n(&s->failures, __ATOMIC_RELAXED),
+			       count ? (unsigned long long)(total / count) : 0ULL,
+			       (unsigned long long)
+			       __atomic_load_n(&s->max_us, __ATOMIC_RELAXED));
+
+		for (i = 0; i < STATS_BUCKETS && len < (int) sizeof(line) - 32; i++) {
+			hist = __atomic_load_n(&s->hist[i], __ATOMIC_RELAXED);
+			if (!hist)
+				continue;
+			if (i == STATS_BUCKETS - 1)
+				len += snprintf(line + len, sizeof(line) - len,
+						" inf:%u", hist);
+			else
+				len += snprintf(line + len, sizeof(line) - len,
+						" %llu:%u", 1ULL << i, hist);
+		}
+
+		line[len++] = '\n';
+
+		if (write(fd, line, len) != len)
+			return -errno;
+	}
+
+	return 0;
+}
+
+int bt_vendor_stats_dump_file(const char *path)
+{
+	char tmp[PATH_MAX];
+	int fd, ret;
+
+	/* Readers never see a partial file */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ALOGE("Unable to open %s: %s", tmp, strerror(errno));
+		return -errno;
+	}
+
+	ret = bt_vendor_stats_dump(fd);
+	close(fd);
+
+	if (!ret && rename(tmp, path) < 0)
+		ret = -errno;
+
+	if (ret) {
+		ALOGE("Unable to write stats to %s: %s", path, strerror(-ret));
+		unlink(tmp);
+	}
+
+	return ret;
+}
@@ -0,0 +1,231 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2013 Intel Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*
+ * Always-on trace of the mgmt and coex HCI traffic handled by the vendor
+ * library. Recording is lock-free and costs a copy of the first bytes of
+ * each packet. The ring is dumped on demand in btsnoop format with the
+ * Linux monitor datalink, readable by btmon and Wireshark.
+ */
+
+#define LOG_TAG "bt_vendor_trace"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <utils/Log.h>
+
+#include "bt_vendor_linux.h"
+
+#define TRACE_ENTRIES		256	/* power of two */
+#define TRACE_DATA_MAX		64
+
+#define BTSNOOP_DATALINK_MONITOR	2001
+/* Microseconds between 0 AD and the Unix epoch */
+#define BTSNOOP_EPOCH_DELTA	0x00dcddb30f2f8000ULL
+
+struct trace_entry {
+	/* Position + 1 once the entry is complete, 0 while written */
+	uint32_t seq;
+	uint16_t type;
+	uint16_t len;
+	uint16_t orig_len;
+	uint64_t ts_us;
+	uint8_t  data[TRACE_DATA_MAX];
+};
+
+static struct trace_entry trace_ring[TRACE_ENTRIES];
+static uint32_t trace_head;
+
+static uint64_t trace_now_us(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void bt_vendor_trace(uint16_t type, const void *data, int len)
+{
+	struct trace_entry *e;
+	uint32_t pos;
+
+	if (len < 0)
+		return;
+
+	pos = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+	e = &trace_ring[pos % TRACE_ENTRIES];
+
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	e->type = type;
+	e->orig_len = len;
+	e->len = len < TRACE_DATA_MAX ? len : TRACE_DATA_MAX;
+	e->ts_us = trace_now_us(CLOCK_MONOTONIC);
+	memcpy(e->data, data, e->len);
+
+	__atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void put_be64(uint8_t *p, uint64_t v)
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v);
+}
+
+static int trace_write(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Write one btsnoop record. Monitor records carry the controller index and
+ * the packet type in their flags. mgmt packets are stored with their
+ * header and converted to monitor control records, prefixed with a cookie.
+ */
+static int trace_write_record(int fd, const struct trace_entry *e,
+			      int64_t clock_delta)
+{
+	uint8_t hdr[24 + 6];
+	uint16_t index = 0, opcode = e->type;
+	int hlen = 24, len = e->len, orig_len = e->orig_len;
+	const uint8_t *data = e->data;
+
+	if (e->type == TRACE_MGMT_COMMAND || e->type == TRACE_MGMT_EVENT) {
+		if (len < MGMT_HDR_SIZE)
+			return 0;
+
+		/* Cookie, then the mgmt opcode or event code */
+		put_be32(hdr + 24, 0);
+		hdr[28] = data[0];
+		hdr[29] = data[1];
+		index = data[2] | (data[3] << 8);
+		hlen += 6;
+		data += MGMT_HDR_SIZE;
+		len -= MGMT_HDR_SIZE;
+		orig_len -= MGMT_HDR_SIZE;
+	}
+
+	put_be32(hdr, orig_len + hlen - 24);
+	put_be32(hdr + 4, len + hlen - 24);
+	put_be32(hdr + 8, ((uint32_t)index << 16) | opcode);
+	put_be32(hdr + 12, 0);
+	put_be64(hdr + 16, e->ts_us + clock_delta + BTSNOOP_EPOCH_DELTA);
+
+	if (trace_write(fd, hdr, hlen))
+		return -1;
+
+	return trace_write(fd, data, len);
+}
+
+/*
+ * Dump the ring oldest first. Entries overwritten or still being written
+ * while dumping are skipped. Returns the number of records or -errno.
+ */
+int bt_vendor_trace_dump(int fd)
+{
+	static const uint8_t magic[8] = { 'b', 't', 's', 'n', 'o', 'o', 'p', 0 };
+	struct trace_entry e;
+	uint8_t hdr[16];
+	uint32_t head, pos, seq;
+	int64_t clock_delta;
+	int ret, count = 0;
+
+	memcpy(hdr, magic, sizeof(magic));
+	put_be32(hdr + 8, 1);
+	put_be32(hdr + 12, BTSNOOP_DATALINK_MONITOR);
+
+	ret = trace_write(fd, hdr, sizeof(hdr));
+	if (ret)
+		return ret;
+
+	/* Entries are stamped on the monotonic clock, btsnoop wants wall time */
+	clock_delta = trace_now_us(CLOCK_REALTIME) - trace_now_us(CLOCK_MONOTONIC);
+
+	head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	pos = head > TRACE_ENTRIES ? head - TRACE_ENTRIES : 0;
+
+	for (; pos != head; pos++) {
+		struct trace_entry *cur = &trace_ring[pos % TRACE_ENTRIES];
+
+		seq = __atomic_load_n(&cur->seq, __ATOMIC_ACQUIRE);
+		if (seq != pos + 1)
+			continue;
+
+		memcpy(&e, cur, sizeof(e));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&cur->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		ret = trace_write_record(fd, &e, clock_delta);
+		if (ret)
+			return ret;
+		count++;
+	}
+
+	return count;
+}
+
+int bt_vendor_trace_dump_file(const char *path)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0660);
+	if (fd < 0) {
+		ALOGE("Unable to open %s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	ret = bt_vendor_trace_dump(fd);
+	close(fd);
+
+	if (ret < 0)
+		ALOGE("Unable to dump trace to %s: %s", path, strerror(-ret));
+	else
+		ALOGI("%d trace records dumped to %s", ret, path);
+
+	return ret;
+}
@@ -0,0 +1,388 @@
+/******************************************************************************
+ *
+ *  Copyright (C) Intel 2014
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ *
+ *  Filename:   hci_cmd_ring.c
+ *
+ *  Description:    Shared memory command ring offered to the coex client,
+ *      avoiding a Binder transaction per command. See hci_cmd_ring.h for
+ *      the protocol.
+ *
+ ******************************************************************************/
+
+#define LOG_TAG "bt_bind_service"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <utils/Log.h>
+
+#include "libbtcellcoex-client.h"
+#include "hci_cmd_ring.h"
+#include "hci_service.h"
+
+/******************************************************************************
+**  Constants & Macros
+******************************************************************************/
+
+#ifndef BTHCISERVICE_DBG
+#define BTHCISERVICE_DBG FALSE
+#endif
+
+#if (BTHCISERVICE_DBG == TRUE)
+#define BTHSDBG(param, ...) {ALOGD(param, ## __VA_ARGS__);}
+#else
+#define BTHSDBG(param, ...) {}
+#endif
+
+#define BTHSERR(param, ...) {ALOGE(param, ## __VA_ARGS__);}
+#define BTHSWARN(param, ...) {ALOGW(param, ## __VA_ARGS__);}
+
+// Not exported by every libc
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC         0x0001U
+#define MFD_ALLOW_SEALING   0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS         1033
+#define F_SEAL_SEAL         0x0001
+#define F_SEAL_SHRINK       0x0002
+#define F_SEAL_GROW         0x0004
+#endif
+
+/******************************************************************************
+**  Static Variables
+******************************************************************************/
+
+static tHCI_CMD_RING *ring = NULL;
+static int ring_mem_fd = -1;
+static int ring_submit_fd = -1;
+static int ring_complete_fd = -1;
+static int ring_stop_fd = -1;
+static pthread_t ring_thread;
+static bool ring_thread_started = false;
+// Completions come from the stack and from the drain thread
+static pthread_mutex_t ring_cq_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/******************************************************************************
+**  Functions
+******************************************************************************/
+// Ring registration, only provided by client libraries supporting it
+extern int bindRingToCoexService(int memFd, size_t memSize, int submitFd,
+        int completeFd) __attribute__((weak));
+
+/*******************************************************************************
+**
+** Function         hci_cmd_ring_complete
+**
+** Description     Post the completion of a ring command to the client
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_ring_complete(int status, void *user_data)
+{
+    uint32_t tail, head;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&ring_cq_mutex);
+    if (ring) {
+        tail = ring->cq_tail;
+        head = __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE);
+        if (tail - head < HCI_CMD_RING_ENTRIES) {
+            tHCI_CMD_RING_CQE *cqe = &ring->cq[tail % HCI_CMD_RING_ENTRIES];
+
+            cqe->tag = (uint32_t)(uintptr_t)user_data;
+            cqe->status = status;
+            __atomic_store_n(&ring->cq_tail, tail + 1, __ATOMIC_RELEASE);
+            if (write(ring_complete_fd, &one, sizeof(one)) < 0)
+                BTHSWARN("%s: eventfd write failed: %s", __FUNCTION__, strerror(errno));
+        } else {
+            BTHSERR("%s: completion queue full, tag %u dropped", __FUNCTION__,
+                    (uint32_t)(uintptr_t)user_data);
+            __atomic_fetch_or(&ring->flags, HCI_CMD_RING_F_CQ_OVERFLOW, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&ring_cq_mutex);
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_ring_superseded
+**
+** Description     Check whether a later command queued in the ring makes
+**                 sqe, the local copy of the one at index, useless, see
+**                 hci_cmd_collapse
+**
+** Returns          true if the command at index needs not be sent
+**
+*******************************************************************************/
+static bool hci_cmd_ring_superseded(const tHCI_CMD_RING_SQE *sqe, uint32_t index,
+                                    uint32_t tail)
+{
+    uint8_t later[3];
+    uint16_t len;
+    uint32_t i;
+
+    if (sqe->len < 3 || sqe->len != sqe->cmd[2] + 3)
+        return false;
+
+    for (i = index + 1; i != tail; i++) {
+        const tHCI_CMD_RING_SQE *entry = &ring->sq[i % HCI_CMD_RING_ENTRIES];
+
+        // Read once, the client may be rewriting the entry
+        len = __atomic_load_n(&entry->len, __ATOMIC_RELAXED);
+        memcpy(later, entry->cmd, sizeof(later));
+        if (len < 3 || len > HCI_CMD_RING_CMD_MAX || len != later[2] + 3)
+            continue;
+        if (hci_cmd_collapse(sqe->cmd, later))
+            return true;
+    }
+
+    return false;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_ring_drain
+**
+** Description     Submit the commands queued by the client. Each entry is
+**                 copied once, then validated and sent from the copy: the
+**                 client shares the memory and may still write it.
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_ring_drain(void)
+{
+    uint32_t head = ring->sq_head;
+    uint32_t tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+    tHCI_CMD_RING_SQE sqe;
+    int status;
+
+    if (tail - head > HCI_CMD_RING_ENTRIES) {
+        BTHSERR("%s: corrupted submission queue, %u entries", __FUNCTION__, tail - head);
+        __atomic_store_n(&ring->sq_head, tail, __ATOMIC_RELEASE);
+        return;
+    }
+
+    while (head != tail) {
+        const tHCI_CMD_RING_SQE *entry = &ring->sq[head % HCI_CMD_RING_ENTRIES];
+
+        sqe.tag = __atomic_load_n(&entry->tag, __ATOMIC_RELAXED);
+        sqe.len = __atomic_load_n(&entry->len, __ATOMIC_RELAXED);
+        if (sqe.len <= HCI_CMD_RING_CMD_MAX)
+            memcpy(sqe.cmd, entry->cmd, sqe.len);
+
+        // The entry is copied, give it back
+        __atomic_store_n(&ring->sq_head, ++head, __ATOMIC_RELEASE);
+
+        if (sqe.len > HCI_CMD_RING_CMD_MAX)
+            status = BTCELLCOEX_STATUS_BAD_VALUE;
+        else if (hci_cmd_ring_superseded(&sqe, head - 1, tail))
+            status = BTCELLCOEX_STATUS_OK;
+        else
+            status = hci_cmd_send_async(sqe.len, sqe.cmd, hci_cmd_ring_complete,
+                                        (void *)(uintptr_t)sqe.tag);
+
+        if (status != BTCELLCOEX_STATUS_OK)
+            hci_cmd_ring_complete(status, (void *)(uintptr_t)sqe.tag);
+
+        if (head == tail)
+            tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_ring_thread
+**
+** Description     Wait for the client submissions until the ring is torn
+**                 down
+**
+** Returns          None
+**
+*******************************************************************************/
+static void *hci_cmd_ring_thread(void *param)
+{
+    struct pollfd pfd[2];
+    uint64_t count;
+
+    BTHSDBG("%s", __FUNCTION__);
+
+    pfd[0].fd = ring_submit_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = ring_stop_fd;
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            BTHSERR("%s: poll failed: %s", __FUNCTION__, strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents)
+            break;
+
+        if (pfd[0].revents & POLLIN) {
+            if (read(ring_submit_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                BTHSWARN("%s: eventfd read failed: %s", __FUNCTION__, strerror(errno));
+            hci_cmd_ring_drain();
+        }
+    }
+
+    BTHSDBG("%s exit", __FUNCTION__);
+
+    return NULL;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_ring_close
+**
+** Description     Release the ring resources
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_ring_close(void)
+{
+    pthread_mutex_lock(&ring_cq_mutex);
+    if (ring)
+        munmap(ring, sizeof(*ring));
+    ring = NULL;
+    pthread_mutex_unlock(&ring_cq_mutex);
+
+    if (ring_mem_fd >= 0)
+        close(ring_mem_fd);
+    if (ring_submit_fd >= 0)
+        close(ring_submit_fd);
+    if (ring_complete_fd >= 0)
+        close(ring_complete_fd);
+    if (ring_stop_fd >= 0)
+        close(ring_stop_fd);
+    ring_mem_fd = ring_submit_fd = ring_complete_fd = ring_stop_fd = -1;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_ring_init
+**
+** Description     Offer the shared memory ring to the coex client, when its
+**                 library supports it. Called once the client is bound.
+**
+** Returns          None
+**
+*******************************************************************************/
+void hci_cmd_ring_init(void)
+{
+    void *mem;
+    int ret;
+
+    if (!bindRingToCoexService || ring)
+        return;
+
+    ring_mem_fd = syscall(__NR_memfd_create, "bt_coex_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ring_mem_fd < 0) {
+        BTHSWARN("%s: memfd_create failed: %s", __FUNCTION__, strerror(errno));
+        return;
+    }
+
+    // Sealed size, the client cannot truncate the memory under our feet
+    if (ftruncate(ring_mem_fd, sizeof(tHCI_CMD_RING)) < 0 ||
+        fcntl(ring_mem_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        BTHSERR("%s: memfd setup failed: %s", __FUNCTION__, strerror(errno));
+        goto failure;
+    }
+
+    mem = mmap(NULL, sizeof(tHCI_CMD_RING), PROT_READ | PROT_WRITE, MAP_SHARED,
+               ring_mem_fd, 0);
+    if (mem == MAP_FAILED) {
+        BTHSERR("%s: mmap failed: %s", __FUNCTION__, strerror(errno));
+        goto failure;
+    }
+
+    ring_submit_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ring_complete_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ring_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ring = (tHCI_CMD_RING *) mem;
+    if (ring_submit_fd < 0 || ring_complete_fd < 0 || ring_stop_fd < 0) {
+        BTHSERR("%s: eventfd failed: %s", __FUNCTION__, strerror(errno));
+        goto failure;
+    }
+
+    // ftruncate zeroed the indexes
+    ring->magic = HCI_CMD_RING_MAGIC;
+    ring->version = HCI_CMD_RING_VERSION;
+    ring->entries = HCI_CMD_RING_ENTRIES;
+
+    if ((ret = pthread_create(&ring_thread, NULL, hci_cmd_ring_thread, NULL)) != 0) {
+        BTHSERR("%s: pthread_create failed: %s", __FUNCTION__, strerror(ret));
+        goto failure;
+    }
+    ring_thread_started = true;
+
+    if (bindRingToCoexService(ring_mem_fd, sizeof(tHCI_CMD_RING), ring_submit_fd,
+                              ring_complete_fd) != BTCELLCOEX_STATUS_OK) {
+        BTHSWARN("%s: bindRingToCoexService failure, using Binder calls", __FUNCTION__);
+        hci_cmd_ring_cleanup();
+        return;
+    }
+
+    BTHSDBG("%s: command ring of %d entries bound", __FUNCTION__, HCI_CMD_RING_ENTRIES);
+    return;
+
+failure:
+    hci_cmd_ring_close();
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_ring_cleanup
+**
+** Description     Stop draining the ring and release it. Commands still in
+**                 flight must have been completed beforehand.
+**
+** Returns          None
+**
+*******************************************************************************/
+void hci_cmd_ring_cleanup(void)
+{
+    uint64_t one = 1;
+    int ret;
+
+    if (ring_thread_started) {
+        if (write(ring_stop_fd, &one, sizeof(one)) < 0)
+            BTHSWARN("%s: eventfd write failed: %s", __FUNCTION__, strerror(errno));
+        if ((ret = pthread_join(ring_thread, NULL)) != 0)
+            BTHSWARN("%s: pthread_join failed: %s", __FUNCTION__, strerror(ret));
+        ring_thread_started = false;
+    }
+
+    hci_cmd_ring_close();
+}
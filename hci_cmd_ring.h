@@ -0,0 +1,93 @@
+/******************************************************************************
+ *
+ *  Copyright (C) Intel 2014
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ *
+ *  Filename:   hci_cmd_ring.h
+ *
+ *  Description:    Layout of the shared memory command ring between the
+ *      coex client and the vendor library, see hci_cmd_ring.c
+ *
+ *  The vendor library creates a memfd holding a tHCI_CMD_RING and two
+ *  eventfds, and hands them to the client through bindRingToCoexService.
+ *
+ *  Submission: the client writes sq[sq_tail % entries], then increments
+ *  sq_tail with release semantics and writes 1 to the submit eventfd.
+ *  The vendor library advances sq_head once the command is copied out of
+ *  the entry, which can then be reused.
+ *
+ *  Completion: the vendor library writes cq[cq_tail % entries], increments
+ *  cq_tail and writes 1 to the completion eventfd. The client advances
+ *  cq_head once the entry is consumed. A client must not have more than
+ *  entries commands waiting for their completion.
+ *
+ *  Indexes are free running, entries is a power of two.
+ *
+ ******************************************************************************/
+
+#ifndef HCI_CMD_RING_H
+#define HCI_CMD_RING_H
+
+#include <stdint.h>
+
+/******************************************************************************
+**  Constants & Macros
+******************************************************************************/
+
+#define HCI_CMD_RING_MAGIC      0x42544352  /* "BTCR" */
+#define HCI_CMD_RING_VERSION    1
+#define HCI_CMD_RING_ENTRIES    32
+
+// Largest HCI command: preamble plus 255 bytes of parameters
+#define HCI_CMD_RING_CMD_MAX    258
+
+// Set by the vendor library when a completion was dropped, cq full
+#define HCI_CMD_RING_F_CQ_OVERFLOW  0x01
+
+/******************************************************************************
+**  Type definitions
+******************************************************************************/
+
+typedef struct {
+    uint32_t tag;           // chosen by the client, echoed in the completion
+    uint16_t len;           // length of cmd, preamble included
+    uint8_t  cmd[HCI_CMD_RING_CMD_MAX];
+} tHCI_CMD_RING_SQE;
+
+typedef struct {
+    uint32_t tag;
+    int32_t  status;        // BTCELLCOEX_STATUS_*
+} tHCI_CMD_RING_CQE;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entries;
+    uint32_t flags;
+
+    // Each index on its own cache line, written by one side only
+    uint32_t sq_head __attribute__((aligned(64)));  // vendor library
+    uint32_t sq_tail __attribute__((aligned(64)));  // client
+    uint32_t cq_head __attribute__((aligned(64)));  // client
+    uint32_t cq_tail __attribute__((aligned(64)));  // vendor library
+
+    tHCI_CMD_RING_SQE sq[HCI_CMD_RING_ENTRIES] __attribute__((aligned(64)));
+    tHCI_CMD_RING_CQE cq[HCI_CMD_RING_ENTRIES];
+} tHCI_CMD_RING;
+
+#endif /* HCI_CMD_RING_H */
@@ -26,14 +26,22 @@
  ******************************************************************************/
 
 #define LOG_TAG "bt_bind_service"
+#define ATRACE_TAG ATRACE_TAG_HAL
 
+#include <errno.h>
 #include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 #include <utils/Log.h>
+#include <cutils/trace.h>
 
 #include "libbtcellcoex-client.h"
 #include "bt_hci_bdroid.h"
 #include "bt_vendor_lib.h"
 #include "hardware/bluetooth.h"
+#include "hci_service.h"
+#include "bt_vendor_linux.h"
 
 /******************************************************************************
 **  Constants & Macros
@@ -66,37 +74,307 @@
 #define HCI_CMD_PREAMBLE_SIZE                   3
 #define HCI_EVT_CMD_CMPL_STATUS_RET_BYTE        5
 #define HCI_EVT_CMD_CMPL_OPCODE                 3
+#define HCI_EVT_CMD_CMPL_NUM_CMD_PKTS           2
 
 #define STREAM_TO_UINT8(u8, p) {u8 = (uint8_t)(*(p)); (p) += 1;}
 #define STREAM_TO_UINT16(u16, p) {u16 = ((uint16_t)(*(p)) + (((uint16_t)(*((p) + 1))) << 8)); (p) += 2;}
 
-// Time to wait the HCI command complete event after that HCI command is sent.
+// Time to wait the HCI command complete event after that HCI command is sent,
+// until round trips are measured and at most afterwards.
 // CAUTION: Must be < 1000. On stress tests, 60ms has been measured between
 // the hci_cmd_send and the hci_cmd_cback calls.
 #define WAIT_TIME_MS       500
 
+// Lowest timeout derived from the measured round trips, keeps a margin over
+// the stress measurement above.
+#define WAIT_TIME_MIN_MS   100
+
+// Time a timed out command is remembered, its late completion is then
+// dropped instead of completing a newer command with the same opcode.
+#define STALE_TIME_MS      (4 * WAIT_TIME_MS)
+
+// Maximum number of coex commands in flight, matches the number of internal
+// commands the stack accepts through xmit_cb.
+#define HCI_CMD_QUEUE_SIZE 8
+
+// Maximum number of commands accepted by a single hci_cmd_send_batch call
+#define HCI_CMD_BATCH_MAX  32
+
+// Largest HCI command: preamble plus 255 bytes of parameters
+#define HCI_CMD_MAX_LEN    (HCI_CMD_PREAMBLE_SIZE + 255)
+
+// Number of pre-allocated command buffers
+#define HCI_CMD_POOL_SIZE  16
+
+// Systrace span of each command, from xmit to completion or timeout
+#define HCI_CMD_TRACE_NAME "bt coex cmd"
+
+// Budget of each scheduling class: burst commands handed to the stack per
+// period, and commands in flight. Background commands leave the other
+// controller credits to the stack and to urgent commands.
+#define HCI_CMD_URGENT_BURST        64
+#define HCI_CMD_URGENT_PERIOD_MS    50
+#define HCI_CMD_BACKGROUND_BURST    4
+#define HCI_CMD_BACKGROUND_PERIOD_MS 100
+#define HCI_CMD_BACKGROUND_INFLIGHT 1
+// A command preempted this long is not anymore, the urgent ones then let it
+// through: background commands progress under a continuous urgent load.
+#define HCI_CMD_CLASS_AGE_MS        HCI_CMD_BACKGROUND_PERIOD_MS
+// Longest wait of a command for its class turn, preemption and budget
+#define HCI_CMD_CLASS_WAIT_MS       2000
+
+// Fallback polling of the coex service when no availability notification
+// comes: first retry delay, doubled up to the maximum, +/- 25% jitter.
+#define BIND_RETRY_MIN_MS  100
+#define BIND_RETRY_MAX_MS  1000
+
 /******************************************************************************
 **  Extern variables and functions
 ******************************************************************************/
-extern const bt_vendor_callbacks_t *bt_vendor_cbacks;
+extern const bt_vendor_callbacks_t *bt_vendor_callbacks;
 
 /******************************************************************************
 **  Static Variables
 ******************************************************************************/
-static uint8_t status = -1;
+typedef struct {
+    bool in_use;
+    bool sent;
+    bool done;
+    uint16_t opcode;
+    uint32_t seq;
+    int status;
+    struct timespec deadline;
+    uint64_t sent_us;
+    tHCI_CMD_COMPLETE_CBACK p_cback;
+    void *user_data;
+    uint8_t cls;
+    // Parameters of a shadowed command, applied on success
+    bool shadowed;
+    uint8_t plen;
+    uint8_t params[HCI_CMD_MAX_LEN - HCI_CMD_PREAMBLE_SIZE];
+} tHCI_CMD_SLOT;
+
+// Last parameters the controller accepted for a coex configuration command
+typedef struct {
+    bool valid;
+    uint8_t plen;
+    uint8_t params[HCI_CMD_MAX_LEN - HCI_CMD_PREAMBLE_SIZE];
+    // Senders waiting to transmit or waiting for the completion, and
+    // ticket of the latest one: older waiting senders are superseded
+    int pending;
+    uint32_t ticket;
+} tHCI_CMD_SHADOW;
+
+// Command that timed out, waiting for its late completion
+typedef struct {
+    bool in_use;
+    uint16_t opcode;
+    uint32_t seq;
+    uint64_t expired_us;
+} tHCI_CMD_STALE;
+
+// Token bucket and queue of a scheduling class
+typedef struct {
+    const char *trace_name;     // queue depth counter
+    int stats_id;               // submission wait, STATS_*
+    int burst;
+    int period_ms;
+    int max_outstanding;
+    int tokens;
+    uint64_t refill_us;
+    int waiting;
+    int aged;                   // waiting commands no longer preempted
+    int outstanding;
+    uint32_t max_depth;
+    uint32_t throttled;
+} tHCI_CMD_CLASS_STATE;
+
+typedef struct {
+    int remaining;
+} tHCI_CMD_BATCH;
+
+typedef struct {
+    tHCI_CMD_BATCH *batch;
+    int *p_status;
+} tHCI_CMD_BATCH_ENTRY;
+
+static tHCI_CMD_SLOT cmd_queue[HCI_CMD_QUEUE_SIZE];
+static uint8_t cmd_outstanding = 0;
+// Last Num_HCI_Command_Packets reported by the controller
+static uint8_t cmd_credits = 1;
+static uint32_t cmd_seq = 0;
+static tHCI_CMD_STALE cmd_stale[HCI_CMD_QUEUE_SIZE];
+static uint32_t cmd_stale_drops = 0;
+// Coex configuration commands setting controller state, sending the
+// parameters already applied again is a no-op. Protected by mutex.
+static const uint16_t shadow_opcodes[] = {
+    0x0c3f,     // Set AFH Host Channel Classification
+    0x0c6e,     // Set MWS Channel Parameters
+    0x0c6f,     // Set External Frame Configuration
+    0x0c70,     // Set MWS Signaling
+    0x0c71,     // Set MWS Transport Layer
+    0x0c72,     // Set MWS Scan Frequency Table
+    0x0c73,     // Set MWS PATTERN Configuration
+    0x2014,     // LE Set Host Channel Classification
+};
+#define HCI_CMD_SHADOW_SIZE (sizeof(shadow_opcodes) / sizeof(shadow_opcodes[0]))
+static tHCI_CMD_SHADOW cmd_shadow[HCI_CMD_SHADOW_SIZE];
+static uint32_t cmd_shadow_hits = 0;
+static uint32_t cmd_shadow_collapsed = 0;
+// Protected by mutex
+static tHCI_CMD_CLASS_STATE cmd_classes[HCI_CMD_CLASS_MAX] = {
+    [HCI_CMD_CLASS_URGENT] = {
+        "bt coex urgent depth", STATS_COEX_URGENT_WAIT,
+        HCI_CMD_URGENT_BURST, HCI_CMD_URGENT_PERIOD_MS, HCI_CMD_QUEUE_SIZE,
+    },
+    [HCI_CMD_CLASS_BACKGROUND] = {
+        "bt coex background depth", STATS_COEX_BACKGROUND_WAIT,
+        HCI_CMD_BACKGROUND_BURST, HCI_CMD_BACKGROUND_PERIOD_MS,
+        HCI_CMD_BACKGROUND_INFLIGHT,
+    },
+};
+// Round trip estimate in us, smoothed as TCP does (RFC 6298), and the
+// resulting command timeout. Protected by mutex.
+static uint32_t cmd_srtt_us = 0;
+static uint32_t cmd_rttvar_us = 0;
+static int cmd_timeout_ms = WAIT_TIME_MS;
+// Controller capabilities from FW_CFG, protected by mutex
+static struct hci_caps ctrl_caps;
+static bool ctrl_caps_valid = false;
+// Process lifetime, initialized once and never destroyed: callers woken up
+// by cleanup still take the mutex on their way out
+static pthread_once_t sync_once = PTHREAD_ONCE_INIT;
+static bool thread_cond_ready = false;
 static pthread_cond_t thread_cond;
-static pthread_mutex_t mutex;
-static bool predicate = false;
+// Wakes the expiry thread up when an asynchronous command is sent
+static pthread_cond_t expire_cond;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static volatile bool hci_service_stopped = false;
+// Callers inside the command entry points, see hci_service_enter
+static int cmd_users = 0;
+
+// Binding retry thread, woken up by cleanup or by a service notification
 static pthread_t init_thread;
+static bool init_thread_started = false;
+static pthread_mutex_t bind_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bind_cond;
+static bool bind_cond_ready = false;
+static bool bind_stop = false;
+static bool bind_notified = false;
+
+// Expiry thread, calling back the asynchronous commands left without a
+// completion. Protected by mutex.
+static pthread_t expire_thread;
+static bool expire_thread_started = false;
+static bool expire_stop = false;
+
+// Command buffers allocated ahead of time from the stack allocator. The
+// stack frees transmitted buffers itself, so the pool only saves the
+// allocation from the submission path and is refilled between bursts.
+// Accessed with atomic operations only.
+static HC_BT_HDR *cmd_pool[HCI_CMD_POOL_SIZE];
+static uint32_t cmd_pool_hits = 0;
+static uint32_t cmd_pool_misses = 0;
 
 /******************************************************************************
 **  Functions
 ******************************************************************************/
-static int hci_cmd_send(const size_t cmdLen, const void* cmdBuf);
-void hci_bind_client_cleanup(void);
+// Batch entry point registration, only provided by client libraries
+// supporting batched submissions.
+extern int bindBatchToCoexService(int (*)(const size_t, const size_t *,
+        const void * const *, int *)) __attribute__((weak));
+
+// Service availability listener, only provided by client libraries able to
+// report when the coex service gets registered.
+extern int registerCoexServiceListener(void (*)(void)) __attribute__((weak));
+
+int hci_cmd_send(const size_t cmdLen, const void* cmdBuf);
 static void print_xmit(HC_BT_HDR *p_msg);
 static void *retry_init_thread(void* param);
+static void hci_bind_retry_start(void);
+static void hci_bind_retry_stop(void);
+static int hci_bind_coex_service(void);
+static void hci_cmd_pool_refill(void);
+static bool hci_cmd_buf_put(HC_BT_HDR *p_buf);
+static tHCI_CMD_SHADOW *hci_cmd_shadow_get(uint16_t opcode);
+static void hci_cmd_shadow_done_locked(tHCI_CMD_SLOT *slot, int result);
+static void hci_cmd_expire_start(void);
+static void hci_cmd_expire_stop(void);
+
+/*******************************************************************************
+**
+** Function         hci_service_sync_init
+**
+** Description     Create the conditions the senders and the expiry thread
+**                 wait on, once per process
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_service_sync_init(void)
+{
+    pthread_condattr_t cond_attr;
+    int ret;
+
+    // Command deadlines are on the monotonic clock, immune to time changes
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    ret = pthread_cond_init(&thread_cond, &cond_attr);
+    if (ret == 0) {
+        ret = pthread_cond_init(&expire_cond, &cond_attr);
+        if (ret != 0)
+            pthread_cond_destroy(&thread_cond);
+    }
+    pthread_condattr_destroy(&cond_attr);
+    if (ret != 0) {
+        BTHSERR("%s: pthread_cond_init failed: %s", __FUNCTION__, strerror(ret));
+        return;
+    }
+    thread_cond_ready = true;
+}
+
+/*******************************************************************************
+**
+** Function         hci_service_enter
+**
+** Description     Account a caller of the command entry points. Cleanup waits
+**                 for all of them to leave before returning.
+**
+** Returns          false if the service is stopped, the caller must not go on
+**
+*******************************************************************************/
+static bool hci_service_enter(void)
+{
+    bool entered;
+
+    pthread_mutex_lock(&mutex);
+    entered = !hci_service_stopped;
+    if (entered)
+        cmd_users++;
+    pthread_mutex_unlock(&mutex);
+
+    if (!entered)
+        BTHSWARN("%s: HCI service is stopped!", __FUNCTION__);
+
+    return entered;
+}
+
+/*******************************************************************************
+**
+** Function         hci_service_leave
+**
+** Description     A caller accounted by hci_service_enter is done
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_service_leave(void)
+{
+    pthread_mutex_lock(&mutex);
+    if (--cmd_users == 0 && hci_service_stopped)
+        pthread_cond_broadcast(&thread_cond);
+    pthread_mutex_unlock(&mutex);
+}
 
 /*******************************************************************************
 **
@@ -110,51 +388,164 @@ static void *retry_init_thread(void* param);
 *******************************************************************************/
 void hci_bind_client_init(void)
 {
-    int ret = -1;
+    int i;
     int bind_state = BTCELLCOEX_STATUS_NO_INIT;
-    pthread_attr_t thread_attr;
 
     BTHSVERB("%s enter", __FUNCTION__);
 
-    if ((ret = pthread_cond_init(&thread_cond, NULL)) != 0) {
-        BTHSERR("%s: pthread_cond_init failed: %s", __FUNCTION__, strerror(ret));
-        hci_service_stopped = true;
-        return;
-    }
-    if ((ret = pthread_mutex_init(&mutex, NULL)) != 0) {
-        BTHSERR("%s: pthread_mutex_init failed: %s", __FUNCTION__, strerror(ret));
+    pthread_once(&sync_once, hci_service_sync_init);
+    if (!thread_cond_ready) {
         hci_service_stopped = true;
-        if ((ret = pthread_cond_destroy(&thread_cond)) != 0)
-            BTHSWARN("%s: pthread_cond_destroy failed: %s", __FUNCTION__, strerror(ret));
         return;
     }
 
+    // A previous cleanup waited for its callers, only late completions from
+    // the stack can still show up
+    pthread_mutex_lock(&mutex);
     hci_service_stopped = false;
 
-    bind_state = bindToCoexService(&hci_cmd_send);
+    memset(cmd_stale, 0, sizeof(cmd_stale));
+    memset(cmd_shadow, 0, sizeof(cmd_shadow));
+    for (i = 0; i < HCI_CMD_CLASS_MAX; i++) {
+        cmd_classes[i].tokens = cmd_classes[i].burst;
+        cmd_classes[i].refill_us = bt_vendor_stats_now();
+        cmd_classes[i].waiting = 0;
+        cmd_classes[i].aged = 0;
+        cmd_classes[i].outstanding = 0;
+    }
+    cmd_srtt_us = 0;
+    cmd_rttvar_us = 0;
+    cmd_timeout_ms = WAIT_TIME_MS;
+    pthread_mutex_unlock(&mutex);
+
+    hci_cmd_pool_refill();
+    hci_cmd_expire_start();
+
+    bind_state = hci_bind_coex_service();
     if(bind_state != BTCELLCOEX_STATUS_OK) {
         BTHSDBG("%s: bindToCoexService failure, planning to retry later", __FUNCTION__);
+        hci_bind_retry_start();
+    }
 
-        BTHSDBG("%s: Create a thread on service", __FUNCTION__);
-        if ((ret = pthread_attr_init(&thread_attr)) != 0) {
-            BTHSERR("%s: pthread_attr_init failed: %s", __FUNCTION__, strerror(ret));
-            return;
-        }
-        if ((ret = pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED)) != 0) {
-            BTHSERR("%s: pthread_attr_setdetachstate failed: %s", __FUNCTION__, strerror(ret));
-            pthread_attr_destroy(&thread_attr);
-            return;
-        }
-        if ((ret = pthread_create(&init_thread, &thread_attr, retry_init_thread, NULL)) != 0) {
-            BTHSERR("%s: pthread_create failed: %s", __FUNCTION__, strerror(ret));
-            pthread_attr_destroy(&thread_attr);
+    BTHSVERB("%s exit", __FUNCTION__);
+}
+
+/*******************************************************************************
+**
+** Function         hci_bind_coex_service
+**
+** Description     Bind the HCI command entry points to the coex service
+**
+** Returns          BTCELLCOEX_STATUS_OK on success
+**
+*******************************************************************************/
+static int hci_bind_coex_service(void)
+{
+    int bind_state = bindToCoexService(&hci_cmd_send);
+
+    if (bind_state == BTCELLCOEX_STATUS_OK && bindBatchToCoexService) {
+        if (bindBatchToCoexService(&hci_cmd_send_batch) != BTCELLCOEX_STATUS_OK)
+            BTHSWARN("%s: bindBatchToCoexService failure", __FUNCTION__);
+    }
+
+    // Heavy coex traffic then bypasses Binder, when the client supports it
+    if (bind_state == BTCELLCOEX_STATUS_OK)
+        hci_cmd_ring_init();
+
+    return bind_state;
+}
+
+/*******************************************************************************
+**
+** Function         hci_bind_client_notify
+**
+** Description     Report that the coex service may have become available,
+** the pending binding retry is done right away instead of at the next poll.
+**
+** Returns          None
+**
+*******************************************************************************/
+void hci_bind_client_notify(void)
+{
+    BTHSDBG("%s", __FUNCTION__);
+
+    pthread_mutex_lock(&bind_mutex);
+    bind_notified = true;
+    if (bind_cond_ready)
+        pthread_cond_broadcast(&bind_cond);
+    pthread_mutex_unlock(&bind_mutex);
+}
+
+/*******************************************************************************
+**
+** Function         hci_bind_retry_start
+**
+** Description     Start the binding retry thread
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_bind_retry_start(void)
+{
+    pthread_condattr_t cond_attr;
+    int ret = -1;
+
+    pthread_mutex_lock(&bind_mutex);
+
+    if (!bind_cond_ready) {
+        // Waits are measured on the monotonic clock, immune to time changes
+        pthread_condattr_init(&cond_attr);
+        pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+        ret = pthread_cond_init(&bind_cond, &cond_attr);
+        pthread_condattr_destroy(&cond_attr);
+        if (ret != 0) {
+            BTHSERR("%s: pthread_cond_init failed: %s", __FUNCTION__, strerror(ret));
+            pthread_mutex_unlock(&bind_mutex);
             return;
         }
-        if ((ret = pthread_attr_destroy(&thread_attr)) != 0)
-            BTHSWARN("%s: pthread_attr_destroy failed: %s", __FUNCTION__, strerror(ret));
+        bind_cond_ready = true;
     }
 
-    BTHSVERB("%s exit", __FUNCTION__);
+    bind_stop = false;
+    bind_notified = false;
+    pthread_mutex_unlock(&bind_mutex);
+
+    if (registerCoexServiceListener &&
+            registerCoexServiceListener(&hci_bind_client_notify) != BTCELLCOEX_STATUS_OK)
+        BTHSWARN("%s: registerCoexServiceListener failure, polling only", __FUNCTION__);
+
+    BTHSDBG("%s: Create a thread on service", __FUNCTION__);
+    if ((ret = pthread_create(&init_thread, NULL, retry_init_thread, NULL)) != 0) {
+        BTHSERR("%s: pthread_create failed: %s", __FUNCTION__, strerror(ret));
+        return;
+    }
+    init_thread_started = true;
+}
+
+/*******************************************************************************
+**
+** Function         hci_bind_retry_stop
+**
+** Description     Interrupt the binding retry thread and wait for its end
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_bind_retry_stop(void)
+{
+    int ret = -1;
+
+    if (!init_thread_started)
+        return;
+
+    pthread_mutex_lock(&bind_mutex);
+    bind_stop = true;
+    pthread_cond_broadcast(&bind_cond);
+    pthread_mutex_unlock(&bind_mutex);
+
+    if ((ret = pthread_join(init_thread, NULL)) != 0)
+        BTHSWARN("%s: pthread_join failed: %s", __FUNCTION__, strerror(ret));
+    init_thread_started = false;
 }
 
 /*******************************************************************************
@@ -162,7 +553,9 @@ void hci_bind_client_init(void)
 ** Function         retry_init_thread
 **
 ** Description     Thread handling the binding retry in case the modem is not
-** ready and so the BT handler and its binder doesn't exist.
+** ready and so the BT handler and its binder doesn't exist. It retries when
+** notified of the service availability, otherwise polls with a short
+** jittered delay so that devices polling at once do not stay in step.
 ** param not necessary but compiler friendly.
 **
 ** Returns          None
@@ -170,28 +563,59 @@ void hci_bind_client_init(void)
 *******************************************************************************/
 static void *retry_init_thread(void* param)
 {
-    int seconds = 1;
+    int delay_ms = BIND_RETRY_MIN_MS;
+    int wait_ms;
     int bind_retry = BTCELLCOEX_STATUS_NO_INIT;
+    unsigned int seed = (unsigned int)getpid() ^ (unsigned int)time(NULL);
+    struct timespec ts;
 
     BTHSDBG("%s", __FUNCTION__);
 
+    pthread_mutex_lock(&bind_mutex);
     for(;;) {
-        if (hci_service_stopped) {
+        wait_ms = delay_ms - delay_ms / 4 + rand_r(&seed) % (delay_ms / 2 + 1);
+        BTHSVERB("%s: Wait %d ms before retrying to bind", __FUNCTION__, wait_ms);
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += wait_ms / 1000;
+        ts.tv_nsec += (wait_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        while (!bind_stop && !bind_notified) {
+            if (pthread_cond_timedwait(&bind_cond, &bind_mutex, &ts) == ETIMEDOUT)
+                break;
+        }
+
+        if (bind_stop || hci_service_stopped) {
             BTHSDBG("%s: hci_service_stopped, retry_init_thread exit", __FUNCTION__);
-            pthread_exit(NULL);
+            break;
+        }
+
+        if (bind_notified) {
+            // The service just showed up, poll fast again if not yet usable
+            bind_notified = false;
+            delay_ms = BIND_RETRY_MIN_MS;
+        } else if (delay_ms < BIND_RETRY_MAX_MS) {
+            delay_ms *= 2;
+            if (delay_ms > BIND_RETRY_MAX_MS)
+                delay_ms = BIND_RETRY_MAX_MS;
         }
-        BTHSVERB("%s: Wait before retrying to bind", __FUNCTION__);
-        sleep(seconds);
-        if (seconds < 10)
-            seconds++;
-        bind_retry = bindToCoexService(&hci_cmd_send);
+
+        pthread_mutex_unlock(&bind_mutex);
+        bind_retry = hci_bind_coex_service();
+        pthread_mutex_lock(&bind_mutex);
+
         if(bind_retry != BTCELLCOEX_STATUS_OK) {
-            BTHSDBG("%s: bindToCoexService failure, retry in %d seconds", __FUNCTION__, seconds);
+            BTHSDBG("%s: bindToCoexService failure, retry in %d ms", __FUNCTION__, delay_ms);
         } else {
             BTHSDBG("%s: bindToCoexService success", __FUNCTION__);
             break;
         }
     }
+    pthread_mutex_unlock(&bind_mutex);
 
     return NULL; // Not necessary but compiler friendly
 }
@@ -208,171 +632,1452 @@ static void *retry_init_thread(void* param)
 *******************************************************************************/
 void hci_bind_client_cleanup(void)
 {
-    int ret = -1;
+    int i;
+    tHCI_CMD_SLOT pending[HCI_CMD_QUEUE_SIZE];
+    int num_pending = 0;
+
     BTHSDBG("%s", __FUNCTION__);
 
     hci_service_stopped = true;
 
-    if ((ret = pthread_mutex_destroy(&mutex)) != 0)
-        BTHSWARN("%s: pthread_mutex_destroy failed: %s", __FUNCTION__, strerror(ret));
-    if ((ret = pthread_cond_destroy(&thread_cond)) != 0)
-        BTHSWARN("%s: pthread_cond_destroy failed: %s", __FUNCTION__, strerror(ret));
+    // Interrupts a pending binding retry at once
+    hci_bind_retry_stop();
+
+    if (!thread_cond_ready)
+        return;
+
+    // Commands in flight are failed below rather than timed out
+    hci_cmd_expire_stop();
+
+    // Fail the asynchronous commands still in flight and wake up the
+    // blocking senders so that nobody is left waiting on the condition.
+    pthread_mutex_lock(&mutex);
+    for (i = 0; i < HCI_CMD_QUEUE_SIZE; i++) {
+        tHCI_CMD_SLOT *slot = &cmd_queue[i];
+
+        if (!slot->in_use || slot->done)
+            continue;
+        ATRACE_ASYNC_END(HCI_CMD_TRACE_NAME, slot->seq);
+        hci_cmd_shadow_done_locked(slot, BTCELLCOEX_STATUS_INVALID_OPERATION);
+        if (slot->p_cback) {
+            pending[num_pending++] = *slot;
+            slot->in_use = false;
+        } else {
+            slot->status = BTCELLCOEX_STATUS_INVALID_OPERATION;
+            slot->done = true;
+        }
+    }
+    cmd_outstanding = 0;
+    for (i = 0; i < HCI_CMD_CLASS_MAX; i++)
+        cmd_classes[i].outstanding = 0;
+    pthread_cond_broadcast(&thread_cond);
+    pthread_mutex_unlock(&mutex);
+
+    for (i = 0; i < num_pending; i++)
+        pending[i].p_cback(BTCELLCOEX_STATUS_INVALID_OPERATION, pending[i].user_data);
+
+    // Ring completions were posted above, the ring can go
+    hci_cmd_ring_cleanup();
+
+    // The senders woken above still hold their slot or class accounting
+    // until they reacquire the mutex and leave
+    pthread_mutex_lock(&mutex);
+    while (cmd_users > 0)
+        pthread_cond_wait(&thread_cond, &mutex);
+
+    // Late completions from the stack find nothing to match anymore
+    memset(cmd_stale, 0, sizeof(cmd_stale));
+    memset(cmd_shadow, 0, sizeof(cmd_shadow));
+    pthread_mutex_unlock(&mutex);
 
-    BTHSDBG("%s done.", __FUNCTION__);
+    for (i = 0; i < HCI_CMD_POOL_SIZE; i++) {
+        HC_BT_HDR *p_buf = __atomic_exchange_n(&cmd_pool[i], NULL, __ATOMIC_ACQUIRE);
+
+        if (p_buf && bt_vendor_callbacks)
+            bt_vendor_callbacks->dealloc(p_buf);
+    }
+
+    BTHSDBG("%s done. pool hits %u misses %u", __FUNCTION__,
+            __atomic_load_n(&cmd_pool_hits, __ATOMIC_RELAXED),
+            __atomic_load_n(&cmd_pool_misses, __ATOMIC_RELAXED));
 }
 
 /*******************************************************************************
 **
-** Function         hci_cmd_cback
+** Function         hci_cmd_pool_refill
 **
-** Description     Callback invoked on completion of the HCI command
+** Description     Top up the command buffer pool from the stack allocator
 **
 ** Returns          None
 **
 *******************************************************************************/
-static void hci_cmd_cback(void *p_mem)
+static void hci_cmd_pool_refill(void)
 {
-    int ret = -1;
-    HC_BT_HDR *p_evt_buf = (HC_BT_HDR *) p_mem;
-    uint8_t *p;
-    uint16_t opcode;
+    HC_BT_HDR *p_buf;
+    int i;
 
-    // Get the HCI command complete event status
-    status = *((uint8_t *)(p_evt_buf + 1) + HCI_EVT_CMD_CMPL_STATUS_RET_BYTE);
-    p = (uint8_t *)(p_evt_buf + 1) + HCI_EVT_CMD_CMPL_OPCODE;
-    STREAM_TO_UINT16(opcode, p);
+    if (!bt_vendor_callbacks)
+        return;
 
-    if (status == 0) {
-        BTHSDBG("%s: HCI with opcode: 0x%04X success", __FUNCTION__, opcode);
-    } else {
-        BTHSERR("%s: HCI with opcode: 0x%04X failure", __FUNCTION__, opcode);
-    }
+    for (i = 0; i < HCI_CMD_POOL_SIZE; i++) {
+        if (__atomic_load_n(&cmd_pool[i], __ATOMIC_RELAXED))
+            continue;
 
-    // We need to deallocate the received buffer
-    if (bt_vendor_cbacks)
-        bt_vendor_cbacks->dealloc(p_evt_buf);
+        p_buf = (HC_BT_HDR *) bt_vendor_callbacks->alloc(BT_HC_HDR_SIZE + HCI_CMD_MAX_LEN);
+        if (!p_buf) {
+            BTHSWARN("%s: failed to allocate buffer.", __FUNCTION__);
+            return;
+        }
 
-    if ((ret = pthread_mutex_lock(&mutex)) != 0) {
-        BTHSERR("%s: pthread_mutex_lock failed: %s", __FUNCTION__, strerror(ret));
-        return;
+        if (!hci_cmd_buf_put(p_buf)) {
+            bt_vendor_callbacks->dealloc(p_buf);
+            return;
+        }
     }
-    predicate = true;
-    // Wakeup the socket server thread so it can send the status to the sender
-    if ((ret = pthread_cond_signal(&thread_cond)) != 0)
-        BTHSERR("%s: pthread_cond_signal failed: %s", __FUNCTION__, strerror(ret));
-    if ((ret = pthread_mutex_unlock(&mutex)) != 0)
-        BTHSERR("%s: pthread_mutex_unlock failed: %s", __FUNCTION__, strerror(ret));
 }
 
 /*******************************************************************************
 **
-** Function         hci_cmd_send
+** Function         hci_cmd_buf_get
 **
-** Returns          BTCELLCOEX_STATUS_OK on success
-**                  BTCELLCOEX_STATUS_INVALID_OPERATION if the service if not ready
-**                  BTCELLCOEX_STATUS_BAD_VALUE on invalid parameters
-**                  BTCELLCOEX_STATUS_UNKNOWN_ERROR on internal software issues
-**                  BTCELLCOEX_STATUS_CMD_FAILED on HCI transmission failures
+** Description     Get a buffer for an HCI command of length bytes, from the
+**                 pool when possible, from the stack allocator otherwise
+**
+** Returns          The buffer, NULL if none is available
 **
 *******************************************************************************/
-int hci_cmd_send(const size_t cmdLen, const void* cmdBuf)
+static HC_BT_HDR *hci_cmd_buf_get(uint16_t length)
 {
-    uint8_t *p;
-    struct timespec ts;
-    struct timeval currentTime;
-    int ret = 0;
-    int retVal = BTCELLCOEX_STATUS_OK;
-    HC_BT_HDR *p_msg = NULL;
-    uint8_t *pcmdBuf = (uint8_t *)cmdBuf;
-
-    BTHSDBG("%s", __FUNCTION__);
-
-    if(hci_service_stopped) {
-        BTHSWARN("%s: HCI service is stopped!", __FUNCTION__);
-        return BTCELLCOEX_STATUS_INVALID_OPERATION;
-    }
-
-    if(NULL == cmdBuf) {
-        BTHSERR("%s: null cmd pointer passed!", __FUNCTION__);
-        return BTCELLCOEX_STATUS_BAD_VALUE;
-    }
-
-    uint16_t opcode = (uint16_t)(*(pcmdBuf)) + (((uint16_t)(*((pcmdBuf) + 1))) << 8);
-    uint8_t length = (uint8_t)(*((pcmdBuf) + 2)) + HCI_CMD_PREAMBLE_SIZE;
+    HC_BT_HDR *p_buf;
+    int i;
 
-    if (length != (uint8_t) cmdLen) {
-        BTHSERR("%s: wrong cmd length parameter!", __FUNCTION__);
-        return BTCELLCOEX_STATUS_BAD_VALUE;
-    }
-    if (!bt_vendor_cbacks) {
-        BTHSERR("%s: bt_vendor_cbacks not initialized.", __FUNCTION__);
-        return BTCELLCOEX_STATUS_UNKNOWN_ERROR;
-    }
-    // Transmitted buffers are automatically deallocated
-    if ((p_msg = (HC_BT_HDR *) bt_vendor_cbacks->alloc(BT_HC_HDR_SIZE + length)) == NULL) {
-        BTHSERR("%s: failed to allocate buffer.", __FUNCTION__);
-        return BTCELLCOEX_STATUS_UNKNOWN_ERROR;
+    for (i = 0; i < HCI_CMD_POOL_SIZE; i++) {
+        if (!__atomic_load_n(&cmd_pool[i], __ATOMIC_RELAXED))
+            continue;
+        p_buf = __atomic_exchange_n(&cmd_pool[i], NULL, __ATOMIC_ACQUIRE);
+        if (p_buf) {
+            __atomic_fetch_add(&cmd_pool_hits, 1, __ATOMIC_RELAXED);
+            return p_buf;
+        }
     }
 
-    p_msg->event = MSG_STACK_TO_HC_HCI_CMD;
-    p_msg->len = length;
-    p_msg->offset = 0;
-
-    p = (uint8_t *)(p_msg + 1);
-    memcpy(p, cmdBuf, length);
+    __atomic_fetch_add(&cmd_pool_misses, 1, __ATOMIC_RELAXED);
 
-    // Only if BTHCISERVICE_VERB == TRUE
-    print_xmit(p_msg);
+    return (HC_BT_HDR *) bt_vendor_callbacks->alloc(BT_HC_HDR_SIZE + length);
+}
 
-    // HCI send / cback mechanism is made to send 1 cmd at a time.
-    if ((ret = pthread_mutex_lock(&mutex)) != 0) {
-        BTHSERR("%s: pthread_mutex_lock failed: %s", __FUNCTION__, strerror(ret));
-        bt_vendor_cbacks->dealloc(p_msg);
-        return BTCELLCOEX_STATUS_UNKNOWN_ERROR;
-    }
+/*******************************************************************************
+**
+** Function         hci_cmd_buf_put
+**
+** Description     Give a full size buffer to the pool
+**
+** Returns          true if the pool took the buffer
+**
+*******************************************************************************/
+static bool hci_cmd_buf_put(HC_BT_HDR *p_buf)
+{
+    HC_BT_HDR *expected;
+    int i;
 
-    // Send the HCI command
-    if (bt_vendor_cbacks->xmit_cb(opcode, p_msg, hci_cmd_cback) == FALSE) {
-        BTHSERR("%s: failed to xmit buffer.", __FUNCTION__);
-        bt_vendor_cbacks->dealloc(p_msg);
-        retVal = BTCELLCOEX_STATUS_UNKNOWN_ERROR;
-        goto exit_unlock;
+    for (i = 0; i < HCI_CMD_POOL_SIZE; i++) {
+        expected = NULL;
+        if (__atomic_compare_exchange_n(&cmd_pool[i], &expected, p_buf, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return true;
     }
 
-    gettimeofday(&currentTime, NULL);
-    ts.tv_nsec = (currentTime.tv_usec * 1000) + (WAIT_TIME_MS % 1000) * 1000000;
-    ts.tv_sec = currentTime.tv_sec + (WAIT_TIME_MS / 1000) + (ts.tv_nsec / 1000000000);
-    ts.tv_nsec %= 1000000000;
+    return false;
+}
 
-    ret = 0;
-    while (!predicate && ret == 0)
-        ret = pthread_cond_timedwait(&thread_cond, &mutex, &ts);
-    if (ret == 0) {
-        BTHSVERB("%s: pthread_cond_timedwait succeed", __FUNCTION__);
-        predicate = false;
-    } else {
-        BTHSERR("%s: pthread_cond_timedwait failed: %s", __FUNCTION__, strerror(ret));
-        retVal = BTCELLCOEX_STATUS_UNKNOWN_ERROR;
-        goto exit_unlock;
+/*******************************************************************************
+**
+** Function         hci_cmd_pool_stats
+**
+** Description     Number of command buffers taken from the pool (hits) and
+**                 from the stack allocator (misses) since start
+**
+** Returns          None
+**
+*******************************************************************************/
+void hci_cmd_pool_stats(uint32_t *hits, uint32_t *misses)
+{
+    *hits = __atomic_load_n(&cmd_pool_hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cmd_pool_misses, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_timeout_stats
+**
+** Description     Current command timeout, derived from the measured round
+**                 trips, and number of late completions dropped since start
+**
+** Returns          None
+**
+*******************************************************************************/
+void hci_cmd_timeout_stats(uint32_t *timeout_ms, uint32_t *stale_drops)
+{
+    pthread_mutex_lock(&mutex);
+    *timeout_ms = cmd_timeout_ms;
+    *stale_drops = cmd_stale_drops;
+    pthread_mutex_unlock(&mutex);
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_shadow_stats
+**
+** Description     Number of coex configuration commands completed locally
+**                 since start, as already applied (hits) or superseded by
+**                 a newer one before being sent (collapsed)
+**
+** Returns          None
+**
+*******************************************************************************/
+void hci_cmd_shadow_stats(uint32_t *hits, uint32_t *collapsed)
+{
+    pthread_mutex_lock(&mutex);
+    *hits = cmd_shadow_hits;
+    *collapsed = cmd_shadow_collapsed;
+    pthread_mutex_unlock(&mutex);
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_class_stats
+**
+** Description     Deepest queue of a scheduling class since start, commands
+**                 waiting plus in flight, and number of submissions held
+**                 back by the class budget
+**
+** Returns          None
+**
+*******************************************************************************/
+void hci_cmd_class_stats(int cmdClass, uint32_t *max_depth, uint32_t *throttled)
+{
+    *max_depth = 0;
+    *throttled = 0;
+    if (cmdClass < 0 || cmdClass >= HCI_CMD_CLASS_MAX)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    *max_depth = cmd_classes[cmdClass].max_depth;
+    *throttled = cmd_classes[cmdClass].throttled;
+    pthread_mutex_unlock(&mutex);
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_collapse
+**
+** Description     Check whether a queued command is superseded by a later
+**                 one of the same burst, both validated. It then completes
+**                 successfully without being sent.
+**
+** Returns          1 if cmdBuf does not need to be sent, 0 otherwise
+**
+*******************************************************************************/
+int hci_cmd_collapse(const void *cmdBuf, const void *laterBuf)
+{
+    const uint8_t *cmd = (const uint8_t *)cmdBuf;
+    const uint8_t *later = (const uint8_t *)laterBuf;
+
+    if (cmd[0] != later[0] || cmd[1] != later[1])
+        return 0;
+    if (!hci_cmd_shadow_get((uint16_t)cmd[0] + ((uint16_t)cmd[1] << 8)))
+        return 0;
+
+    pthread_mutex_lock(&mutex);
+    cmd_shadow_collapsed++;
+    pthread_mutex_unlock(&mutex);
+
+    return 1;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_shadow_get
+**
+** Description     Shadow of the controller state set by a coex command
+**
+** Returns          The shadow entry, NULL if the opcode is not shadowed
+**
+*******************************************************************************/
+static tHCI_CMD_SHADOW *hci_cmd_shadow_get(uint16_t opcode)
+{
+    size_t i;
+
+    for (i = 0; i < HCI_CMD_SHADOW_SIZE; i++) {
+        if (shadow_opcodes[i] == opcode)
+            return &cmd_shadow[i];
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_shadow_done_locked
+**
+** Description     Record the outcome of a shadowed command. The controller
+**                 state is unknown after a failure or a timeout.
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_shadow_done_locked(tHCI_CMD_SLOT *slot, int result)
+{
+    tHCI_CMD_SHADOW *shadow;
+
+    if (!slot->shadowed)
+        return;
+
+    shadow = hci_cmd_shadow_get(slot->opcode);
+    shadow->pending--;
+    shadow->valid = (result == BTCELLCOEX_STATUS_OK);
+    if (shadow->valid) {
+        shadow->plen = slot->plen;
+        memcpy(shadow->params, slot->params, slot->plen);
+    }
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_class_refill_locked
+**
+** Description     Give a class the tokens earned since its last refill
+**
+** Returns          Monotonic time in us at which the next token is earned
+**
+*******************************************************************************/
+static uint64_t hci_cmd_class_refill_locked(tHCI_CMD_CLASS_STATE *c)
+{
+    uint64_t now_us = bt_vendor_stats_now();
+    uint64_t interval_us = (uint64_t)c->period_ms * 1000 / c->burst;
+    uint64_t n;
+
+    if (c->tokens >= c->burst) {
+        c->refill_us = now_us;
+        return now_us;
+    }
+
+    n = (now_us - c->refill_us) / interval_us;
+    if (n > 0) {
+        c->tokens = n >= (uint64_t)(c->burst - c->tokens) ? c->burst : c->tokens + (int)n;
+        c->refill_us += n * interval_us;
+    }
+
+    return c->refill_us + interval_us;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_class_depth_locked
+**
+** Description     Account a change of the number of commands of a class
+**                 waiting or in flight
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_class_depth_locked(tHCI_CMD_CLASS_STATE *c)
+{
+    uint32_t depth = c->waiting + c->outstanding;
+
+    if (depth > c->max_depth)
+        c->max_depth = depth;
+    ATRACE_INT(c->trace_name, depth);
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_class_done_locked
+**
+** Description     A command of the class completed or timed out
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_class_done_locked(tHCI_CMD_SLOT *slot)
+{
+    tHCI_CMD_CLASS_STATE *c = &cmd_classes[slot->cls];
+
+    if (c->outstanding > 0)
+        c->outstanding--;
+    hci_cmd_class_depth_locked(c);
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_class_preempted_locked
+**
+** Description     Check whether a command of cmdClass must let the commands
+**                 of another class go first. Urgent commands go first,
+**                 unless a background command aged and can be sent.
+**
+** Returns          true if the command must wait
+**
+*******************************************************************************/
+static bool hci_cmd_class_preempted_locked(int cmdClass, bool aged)
+{
+    tHCI_CMD_CLASS_STATE *c;
+    int i;
+
+    if (cmdClass != HCI_CMD_CLASS_URGENT)
+        return !aged && cmd_classes[HCI_CMD_CLASS_URGENT].waiting > 0;
+
+    for (i = 0; i < HCI_CMD_CLASS_MAX; i++) {
+        c = &cmd_classes[i];
+        if (i == HCI_CMD_CLASS_URGENT || c->aged == 0 ||
+            c->outstanding >= c->max_outstanding)
+            continue;
+        hci_cmd_class_refill_locked(c);
+        if (c->tokens > 0)
+            return true;
+    }
+
+    return false;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_timespec_add
+**
+** Description     Move a CLOCK_MONOTONIC time forward by us
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_timespec_add(struct timespec *ts, uint64_t us)
+{
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000;
+    ts->tv_sec += ts->tv_nsec / 1000000000;
+    ts->tv_nsec %= 1000000000;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_deadline
+**
+** Description     Compute the monotonic time at which a command sent now
+**                 is considered lost. Called with mutex held.
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_deadline(struct timespec *ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_nsec += (cmd_timeout_ms % 1000) * 1000000;
+    ts->tv_sec += (cmd_timeout_ms / 1000) + (ts->tv_nsec / 1000000000);
+    ts->tv_nsec %= 1000000000;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_rtt_sample_locked
+**
+** Description     Update the round trip estimate with a command that
+**                 completed in time, and the timeout derived from it
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_rtt_sample_locked(uint32_t rtt_us)
+{
+    uint32_t delta;
+    int timeout_ms;
+
+    if (cmd_srtt_us == 0) {
+        cmd_srtt_us = rtt_us;
+        cmd_rttvar_us = rtt_us / 2;
+    } else {
+        delta = rtt_us > cmd_srtt_us ? rtt_us - cmd_srtt_us : cmd_srtt_us - rtt_us;
+        cmd_rttvar_us = cmd_rttvar_us - cmd_rttvar_us / 4 + delta / 4;
+        cmd_srtt_us = cmd_srtt_us - cmd_srtt_us / 8 + rtt_us / 8;
+    }
+
+    timeout_ms = (cmd_srtt_us + 4 * cmd_rttvar_us) / 1000 + 1;
+    if (timeout_ms < WAIT_TIME_MIN_MS)
+        timeout_ms = WAIT_TIME_MIN_MS;
+    if (timeout_ms > WAIT_TIME_MS)
+        timeout_ms = WAIT_TIME_MS;
+    cmd_timeout_ms = timeout_ms;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_stale_add_locked
+**
+** Description     Release the slot of a command that timed out and remember
+**                 it until its completion shows up. The timeout is backed
+**                 off until a command completes in time again.
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_stale_add_locked(tHCI_CMD_SLOT *slot)
+{
+    uint64_t now_us = bt_vendor_stats_now();
+    tHCI_CMD_STALE *stale = NULL;
+    int i;
+
+    BTHSERR("%s: HCI with opcode: 0x%04X timed out after %d ms", __FUNCTION__,
+            slot->opcode, cmd_timeout_ms);
+    bt_vendor_stats_record(STATS_COEX_CMD, slot->sent_us, 1);
+    ATRACE_ASYNC_END(HCI_CMD_TRACE_NAME, slot->seq);
+    hci_cmd_shadow_done_locked(slot, BTCELLCOEX_STATUS_UNKNOWN_ERROR);
+    hci_cmd_class_done_locked(slot);
+    slot->in_use = false;
+    cmd_outstanding--;
+
+    cmd_timeout_ms *= 2;
+    if (cmd_timeout_ms > WAIT_TIME_MS)
+        cmd_timeout_ms = WAIT_TIME_MS;
+
+    // Reuse an entry that is free, too old, or else the oldest one
+    for (i = 0; i < HCI_CMD_QUEUE_SIZE; i++) {
+        tHCI_CMD_STALE *cur = &cmd_stale[i];
+
+        if (!cur->in_use || now_us - cur->expired_us > STALE_TIME_MS * 1000ULL) {
+            stale = cur;
+            break;
+        }
+        if (!stale || (int32_t)(cur->seq - stale->seq) < 0)
+            stale = cur;
+    }
+
+    stale->in_use = true;
+    stale->opcode = slot->opcode;
+    stale->seq = slot->seq;
+    stale->expired_us = now_us;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_stale_find_locked
+**
+** Description     Oldest timed out command with this opcode still expected
+**                 to complete
+**
+** Returns          The stale entry, NULL if none
+**
+*******************************************************************************/
+static tHCI_CMD_STALE *hci_cmd_stale_find_locked(uint16_t opcode)
+{
+    uint64_t now_us = bt_vendor_stats_now();
+    tHCI_CMD_STALE *stale = NULL;
+    int i;
+
+    for (i = 0; i < HCI_CMD_QUEUE_SIZE; i++) {
+        tHCI_CMD_STALE *cur = &cmd_stale[i];
+
+        if (!cur->in_use)
+            continue;
+        if (now_us - cur->expired_us > STALE_TIME_MS * 1000ULL) {
+            cur->in_use = false;
+            continue;
+        }
+        if (cur->opcode != opcode)
+            continue;
+        if (!stale || (int32_t)(cur->seq - stale->seq) < 0)
+            stale = cur;
+    }
+
+    return stale;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_expire_locked
+**
+** Description     Release the asynchronous commands whose deadline is over.
+**                 Their slots are copied to expired so that the completion
+**                 callbacks can be called once the mutex is released.
+**
+** Returns          Number of expired commands
+**
+*******************************************************************************/
+static int hci_cmd_expire_locked(tHCI_CMD_SLOT *expired)
+{
+    struct timespec now;
+    int i, num_expired = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (i = 0; i < HCI_CMD_QUEUE_SIZE; i++) {
+        tHCI_CMD_SLOT *slot = &cmd_queue[i];
+
+        if (!slot->in_use || !slot->p_cback)
+            continue;
+        if ((slot->deadline.tv_sec > now.tv_sec) ||
+            ((slot->deadline.tv_sec == now.tv_sec) &&
+             (slot->deadline.tv_nsec > now.tv_nsec)))
+            continue;
+
+        expired[num_expired++] = *slot;
+        hci_cmd_stale_add_locked(slot);
+    }
+
+    return num_expired;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_next_deadline_locked
+**
+** Description     Earliest deadline of the asynchronous commands in flight
+**
+** Returns          false if there is none
+**
+*******************************************************************************/
+static bool hci_cmd_next_deadline_locked(struct timespec *ts)
+{
+    bool found = false;
+    int i;
+
+    for (i = 0; i < HCI_CMD_QUEUE_SIZE; i++) {
+        tHCI_CMD_SLOT *slot = &cmd_queue[i];
+
+        if (!slot->in_use || !slot->p_cback)
+            continue;
+        if (found && ((slot->deadline.tv_sec > ts->tv_sec) ||
+                      ((slot->deadline.tv_sec == ts->tv_sec) &&
+                       (slot->deadline.tv_nsec >= ts->tv_nsec))))
+            continue;
+
+        *ts = slot->deadline;
+        found = true;
+    }
+
+    return found;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_expire_thread_main
+**
+** Description     Sleep until the earliest asynchronous command deadline and
+**                 expire the commands whose completion never came. Without
+**                 it, a lost completion would only be noticed by the next
+**                 submission, possibly never.
+**
+** Returns          None
+**
+*******************************************************************************/
+static void *hci_cmd_expire_thread_main(void *param)
+{
+    tHCI_CMD_SLOT expired[HCI_CMD_QUEUE_SIZE];
+    struct timespec ts;
+    int i, num_expired;
+
+    BTHSDBG("%s", __FUNCTION__);
+
+    pthread_mutex_lock(&mutex);
+    while (!expire_stop) {
+        num_expired = hci_cmd_expire_locked(expired);
+        if (num_expired > 0) {
+            // Slots and credits are back for the senders
+            pthread_cond_broadcast(&thread_cond);
+            pthread_mutex_unlock(&mutex);
+            for (i = 0; i < num_expired; i++)
+                expired[i].p_cback(BTCELLCOEX_STATUS_UNKNOWN_ERROR, expired[i].user_data);
+            pthread_mutex_lock(&mutex);
+            continue;
+        }
+
+        if (hci_cmd_next_deadline_locked(&ts))
+            pthread_cond_timedwait(&expire_cond, &mutex, &ts);
+        else
+            pthread_cond_wait(&expire_cond, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    BTHSDBG("%s exit", __FUNCTION__);
+
+    return NULL;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_expire_start
+**
+** Description     Start the expiry thread. Without it, asynchronous commands
+**                 still expire when a sender or a batch waits.
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_expire_start(void)
+{
+    int ret;
+
+    if (expire_thread_started)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    expire_stop = false;
+    pthread_mutex_unlock(&mutex);
+
+    if ((ret = pthread_create(&expire_thread, NULL, hci_cmd_expire_thread_main, NULL)) != 0) {
+        BTHSERR("%s: pthread_create failed: %s", __FUNCTION__, strerror(ret));
+        return;
+    }
+    expire_thread_started = true;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_expire_stop
+**
+** Description     Stop the expiry thread and wait for its end, along with
+**                 the callbacks it is calling
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_expire_stop(void)
+{
+    int ret;
+
+    if (!expire_thread_started)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    expire_stop = true;
+    pthread_cond_signal(&expire_cond);
+    pthread_mutex_unlock(&mutex);
+
+    if ((ret = pthread_join(expire_thread, NULL)) != 0)
+        BTHSWARN("%s: pthread_join failed: %s", __FUNCTION__, strerror(ret));
+    expire_thread_started = false;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_cback
+**
+** Description     Callback invoked on completion of the HCI command. The
+**                 controller completes commands with the same opcode in
+**                 order: the completion belongs to the oldest one, dropped
+**                 if that command already timed out.
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_cback(void *p_mem)
+{
+    int ret = -1;
+    int i;
+    HC_BT_HDR *p_evt_buf = (HC_BT_HDR *) p_mem;
+    tHCI_CMD_SLOT *slot = NULL;
+    tHCI_CMD_STALE *stale;
+    tHCI_CMD_COMPLETE_CBACK p_cback = NULL;
+    void *user_data = NULL;
+    uint8_t *p;
+    uint8_t status, num_cmd_pkts;
+    uint16_t opcode;
+    int result;
+    bool idle = false;
+
+    // Get the HCI command complete event status
+    status = *((uint8_t *)(p_evt_buf + 1) + HCI_EVT_CMD_CMPL_STATUS_RET_BYTE);
+    num_cmd_pkts = *((uint8_t *)(p_evt_buf + 1) + HCI_EVT_CMD_CMPL_NUM_CMD_PKTS);
+    p = (uint8_t *)(p_evt_buf + 1) + HCI_EVT_CMD_CMPL_OPCODE;
+    STREAM_TO_UINT16(opcode, p);
+
+    if (status == 0) {
+        BTHSDBG("%s: HCI with opcode: 0x%04X success", __FUNCTION__, opcode);
+        result = BTCELLCOEX_STATUS_OK;
+    } else {
+        BTHSERR("%s: HCI with opcode: 0x%04X failure", __FUNCTION__, opcode);
+        result = BTCELLCOEX_STATUS_CMD_FAILED;
+    }
+
+    bt_vendor_trace(TRACE_HCI_EVENT, (uint8_t *)(p_evt_buf + 1), p_evt_buf->len);
+
+    // We need to deallocate the received buffer
+    if (bt_vendor_callbacks)
+        bt_vendor_callbacks->dealloc(p_evt_buf);
+
+    if ((ret = pthread_mutex_lock(&mutex)) != 0) {
+        BTHSERR("%s: pthread_mutex_lock failed: %s", __FUNCTION__, strerror(ret));
+        return;
+    }
+
+    cmd_credits = num_cmd_pkts;
+
+    for (i = 0; i < HCI_CMD_QUEUE_SIZE; i++) {
+        tHCI_CMD_SLOT *cur = &cmd_queue[i];
+
+        if (!cur->in_use || !cur->sent || cur->done || cur->opcode != opcode)
+            continue;
+        if (!slot || (int32_t)(cur->seq - slot->seq) < 0)
+            slot = cur;
+    }
+
+    stale = hci_cmd_stale_find_locked(opcode);
+    if (stale && (!slot || (int32_t)(stale->seq - slot->seq) < 0)) {
+        BTHSWARN("%s: late completion of opcode 0x%04X seq %u dropped", __FUNCTION__,
+                 opcode, stale->seq);
+        stale->in_use = false;
+        cmd_stale_drops++;
+    } else if (slot) {
+        hci_cmd_rtt_sample_locked(bt_vendor_stats_now() - slot->sent_us);
+        hci_cmd_shadow_done_locked(slot, result);
+        hci_cmd_class_done_locked(slot);
+        bt_vendor_stats_record(STATS_COEX_CMD, slot->sent_us, result != BTCELLCOEX_STATUS_OK);
+        ATRACE_ASYNC_END(HCI_CMD_TRACE_NAME, slot->seq);
+        cmd_outstanding--;
+        idle = (cmd_outstanding == 0);
+        if (slot->p_cback) {
+            p_cback = slot->p_cback;
+            user_data = slot->user_data;
+            slot->in_use = false;
+        } else {
+            slot->status = result;
+            slot->done = true;
+        }
+    } else {
+        BTHSWARN("%s: no command pending for opcode 0x%04X", __FUNCTION__, opcode);
+    }
+
+    // Wakeup the senders, either their command completed or a credit is back
+    if ((ret = pthread_cond_broadcast(&thread_cond)) != 0)
+        BTHSERR("%s: pthread_cond_broadcast failed: %s", __FUNCTION__, strerror(ret));
+    if ((ret = pthread_mutex_unlock(&mutex)) != 0)
+        BTHSERR("%s: pthread_mutex_unlock failed: %s", __FUNCTION__, strerror(ret));
+
+    if (p_cback)
+        p_cback(result, user_data);
+
+    // Burst is over, restock the pool outside of the submission path
+    if (idle)
+        hci_cmd_pool_refill();
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_validate
+**
+** Description     Check that an HCI command can be submitted
+**
+** Returns          BTCELLCOEX_STATUS_* as hci_cmd_send
+**
+*******************************************************************************/
+static int hci_cmd_validate(const size_t cmdLen, const void* cmdBuf)
+{
+    uint8_t *pcmdBuf = (uint8_t *)cmdBuf;
+
+    if(hci_service_stopped) {
+        BTHSWARN("%s: HCI service is stopped!", __FUNCTION__);
+        return BTCELLCOEX_STATUS_INVALID_OPERATION;
     }
 
-    if (status == 0) {
+    if(NULL == cmdBuf) {
+        BTHSERR("%s: null cmd pointer passed!", __FUNCTION__);
+        return BTCELLCOEX_STATUS_BAD_VALUE;
+    }
+
+    if (cmdLen < HCI_CMD_PREAMBLE_SIZE) {
+        BTHSERR("%s: wrong cmd length parameter!", __FUNCTION__);
+        return BTCELLCOEX_STATUS_BAD_VALUE;
+    }
+
+    // Up to 255 parameter bytes, the full length does not fit a uint8_t
+    uint16_t length = (uint16_t)(*((pcmdBuf) + 2)) + HCI_CMD_PREAMBLE_SIZE;
+
+    if (length != cmdLen) {
+        BTHSERR("%s: wrong cmd length parameter!", __FUNCTION__);
+        return BTCELLCOEX_STATUS_BAD_VALUE;
+    }
+    if (!bt_vendor_callbacks) {
+        BTHSERR("%s: bt_vendor_callbacks not initialized.", __FUNCTION__);
+        return BTCELLCOEX_STATUS_UNKNOWN_ERROR;
+    }
+
+    // Fail locally what the controller would reject
+    uint16_t opcode = (uint16_t)(*(pcmdBuf)) + (((uint16_t)(*((pcmdBuf) + 1))) << 8);
+    int supported = -1;
+
+    pthread_mutex_lock(&mutex);
+    if (ctrl_caps_valid)
+        supported = hci_caps_cmd_supported(&ctrl_caps, opcode);
+    pthread_mutex_unlock(&mutex);
+
+    if (supported == 0) {
+        BTHSERR("%s: opcode 0x%04X not supported by the controller", __FUNCTION__, opcode);
+        return BTCELLCOEX_STATUS_INVALID_OPERATION;
+    }
+
+    return BTCELLCOEX_STATUS_OK;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_set_caps
+**
+** Description     Capabilities of the controller the commands go to, read
+**                 at FW_CFG, or NULL when unknown. The command credits
+**                 start from what the controller last reported, commands
+**                 that timed out before and the coex state shadow are
+**                 forgotten.
+**
+** Returns          None
+**
+*******************************************************************************/
+void hci_cmd_set_caps(const struct hci_caps *caps)
+{
+    size_t i;
+
+    if (hci_service_stopped)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    // Commands lost with the previous controller will never complete, and
+    // the coex configuration was reset with it
+    memset(cmd_stale, 0, sizeof(cmd_stale));
+    for (i = 0; i < HCI_CMD_SHADOW_SIZE; i++)
+        cmd_shadow[i].valid = false;
+    ctrl_caps_valid = caps != NULL;
+    if (caps) {
+        ctrl_caps = *caps;
+        if (caps->ncmd)
+            cmd_credits = caps->ncmd;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_submit
+**
+** Description     Validate and transmit an HCI command. Waits for a free
+**                 queue slot and for the controller to have a command
+**                 credit left. A coex configuration command completes
+**                 locally when its parameters are already applied, or when
+**                 a newer one with the same opcode is submitted while it
+**                 waits: only the latest state is sent.
+**                 Commands also wait for a token of their class, and
+**                 background commands for the urgent ones to be sent. Time
+**                 spent waiting for a token is not counted in the timeout.
+**
+** Returns          BTCELLCOEX_STATUS_* as hci_cmd_send, *pp_slot is set to
+**                  the slot tracking the command on success, or left NULL
+**                  if completed locally. p_cback is then already called.
+**
+*******************************************************************************/
+static int hci_cmd_submit(const size_t cmdLen, const void* cmdBuf, int cmdClass,
+                          tHCI_CMD_COMPLETE_CBACK p_cback, void *user_data,
+                          tHCI_CMD_SLOT **pp_slot)
+{
+    uint8_t *p;
+    struct timespec ts, wake, class_ts;
+    uint64_t submit_us = bt_vendor_stats_now();
+    uint64_t next_us, now_us;
+    tHCI_CMD_CLASS_STATE *c;
+    bool queued = false, throttled = false, aged = false, armed = false;
+    bool room;
+    int ret = 0;
+    int i, num_expired = 0;
+    int retVal = BTCELLCOEX_STATUS_OK;
+    HC_BT_HDR *p_msg = NULL;
+    tHCI_CMD_SLOT *slot = NULL;
+    tHCI_CMD_SLOT expired[HCI_CMD_QUEUE_SIZE];
+    tHCI_CMD_SHADOW *shadow = NULL;
+    uint32_t ticket = 0;
+    bool local_done = false;
+    uint8_t *pcmdBuf = (uint8_t *)cmdBuf;
+
+    if (cmdClass < 0 || cmdClass >= HCI_CMD_CLASS_MAX) {
+        BTHSERR("%s: invalid command class %d!", __FUNCTION__, cmdClass);
+        return BTCELLCOEX_STATUS_BAD_VALUE;
+    }
+    c = &cmd_classes[cmdClass];
+
+    if ((retVal = hci_cmd_validate(cmdLen, cmdBuf)) != BTCELLCOEX_STATUS_OK)
+        return retVal;
+
+    uint16_t opcode = (uint16_t)(*(pcmdBuf)) + (((uint16_t)(*((pcmdBuf) + 1))) << 8);
+    uint16_t length = (uint16_t)(*((pcmdBuf) + 2)) + HCI_CMD_PREAMBLE_SIZE;
+
+    // Transmitted buffers are automatically deallocated
+    if ((p_msg = hci_cmd_buf_get(length)) == NULL) {
+        BTHSERR("%s: failed to allocate buffer.", __FUNCTION__);
+        return BTCELLCOEX_STATUS_UNKNOWN_ERROR;
+    }
+
+    p_msg->event = MSG_STACK_TO_HC_HCI_CMD;
+    p_msg->len = length;
+    p_msg->offset = 0;
+
+    p = (uint8_t *)(p_msg + 1);
+    memcpy(p, cmdBuf, length);
+
+    // Only if BTHCISERVICE_VERB == TRUE
+    print_xmit(p_msg);
+
+    if ((ret = pthread_mutex_lock(&mutex)) != 0) {
+        BTHSERR("%s: pthread_mutex_lock failed: %s", __FUNCTION__, strerror(ret));
+        bt_vendor_callbacks->dealloc(p_msg);
+        return BTCELLCOEX_STATUS_UNKNOWN_ERROR;
+    }
+
+    uint8_t plen = length - HCI_CMD_PREAMBLE_SIZE;
+
+    shadow = hci_cmd_shadow_get(opcode);
+    if (shadow) {
+        if (shadow->valid && shadow->pending == 0 && shadow->plen == plen &&
+            memcmp(shadow->params, pcmdBuf + HCI_CMD_PREAMBLE_SIZE, plen) == 0) {
+            BTHSVERB("%s: opcode 0x%04X already applied", __FUNCTION__, opcode);
+            cmd_shadow_hits++;
+            shadow = NULL;
+            local_done = true;
+            goto exit_dealloc;
+        }
+        // Supersedes the senders of this opcode still waiting
+        ticket = ++shadow->ticket;
+        shadow->pending++;
+        pthread_cond_broadcast(&thread_cond);
+    }
+
+    c->waiting++;
+    queued = true;
+    hci_cmd_class_depth_locked(c);
+
+    // Wait for the class turn, bounded by the class deadline, then for a
+    // queue slot and a controller command credit, bounded by the command
+    // timeout from the moment the command competes for them
+    clock_gettime(CLOCK_MONOTONIC, &class_ts);
+    hci_cmd_timespec_add(&class_ts, (uint64_t)HCI_CMD_CLASS_WAIT_MS * 1000);
+    for (;;) {
+        if (hci_service_stopped) {
+            BTHSWARN("%s: HCI service is stopped!", __FUNCTION__);
+            retVal = BTCELLCOEX_STATUS_INVALID_OPERATION;
+            goto exit_release;
+        }
+
+        if (shadow && shadow->ticket != ticket) {
+            BTHSVERB("%s: opcode 0x%04X superseded", __FUNCTION__, opcode);
+            cmd_shadow_collapsed++;
+            local_done = true;
+            goto exit_release;
+        }
+
+        if (num_expired == 0)
+            num_expired = hci_cmd_expire_locked(expired);
+
+        now_us = bt_vendor_stats_now();
+        if (!aged && cmdClass != HCI_CMD_CLASS_URGENT &&
+            now_us - submit_us >= (uint64_t)HCI_CMD_CLASS_AGE_MS * 1000) {
+            aged = true;
+            c->aged++;
+            // Urgent senders now let this one through
+            pthread_cond_broadcast(&thread_cond);
+        }
+
+        room = c->outstanding < c->max_outstanding;
+        if (room && !hci_cmd_class_preempted_locked(cmdClass, aged)) {
+            next_us = hci_cmd_class_refill_locked(c);
+            if (c->tokens > 0) {
+                if (!armed) {
+                    hci_cmd_deadline(&ts);
+                    armed = true;
+                }
+
+                slot = NULL;
+                if (cmd_outstanding < (cmd_credits ? cmd_credits : 1)) {
+                    for (i = 0; i < HCI_CMD_QUEUE_SIZE; i++) {
+                        if (!cmd_queue[i].in_use) {
+                            slot = &cmd_queue[i];
+                            break;
+                        }
+                    }
+                }
+                if (slot)
+                    break;
+
+                ret = pthread_cond_timedwait(&thread_cond, &mutex, &ts);
+                if (ret != 0) {
+                    BTHSERR("%s: no command credit: %s", __FUNCTION__, strerror(ret));
+                    bt_vendor_stats_record(c->stats_id, submit_us, 1);
+                    retVal = BTCELLCOEX_STATUS_UNKNOWN_ERROR;
+                    goto exit_release;
+                }
+                continue;
+            }
+
+            // Over budget, wait for the next token
+            if (!throttled) {
+                c->throttled++;
+                throttled = true;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &wake);
+            if (next_us > now_us)
+                hci_cmd_timespec_add(&wake, next_us - now_us);
+        } else {
+            // Another class goes first, or this one has its share in flight
+            clock_gettime(CLOCK_MONOTONIC, &wake);
+            if (aged || cmdClass == HCI_CMD_CLASS_URGENT)
+                wake = class_ts;
+            else
+                hci_cmd_timespec_add(&wake, submit_us +
+                        (uint64_t)HCI_CMD_CLASS_AGE_MS * 1000 - now_us);
+        }
+
+        // Not competing for a credit anymore
+        armed = false;
+        if (wake.tv_sec > class_ts.tv_sec ||
+            (wake.tv_sec == class_ts.tv_sec && wake.tv_nsec > class_ts.tv_nsec))
+            wake = class_ts;
+        ret = pthread_cond_timedwait(&thread_cond, &mutex, &wake);
+        if (ret == ETIMEDOUT && wake.tv_sec == class_ts.tv_sec &&
+            wake.tv_nsec == class_ts.tv_nsec) {
+            BTHSERR("%s: class %d turn timed out", __FUNCTION__, cmdClass);
+            bt_vendor_stats_record(c->stats_id, submit_us, 1);
+            retVal = HCI_CMD_STATUS_CLASS_TIMEOUT;
+            goto exit_release;
+        }
+    }
+
+    c->tokens--;
+    c->waiting--;
+    c->outstanding++;
+    queued = false;
+    if (aged) {
+        c->aged--;
+        aged = false;
+        pthread_cond_broadcast(&thread_cond);
+    }
+    bt_vendor_stats_record(c->stats_id, submit_us, 0);
+
+    memset(slot, 0, sizeof(*slot));
+    slot->in_use = true;
+    slot->opcode = opcode;
+    slot->seq = cmd_seq++;
+    slot->p_cback = p_cback;
+    slot->user_data = user_data;
+    slot->cls = cmdClass;
+    hci_cmd_deadline(&slot->deadline);
+    slot->sent_us = bt_vendor_stats_now();
+    if (shadow) {
+        slot->shadowed = true;
+        slot->plen = plen;
+        memcpy(slot->params, pcmdBuf + HCI_CMD_PREAMBLE_SIZE, plen);
+    }
+
+    bt_vendor_trace(TRACE_HCI_COMMAND, p, length);
+    ATRACE_ASYNC_BEGIN(HCI_CMD_TRACE_NAME, slot->seq);
+
+    // Send the HCI command. The slot is marked as sent beforehand so that
+    // an immediate completion finds it.
+    slot->sent = true;
+    cmd_outstanding++;
+    if (bt_vendor_callbacks->xmit_cb(opcode, p_msg, hci_cmd_cback) == FALSE) {
+        BTHSERR("%s: failed to xmit buffer.", __FUNCTION__);
+        ATRACE_ASYNC_END(HCI_CMD_TRACE_NAME, slot->seq);
+        hci_cmd_class_done_locked(slot);
+        slot->in_use = false;
+        cmd_outstanding--;
+        retVal = BTCELLCOEX_STATUS_UNKNOWN_ERROR;
+        goto exit_release;
+    }
+
+    // The expiry thread may sleep past this deadline
+    if (p_cback)
+        pthread_cond_signal(&expire_cond);
+
+    *pp_slot = slot;
+    goto exit_unlock;
+
+exit_release:
+    if (shadow)
+        shadow->pending--;
+    if (aged)
+        c->aged--;
+    if (queued) {
+        c->waiting--;
+        hci_cmd_class_depth_locked(c);
+        // Background senders may have waited for this one
+        pthread_cond_broadcast(&thread_cond);
+    }
+exit_dealloc:
+    bt_vendor_callbacks->dealloc(p_msg);
+exit_unlock:
+    if ((ret = pthread_mutex_unlock(&mutex)) != 0) {
+        BTHSERR("%s: pthread_mutex_unlock failed: %s", __FUNCTION__, strerror(ret));
+        retVal = BTCELLCOEX_STATUS_UNKNOWN_ERROR;
+    }
+
+    for (i = 0; i < num_expired; i++)
+        expired[i].p_cback(BTCELLCOEX_STATUS_UNKNOWN_ERROR, expired[i].user_data);
+
+    if (local_done && p_cback)
+        p_cback(BTCELLCOEX_STATUS_OK, user_data);
+
+    return retVal;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_send
+**
+** Description     Send an urgent HCI command and wait for its completion
+**
+** Returns          BTCELLCOEX_STATUS_* as hci_cmd_send_class
+**
+*******************************************************************************/
+int hci_cmd_send(const size_t cmdLen, const void* cmdBuf)
+{
+    return hci_cmd_send_class(cmdLen, cmdBuf, HCI_CMD_CLASS_URGENT);
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_send_class
+**
+** Description     Send an HCI command of a scheduling class and wait for its
+**                 completion. Several senders may have commands in flight
+**                 at the same time.
+**
+** Returns          BTCELLCOEX_STATUS_OK on success
+**                  BTCELLCOEX_STATUS_INVALID_OPERATION if the service if not ready
+**                  BTCELLCOEX_STATUS_BAD_VALUE on invalid parameters
+**                  BTCELLCOEX_STATUS_UNKNOWN_ERROR on internal software issues
+**                  BTCELLCOEX_STATUS_CMD_FAILED on HCI transmission failures
+**                  HCI_CMD_STATUS_CLASS_TIMEOUT if the class turn never came
+**
+*******************************************************************************/
+int hci_cmd_send_class(const size_t cmdLen, const void* cmdBuf, int cmdClass)
+{
+    int ret = 0;
+    int retVal;
+    tHCI_CMD_SLOT *slot = NULL;
+
+    BTHSDBG("%s", __FUNCTION__);
+
+    if (!hci_service_enter())
+        return BTCELLCOEX_STATUS_INVALID_OPERATION;
+
+    retVal = hci_cmd_submit(cmdLen, cmdBuf, cmdClass, NULL, NULL, &slot);
+
+    // Failed or completed locally, nothing was sent
+    if (retVal != BTCELLCOEX_STATUS_OK || !slot) {
+        hci_service_leave();
+        return retVal;
+    }
+
+    if ((ret = pthread_mutex_lock(&mutex)) != 0) {
+        BTHSERR("%s: pthread_mutex_lock failed: %s", __FUNCTION__, strerror(ret));
+        hci_service_leave();
+        return BTCELLCOEX_STATUS_UNKNOWN_ERROR;
+    }
+
+    ret = 0;
+    while (!slot->done && ret == 0)
+        ret = pthread_cond_timedwait(&thread_cond, &mutex, &slot->deadline);
+    if (slot->done) {
+        BTHSVERB("%s: pthread_cond_timedwait succeed", __FUNCTION__);
+        retVal = slot->status;
+    } else {
+        BTHSERR("%s: pthread_cond_timedwait failed: %s", __FUNCTION__, strerror(ret));
+        hci_cmd_stale_add_locked(slot);
+        retVal = BTCELLCOEX_STATUS_UNKNOWN_ERROR;
+    }
+    slot->in_use = false;
+    pthread_cond_broadcast(&thread_cond);
+
+    if (retVal == BTCELLCOEX_STATUS_OK) {
         BTHSVERB("%s: HCI command succeed", __FUNCTION__);
-        retVal = BTCELLCOEX_STATUS_OK;
     } else {
         BTHSERR("%s: HCI command failed", __FUNCTION__);
-        retVal = BTCELLCOEX_STATUS_CMD_FAILED;
     }
 
-exit_unlock:
     if ((ret = pthread_mutex_unlock(&mutex)) != 0) {
         BTHSERR("%s: pthread_mutex_unlock failed: %s", __FUNCTION__, strerror(ret));
         retVal = BTCELLCOEX_STATUS_UNKNOWN_ERROR;
     }
+
+    hci_service_leave();
+    return retVal;
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_send_async
+**
+** Description     Send an urgent HCI command without waiting for its
+**                 completion, see hci_cmd_send_async_class
+**
+** Returns          BTCELLCOEX_STATUS_* as hci_cmd_send for the submission
+**
+*******************************************************************************/
+int hci_cmd_send_async(const size_t cmdLen, const void* cmdBuf,
+                       tHCI_CMD_COMPLETE_CBACK p_cback, void *user_data)
+{
+    return hci_cmd_send_async_class(cmdLen, cmdBuf, HCI_CMD_CLASS_URGENT,
+                                    p_cback, user_data);
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_send_async_class
+**
+** Description     Send an HCI command of a scheduling class without waiting
+**                 for its completion. p_cback is called with the command
+**                 status once the command completed, or from the expiry
+**                 thread once it timed out. It is not called when the
+**                 submission itself fails.
+**
+** Returns          BTCELLCOEX_STATUS_* as hci_cmd_send for the submission
+**
+*******************************************************************************/
+int hci_cmd_send_async_class(const size_t cmdLen, const void* cmdBuf, int cmdClass,
+                             tHCI_CMD_COMPLETE_CBACK p_cback, void *user_data)
+{
+    tHCI_CMD_SLOT *slot = NULL;
+    int retVal;
+
+    BTHSDBG("%s", __FUNCTION__);
+
+    if (!p_cback) {
+        BTHSERR("%s: null completion callback passed!", __FUNCTION__);
+        return BTCELLCOEX_STATUS_BAD_VALUE;
+    }
+
+    if (!hci_service_enter())
+        return BTCELLCOEX_STATUS_INVALID_OPERATION;
+
+    retVal = hci_cmd_submit(cmdLen, cmdBuf, cmdClass, p_cback, user_data, &slot);
+
+    hci_service_leave();
     return retVal;
 }
 
 
+/*******************************************************************************
+**
+** Function         hci_cmd_batch_cback
+**
+** Description     Completion of one command of a batch, wakes up the
+**                 batch sender once the last command completed
+**
+** Returns          None
+**
+*******************************************************************************/
+static void hci_cmd_batch_cback(int status, void *user_data)
+{
+    tHCI_CMD_BATCH_ENTRY *entry = (tHCI_CMD_BATCH_ENTRY *) user_data;
+
+    pthread_mutex_lock(&mutex);
+    *entry->p_status = status;
+    if (--entry->batch->remaining == 0)
+        pthread_cond_broadcast(&thread_cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+/*******************************************************************************
+**
+** Function         hci_cmd_send_batch
+**
+** Description     Send several HCI commands back to back and wait once for
+**                 all of them to complete. All the commands are validated
+**                 before any is sent.
+**
+** Returns          BTCELLCOEX_STATUS_OK when the batch was processed, the
+**                  status of each command is then stored in statuses.
+**                  BTCELLCOEX_STATUS_BAD_VALUE if a command is invalid, no
+**                  command is sent in this case.
+**                  BTCELLCOEX_STATUS_INVALID_OPERATION if the service if not ready
+**                  BTCELLCOEX_STATUS_UNKNOWN_ERROR on internal software issues
+**
+*******************************************************************************/
+int hci_cmd_send_batch(const size_t numCmds, const size_t *cmdLens,
+                       const void * const *cmdBufs, int *statuses)
+{
+    tHCI_CMD_BATCH batch;
+    tHCI_CMD_BATCH_ENTRY entries[HCI_CMD_BATCH_MAX];
+    tHCI_CMD_SLOT expired[HCI_CMD_QUEUE_SIZE];
+    tHCI_CMD_SLOT *slot;
+    struct timespec ts;
+    size_t i, j;
+    int n, ret;
+
+    BTHSDBG("%s: %zu commands", __FUNCTION__, numCmds);
+
+    if (!cmdLens || !cmdBufs || !statuses || numCmds > HCI_CMD_BATCH_MAX) {
+        BTHSERR("%s: invalid batch!", __FUNCTION__);
+        return BTCELLCOEX_STATUS_BAD_VALUE;
+    }
+
+    if (!hci_service_enter())
+        return BTCELLCOEX_STATUS_INVALID_OPERATION;
+
+    for (i = 0; i < numCmds; i++) {
+        if ((ret = hci_cmd_validate(cmdLens[i], cmdBufs[i])) != BTCELLCOEX_STATUS_OK) {
+            BTHSERR("%s: command %zu rejected", __FUNCTION__, i);
+            hci_service_leave();
+            return ret;
+        }
+    }
+
+    batch.remaining = numCmds;
+
+    for (i = 0; i < numCmds; i++) {
+        entries[i].batch = &batch;
+        entries[i].p_status = &statuses[i];
+
+        // Only the last state of a coex configuration is sent
+        for (j = i + 1; j < numCmds; j++) {
+            if (hci_cmd_collapse(cmdBufs[i], cmdBufs[j]))
+                break;
+        }
+        if (j < numCmds) {
+            pthread_mutex_lock(&mutex);
+            statuses[i] = BTCELLCOEX_STATUS_OK;
+            batch.remaining--;
+            pthread_mutex_unlock(&mutex);
+            continue;
+        }
+
+        ret = hci_cmd_submit(cmdLens[i], cmdBufs[i], HCI_CMD_CLASS_URGENT,
+                             hci_cmd_batch_cback, &entries[i], &slot);
+        if (ret != BTCELLCOEX_STATUS_OK) {
+            // Never submitted, the callback won't be called
+            pthread_mutex_lock(&mutex);
+            statuses[i] = ret;
+            batch.remaining--;
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+
+    // Every submitted command reports once, either completed or expired,
+    // entries must stay valid until then.
+    pthread_mutex_lock(&mutex);
+    hci_cmd_deadline(&ts);
+    while (batch.remaining > 0) {
+        ret = pthread_cond_timedwait(&thread_cond, &mutex, &ts);
+        if (ret != ETIMEDOUT)
+            continue;
+
+        n = hci_cmd_expire_locked(expired);
+        if (n > 0) {
+            pthread_mutex_unlock(&mutex);
+            while (n-- > 0)
+                expired[n].p_cback(BTCELLCOEX_STATUS_UNKNOWN_ERROR, expired[n].user_data);
+            pthread_mutex_lock(&mutex);
+        }
+        hci_cmd_deadline(&ts);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    hci_service_leave();
+    return BTCELLCOEX_STATUS_OK;
+}
+
+
 #if (BTHCISERVICE_VERB == TRUE)
 /*******************************************************************************
 **
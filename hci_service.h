@@ -0,0 +1,104 @@
+/******************************************************************************
+ *
+ *  Copyright (C) Intel 2014
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ *
+ *  Filename:   hci_service.h
+ *
+ *  Description:    HCI service gateway interface, see hci_service.c
+ *
+ ******************************************************************************/
+
+#ifndef HCI_SERVICE_H
+#define HCI_SERVICE_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************
+**  Type definitions
+******************************************************************************/
+
+/* Completion of an asynchronous HCI command, status is a BTCELLCOEX_STATUS_* */
+typedef void (*tHCI_CMD_COMPLETE_CBACK)(int status, void *user_data);
+
+/*
+ * Scheduling classes of the coex commands. Urgent commands go first, each
+ * class has a budget of commands handed to the stack command queue.
+ */
+typedef enum {
+    HCI_CMD_CLASS_URGENT,
+    HCI_CMD_CLASS_BACKGROUND,
+    HCI_CMD_CLASS_MAX
+} tHCI_CMD_CLASS;
+
+/*
+ * Returned instead of a BTCELLCOEX_STATUS_* when a command did not get the
+ * turn of its class in time, it was never handed to the stack
+ */
+#define HCI_CMD_STATUS_CLASS_TIMEOUT    (-ETIMEDOUT)
+
+/******************************************************************************
+**  Functions
+******************************************************************************/
+
+void hci_bind_client_init(void);
+void hci_bind_client_cleanup(void);
+
+/* Coex service availability notification, retries a pending binding now */
+void hci_bind_client_notify(void);
+
+/* Shared memory command ring, see hci_cmd_ring.h */
+void hci_cmd_ring_init(void);
+void hci_cmd_ring_cleanup(void);
+
+/* Blocking submission, returns once the command completed or timed out */
+int hci_cmd_send(const size_t cmdLen, const void* cmdBuf);
+int hci_cmd_send_class(const size_t cmdLen, const void* cmdBuf, int cmdClass);
+
+/* Asynchronous submission, p_cback is called from the completion context */
+int hci_cmd_send_async(const size_t cmdLen, const void* cmdBuf,
+                       tHCI_CMD_COMPLETE_CBACK p_cback, void *user_data);
+int hci_cmd_send_async_class(const size_t cmdLen, const void* cmdBuf, int cmdClass,
+                             tHCI_CMD_COMPLETE_CBACK p_cback, void *user_data);
+
+/* Controller capabilities read at FW_CFG, NULL when unknown */
+struct hci_caps;
+void hci_cmd_set_caps(const struct hci_caps *caps);
+
+/* Command buffers served by the pool (hits) or the stack allocator (misses) */
+void hci_cmd_pool_stats(uint32_t *hits, uint32_t *misses);
+
+/* Timeout of the commands sent now, late completions dropped so far */
+void hci_cmd_timeout_stats(uint32_t *timeout_ms, uint32_t *stale_drops);
+
+/* Coex configuration commands completed without being sent */
+void hci_cmd_shadow_stats(uint32_t *hits, uint32_t *collapsed);
+
+/* Deepest queue, waiting plus in flight, and submissions held by the budget */
+void hci_cmd_class_stats(int cmdClass, uint32_t *max_depth, uint32_t *throttled);
+
+/* Non zero if laterBuf, queued after cmdBuf, makes sending cmdBuf useless */
+int hci_cmd_collapse(const void *cmdBuf, const void *laterBuf);
+
+/* Batched submission, statuses receives one BTCELLCOEX_STATUS_* per command */
+int hci_cmd_send_batch(const size_t numCmds, const size_t *cmdLens,
+                       const void * const *cmdBufs, int *statuses);
+
+#endif /* HCI_SERVICE_H */